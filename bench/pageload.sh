@@ -0,0 +1,86 @@
+#!/bin/sh
+# Copyright 2020, JP Norair
+#
+# Redistribution and use in source and binary forms, with or without 
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, 
+#    this list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright 
+#    notice, this list of conditions and the following disclaimer in the 
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+# POSSIBILITY OF SUCH DAMAGE.
+
+# Page-load benchmark of wfedd, over HTTP/1.1 and HTTP/2.
+#
+# usage: bench/pageload.sh [url] [runs]
+#
+# The page and the resources that it references are loaded the way a browser
+# loads them: in parallel, on up to 6 connections with HTTP/1.1, or on one 
+# multiplexed connection with HTTP/2.  Each run starts without connections, 
+# like a new page load.  The mean load time, and the connections (TLS 
+# handshakes) that were opened, are reported for each protocol.  Browsers 
+# only use HTTP/2 over TLS, so wfedd must be run with --tls.  Needs a curl 
+# with HTTP/2 (curl -V lists "HTTP2").
+
+URL=${1:-https://localhost:7681/}
+RUNS=${2:-10}
+CONNS=6
+
+case "$URL" in
+    */) BASE=$URL ;;
+    *)  BASE=${URL%/*}/ ;;
+esac
+ORIGIN=$(printf '%s\n' "$URL" | sed -e 's|^\([a-z]*://[^/]*\).*|\1|')
+
+# Resources of the page: src and href attributes on the same origin
+PAGE=$(curl -sk "$URL") || { echo "Error: could not load $URL"; exit 1; }
+ASSETS=$(printf '%s\n' "$PAGE" \
+    | grep -o -E '(src|href)="[^"]+"' \
+    | sed -e 's/^[a-z]*="//' -e 's/"$//' \
+    | grep -v -E '^([a-z]+:|//|#)' \
+    | while read -r ref; do
+        case "$ref" in
+            /*) printf '%s%s\n' "$ORIGIN" "$ref" ;;
+            *)  printf '%s%s\n' "$BASE" "${ref#./}" ;;
+        esac
+    done | sort -u)
+
+ARGS="-o /dev/null $URL"
+for a in $ASSETS; do
+    ARGS="$ARGS -o /dev/null $a"
+done
+
+echo "$URL: $(printf '%s\n' $URL $ASSETS | wc -l) requests, $RUNS runs"
+printf '%-10s %10s %12s %10s\n' "protocol" "load (ms)" "handshakes" "version"
+
+for proto in --http1.1 --http2; do
+    total=0
+    conns=0
+    version=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        t0=$(date +%s%N)
+        out=$(curl -sk --no-progress-meter $proto --parallel --parallel-max $CONNS \
+                -w '%{num_connects} %{http_version}\n' $ARGS)
+        t1=$(date +%s%N)
+        total=$((total + (t1 - t0) / 1000))
+        conns=$((conns + $(printf '%s\n' "$out" | awk '{ n += $1 } END { print n+0 }')))
+        version=$(printf '%s\n' "$out" | awk '{ print $2 }' | sort -u | tr '\n' ' ' | sed -e 's/ $//')
+        i=$((i + 1))
+    done
+    awk -v p="${proto#--}" -v t=$total -v c=$conns -v r="$RUNS" -v v="$version" \
+        'BEGIN { printf "%-10s %10.1f %12.1f %10s\n", p, t / r / 1000, c / r, v }'
+done
@@ -0,0 +1,258 @@
+/*  Copyright 2020, JP Norair
+  *
+  * Redistribution and use in source and binary forms, with or without 
+  * modification, are permitted provided that the following conditions are met:
+  *
+  * 1. Redistributions of source code must retain the above copyright notice, 
+  *    this list of conditions and the following disclaimer.
+  *
+  * 2. Redistributions in binary form must reproduce the above copyright 
+  *    notice, this list of conditions and the following disclaimer in the 
+  *    documentation and/or other materials provided with the distribution.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+  * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+  * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+  * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+  * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+  * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+  * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+  * POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef assets_h
+#define assets_h
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/// Content codings of an asset.  Compressed bodies are loaded from sidecar 
+/// files (".gz", ".br") next to the file, or gzip is built when the file is 
+/// loaded.  Responses are never compressed on the fly.
+typedef enum {
+    ASSET_IDENTITY  = 0,
+    ASSET_GZIP      = 1,
+    ASSET_BR        = 2,
+    ASSET_ENCODINGS
+} asset_enc_t;
+
+
+/// A body is stored in chunks, and each chunk has LWS_PRE bytes of headroom
+/// ahead of it, so it can be passed to lws_write() as it is.  A coding that 
+/// is not available has no chunks.
+typedef struct {
+    size_t          size;       // bytes in body
+    size_t          nchunks;
+    uint8_t**       chunk;      // each has LWS_PRE bytes of headroom
+} asset_body_t;
+
+
+/// A cached file of the mount origin, with a body for each content coding.
+/// An asset is shared by the responses that are sending it: assets_get() adds
+/// a reference, and assets_put() drops one.  An asset that is evicted or 
+/// invalidated while it is being sent is freed by the last assets_put().
+typedef struct asset {
+    struct asset*   hnext;      // hash chain
+    struct asset*   prev;       // LRU list, most recent first
+    struct asset*   next;
+    char*           path;       // relative to the origin
+    uint32_t        hash;
+    const char*     mimetype;
+    const char*     cachecontrol;
+    time_t          mtime;      // Last-Modified
+    uint64_t        etaghash;   // content hash, that the ETags are made from
+    char            etag[ASSET_ENCODINGS][24];  // strong, from the content
+    bool            bundled;    // bodies are in a bundle, not allocated
+    size_t          bytes;      // bytes in all bodies
+    asset_body_t    body[ASSET_ENCODINGS];
+    unsigned int    refs;       // 1 while cached, +1 per response
+} asset_t;
+
+
+/// Return values of assets_get(), besides 0 for success.  An uncached file is
+/// readable, but it is too large for the cache, so it is served from the 
+/// filesystem.
+#define ASSETS_NOTFOUND     (-1)
+#define ASSETS_FORBIDDEN    (-2)
+#define ASSETS_UNCACHED     (1)
+
+
+typedef struct {
+    size_t          cap;            // byte limit of cached files
+    size_t          bytes;          // bytes of cached files
+    size_t          entries;        // files cached
+    unsigned long   hits;           // served from memory
+    unsigned long   misses;         // not cached at the request
+    unsigned long   loads;          // files read into the cache
+    unsigned long   evictions;      // files dropped to make room
+    unsigned long   invalidations;  // files dropped after they changed
+    unsigned long   uncached;       // served from the filesystem
+    unsigned long   sidecars;       // compressed bodies loaded from files
+    unsigned long   built;          // gzip bodies built at load
+    unsigned long   sent[ASSET_ENCODINGS];  // responses by coding
+    unsigned long   notmodified;    // answered with 304
+    bool            watching;       // changes are being watched
+} assets_stat_t;
+
+
+
+/** @brief Opens the asset cache on a mount origin
+ *  @param origin       (const char*) directory of the mount origin
+ *  @param cap          (size_t) byte limit of cached files
+ *  @param preload      (bool) load the origin into the cache now
+ *  @param maxage       (unsigned int) browser cache lifetime, in seconds, of
+ *                      files that aren't fingerprinted.  0 revalidates.
+ *  @retval (int)       0 on success, negative on failure
+ *
+ *  Files are loaded on first use unless preload is set.  When the cache is 
+ *  full, the least recently used files are evicted.  On Linux, the directories
+ *  of the origin are watched with inotify, and a file that changes is dropped 
+ *  from the cache, so it is loaded again by the next request.
+ */
+int assets_init(const char* origin, size_t cap, bool preload, unsigned int maxage);
+
+/** @brief Opens the asset cache on a bundle, instead of a mount origin
+ *  @param path         (const char*) bundle file, from assets_pack()
+ *  @param maxage       (unsigned int) as for assets_init()
+ *  @retval (int)       0 on success, negative on failure
+ *
+ *  The bundle is mapped into memory, and its index is read once.  Requests
+ *  are then served from the mapping, with the MIME types, ETags, and 
+ *  compressed bodies that were stored in it, and no filesystem calls.  A file
+ *  that isn't in the bundle is not found.
+ */
+int assets_openbundle(const char* path, unsigned int maxage);
+
+/** @brief Packs a mount origin into a bundle file
+ *  @param origin       (const char*) directory of the mount origin
+ *  @param path         (const char*) bundle file to write
+ *  @retval (int)       files packed, or negative on failure
+ *
+ *  Each file is stored with its compressed bodies, as the cache would load
+ *  them.  Files that are too large for the cache are left out.  The cache 
+ *  must not be open.
+ */
+int assets_pack(const char* origin, const char* path);
+
+/** @brief Closes the asset cache, and frees the files that aren't in use
+ *  @retval None
+ */
+void assets_deinit(void);
+
+/** @brief Tests if the asset cache is open
+ *  @retval (bool)      true after a successful assets_init()
+ */
+bool assets_isopen(void);
+
+/** @brief Gets the directory of the mount origin
+ *  @retval (const char*) origin, without a trailing '/'
+ */
+const char* assets_origin(void);
+
+/** @brief Gets a file from the cache, loading it if needed
+ *  @param path         (const char*) path of the file, relative to the origin
+ *  @param asset        (asset_t**) output, the referenced asset on success
+ *  @retval (int)       0 on success, else ASSETS_NOTFOUND, ASSETS_FORBIDDEN, 
+ *                      or ASSETS_UNCACHED
+ *
+ *  Paths that contain ".." segments, and files of an unknown type, are 
+ *  forbidden.  The asset must be returned with assets_put().
+ */
+int assets_get(const char* path, asset_t** asset);
+
+/** @brief Drops a reference to an asset, from assets_get()
+ *  @retval None
+ */
+void assets_put(asset_t* asset);
+
+/** @brief Picks the coding of an asset to send, by Accept-Encoding
+ *  @param asset        (asset_t*) asset from assets_get(), or NULL
+ *  @param path         (const char*) path of the file, if asset is NULL
+ *  @param accept       (const char*) Accept-Encoding header, or NULL
+ *  @retval (asset_enc_t) coding to send
+ *
+ *  br is preferred over gzip, which is preferred over identity.  Codings with
+ *  q=0 are refused.  If asset is NULL, the sidecar files of path are tested 
+ *  instead, which is for files that are served from the filesystem.
+ */
+asset_enc_t assets_select(asset_t* asset, const char* path, const char* accept);
+
+/** @brief Gets the name of a content coding
+ *  @param enc          (asset_enc_t) coding
+ *  @retval (const char*) name for Content-Encoding, or NULL for identity
+ */
+const char* assets_encname(asset_enc_t enc);
+
+/** @brief Gets the Cache-Control policy of a file
+ *  @param path         (const char*) path of the file, relative to the origin
+ *  @retval (const char*) Cache-Control value
+ *
+ *  Fingerprinted files, which have a content hash after the first part of
+ *  their name (such as "app.3f9a0c1d.js"), are immutable.  Other files have
+ *  the max-age that was given to assets_init(), or are revalidated on each 
+ *  use.
+ */
+const char* assets_cachecontrol(const char* path);
+
+/** @brief Tests the conditional headers of a request against a response
+ *  @param etag         (const char*) ETag of the response, or NULL
+ *  @param mtime        (time_t) Last-Modified of the response
+ *  @param ifnonematch  (const char*) If-None-Match header, or NULL
+ *  @param ifmodsince   (const char*) If-Modified-Since header, or NULL
+ *  @retval (bool)      true if the client has it, so 304 can be sent
+ *
+ *  If-Modified-Since is only used without If-None-Match (RFC 7232, 6).
+ *  The 304 is counted.
+ */
+bool assets_notmodified(const char* etag, time_t mtime, const char* ifnonematch, const char* ifmodsince);
+
+/** @brief Formats an HTTP-date
+ *  @param t            (time_t) time to format
+ *  @param buf          (char*) output
+ *  @param size         (size_t) bytes in buf
+ *  @retval (int)       characters written
+ */
+int assets_httpdate(time_t t, char* buf, size_t size);
+
+/** @brief Gets the file extension of a sidecar of a content coding
+ *  @param enc          (asset_enc_t) coding
+ *  @retval (const char*) ".gz", ".br", or "" for identity
+ */
+const char* assets_encext(asset_enc_t enc);
+
+/** @brief Gets the chunk of an asset body that holds a byte offset
+ *  @param asset        (asset_t*) asset from assets_get()
+ *  @param enc          (asset_enc_t) coding, from assets_select()
+ *  @param offset       (size_t) byte offset in the body
+ *  @param len          (size_t*) output, bytes from offset to end of chunk
+ *  @retval (uint8_t*)  data at offset
+ *
+ *  The LWS_PRE bytes ahead of the data may be written by lws_write() only 
+ *  when offset is the start of a chunk, which it is when whole chunks are 
+ *  written.
+ */
+uint8_t* assets_chunk(asset_t* asset, asset_enc_t enc, size_t offset, size_t* len);
+
+/** @brief Processes the pending file change events
+ *  @retval None
+ *
+ *  This is called from the service loop.  It does not block, and it reads 
+ *  the events at most once per WFEDD_PARAM_ASSET_INTERVAL.
+ */
+void assets_service(void);
+
+/** @brief Copies the cache counters
+ *  @param stats        (assets_stat_t*) output
+ *  @retval None
+ */
+void assets_getstats(assets_stat_t* stats);
+
+
+#endif
@@ -39,6 +39,98 @@
 
 
 
+/// This is a connection to a backend client socket from a frontend websocket.
+/// Daemons are expected to be able to handle multiple client connections.
+/// A connection is stored inline in the per-session data of its websocket, 
+/// and the backend keeps a table of the live ones.  The members are private 
+/// to the backend: use the conn_...() functions.
+typedef enum {
+    CONN_IDLE = 0,
+    CONN_CONNECTING,
+    CONN_OPEN,
+    CONN_ENDED          // a multiplexed daemon closed the channel
+} conn_state;
+
+/// Token buckets limit the rate of messages from the websockets, by messages
+/// and by bytes per second.  Each session has a pair, and so does each 
+/// mapping, for all of its sessions.
+typedef struct bucket {
+    int64_t         tokens;     // millionths of a message or byte, may be < 0
+    uint64_t        stamp;      // time of the last refill (us), 0 = full
+} bucket_t;
+
+typedef struct rxlimit {
+    bucket_t        msgs;
+    bucket_t        bytes;
+} rxlimit_t;
+
+typedef struct conn {
+    int             fd_ds;
+    int             state;      // conn_state
+    uint64_t        deadline;   // time (ms) when a pending connect fails
+    sockmap_t*      sock_handle;
+    struct backend* backend;
+    struct govern*  mapgov;
+    struct mapstat* mapstat;
+    size_t          slot;       // slot in the connection table
+    uint32_t        id;         // generation tag, 0 when not in the table
+    size_t          rdsize;     // current size of a read from the daemon
+    unsigned int    rdsmall;    // run of reads much smaller than rdsize
+    
+    // Framing of the daemon stream into messages.  fbuf is NULL for raw and
+    // seqpacket framing, which read straight into the web queue.
+    mq_msg_t*       fbuf;       // staging buffer for unframed data
+    size_t          fhead;      // start of unframed data
+    size_t          fscan;      // where the delimiter scan resumes
+    size_t          ftail;      // end of unframed data
+    size_t          fskip;      // bytes left to discard of an oversize message,
+                                // or nonzero until the next delimiter
+    size_t          fwant;      // size of a message waiting for queue room
+    size_t          fremain;    // bytes left of a streamed, prefixed message
+    struct conn*    fdest;      // subscriber that fwant is waiting for (mux)
+    bool            fstream;    // a message larger than msgmax is streaming
+    bool            fcont;      // a fragment of that message is queued
+    unsigned long   fdrops;     // oversize messages discarded
+    
+    // Coalescing of queued messages into one websocket frame.  cbuf is NULL
+    // unless the mapping enables it.
+    mq_msg_t*       cbuf;       // frame buffer, with LWS_PRE headroom
+    uint64_t        cstamp;     // time (us) the oldest queued message arrived
+    size_t          cmsgs;      // messages in the frame last peeked
+    uint32_t        cflags;     // fragment flags of the frame last peeked
+    bool            cheld;      // the queue was held back to coalesce
+    
+    // Fan-out: the hub of a mapping owns the daemon connection, and its 
+    // subscribers are the sessions.  The web queue of a subscriber holds 
+    // references to messages that are shared by all subscribers, and it has
+    // no daemon socket or local queue of its own.  hub is NULL otherwise.
+    // A multiplexed hub routes each message to the web queue of the 
+    // subscriber whose ID is the channel of the message, and it wakes the
+    // websocket of that subscriber.
+    struct hub*     hub;
+    size_t          subslot;    // slot in the subscriber list of the hub
+    struct lws*     wsi;        // websocket of a session, or NULL
+    
+    // Slow-consumer policy of the mapping, applied when the web queue of a
+    // session is above the high-water mark.
+    bool            sblocked;   // the daemon is paused for this session
+    bool            sclose;     // the session is closing for being too slow
+    
+    // Conflation: the web queue of a conflating session holds references, 
+    // and the key table finds the queued message of each key.  ktab is NULL
+    // unless the mapping conflates.
+    struct ckey*    ktab;
+    size_t          kmask;      // slots in ktab, less 1
+    
+    // Rate limits of messages from the websocket: the buckets of the session
+    // and of its mapping, and the time (us) it may receive again.
+    rxlimit_t       rx;
+    rxlimit_t*      maprx;
+    uint64_t        rxuntil;
+    mq_t            mqweb;
+    mq_t            mqlocal;
+} conn_t;
+
 
 
 int backend_run(socklist_t* socklist,
@@ -53,28 +145,119 @@ int backend_run(socklist_t* socklist,
                 struct lws_protocols* protocols,
                 struct lws_http_mount* mount
                 );
+
+/// backend_getmap() returns the mapping of a websocket protocol, or NULL.
+sockmap_t* backend_getmap(void* backend_handle, const char* ws_name);
                 
 
-void* conn_new(void* backend_handle, const char* ws_name);
+/// conn_new() initializes a connection in storage provided by the caller, and
+/// returns it, or NULL on failure.  conn_close() and conn_del() may be called
+/// more than once on the same connection.
+void* conn_new(void* backend_handle, conn_t* conn, const char* ws_name);
 void conn_del(void* backend_handle, void* conn_handle);
+
+/// conn_open() connects to the daemon without blocking.  It returns 0 when 
+/// connected, 1 while the connect is pending, and negative when it failed: 
+/// -1 on error, -2 on timeout.  A pending connect is completed by calling 
+/// conn_open() again, until it is connected or the mapping's timeout passes.
 int conn_open(void* conn_handle);
 void conn_close(void* conn_handle);
 
-int conn_readraw_local(void** data, void* backend_handle, void* conn_handle);
-int conn_writeraw_local(void* backend_handle, void* conn_handle, void* data, size_t len);
+/// conn_readraw_local() reads from the non-blocking daemon socket until it 
+/// would block, the web queue is full, a governor throttles, or the fairness
+/// budget of one call is used.  It returns the bytes read, 0 on EOF, or a
+/// negative value if nothing was read: -2 no room (or throttled), -3 would 
+/// block, -4 read error.  The data is framed into messages by the framing 
+/// mode of the mapping, and each message is queued with conn_putmsg_forweb().
+/// conn_framemsg_forweb() queues messages that are already read, but that 
+/// were waiting for room in the queue, and returns how many were queued.
+int conn_readraw_local(void* backend_handle, void* conn_handle);
+int conn_framemsg_forweb(void* conn_handle);
+
+/// conn_writeraw_local() writes the messages queued for the daemon with one 
+/// gathered write, and keeps any unwritten bytes queued.  It returns the 
+/// bytes written, or a negative value if nothing was written: -2 nothing 
+/// queued, -3 would block, -4 write error.
+int conn_writeraw_local(void* backend_handle, void* conn_handle);
 
 lws_adoption_type conn_get_adoptiontype(void* conn_handle);
 int conn_get_descriptor(void* conn_handle);
 const char* conn_get_protocolname(void* conn_handle);
+const char* conn_get_wsname(void* conn_handle);
 
+/// In a fan-out or multiplexed mapping, each session is a subscriber to the 
+/// hub connection of the mapping, which is shared.  conn_get_upstream() 
+/// returns the connection that owns the daemon socket: the hub for a 
+/// subscriber, NULL if the hub is closed, or else the connection itself.  The
+/// functions that act on the daemon socket and the local queue act on the 
+/// upstream connection, and conn_close() of a subscriber does nothing.
+void* conn_get_upstream(void* conn_handle);
+bool conn_isshared(void* conn_handle);
 
+/// conn_set_websocket() gives a session's websocket to its connection, which
+/// a multiplexed hub wakes when it routes a message to the session.  
+/// conn_isended() is true when a multiplexed daemon has closed the channel of
+/// the session: the websocket should be closed after its queue is written.
+/// conn_isslow() is true when the session fell behind a mapping with the close
+/// policy: the websocket should be closed at once.
+void conn_set_websocket(void* conn_handle, struct lws* wsi);
+bool conn_isended(void* conn_handle);
+bool conn_isslow(void* conn_handle);
+
+
+/// Each connection has a bounded queue in each direction.  A message is 
+/// consumed by peeking at it, using the data in place, and then popping it.
+/// The forweb data is preceded by LWS_PRE bytes of writable headroom.
 int conn_putmsg_forweb(void* conn_handle, void* data, size_t len);
-mq_msg_t* conn_getmsg_forweb(void* conn_handle);
+void* conn_peekmsg_forweb(void* conn_handle, size_t* len);
+void conn_popmsg_forweb(void* conn_handle);
 bool conn_hasmsg_forweb(void* conn_handle);
+bool conn_hasroom_forweb(void* conn_handle);
+
+/// A frame for the websocket is the oldest queued message or, when the mapping
+/// coalesces, as many of the oldest messages as fit in its byte budget.  With
+/// newline or nul framing, each coalesced message ends with its delimiter.
+/// conn_holdus_forweb() returns how long (us) the queue may still be held to
+/// coalesce more messages, or 0 when it should be written now.
+void* conn_peekframe_forweb(void* conn_handle, size_t* len);
+void conn_popframe_forweb(void* conn_handle);
+long conn_holdus_forweb(void* conn_handle);
 
 int conn_putmsg_forlocal(void* conn_handle, void* data, size_t len);
-mq_msg_t* conn_getmsg_forlocal(void* conn_handle);
+void* conn_peekmsg_forlocal(void* conn_handle, size_t* len);
+void conn_popmsg_forlocal(void* conn_handle);
 bool conn_hasmsg_forlocal(void* conn_handle);
+bool conn_hasroom_forlocal(void* conn_handle, size_t len);
+
+/// conn_get_writeprotocol() returns the websocket opcode for a frame to the 
+/// browser, by the payload mode of the mapping, and for a fragment of a 
+/// streamed message, by its place in the message.  A streamed message is 
+/// BINARY in auto mode, because it can't be validated before it is sent.  
+/// conn_accepts_forlocal() tests if a frame from the browser, which is TEXT 
+/// or BINARY, may be forwarded to the daemon.  Frames that may not are 
+/// counted as dropped.
+enum lws_write_protocol conn_get_writeprotocol(void* conn_handle, const void* data, size_t len);
+bool conn_accepts_forlocal(void* conn_handle, bool binary);
+
+/// conn_count_deflate() counts a message written to a websocket that has 
+/// negotiated permessage-deflate: whether it was deflated or stored, and the
+/// CPU time of writing it.  A sample of messages is deflated again, alone, to
+/// estimate the compression ratio, which lws doesn't report.
+void conn_count_deflate(void* conn_handle, const void* data, size_t len, bool deflated, uint64_t cpu_ns);
+
+/// A connection is throttled when too many bytes are queued, either by all 
+/// connections or by all connections of its mapping.  While throttled, its 
+/// inputs (daemon reads and websocket rx) should be paused.
+bool conn_isthrottled(void* conn_handle);
+
+/// conn_rxcharge() takes the tokens of data received from the websocket of a
+/// session, from the buckets of the session and of its mapping: msgs is 1 for
+/// the first fragment of a message, else 0.  The data is always accepted, and
+/// the buckets may go into debt.  It returns how long (us) the session should
+/// stop receiving, or 0.  conn_rxwait() returns how long it should still 
+/// wait, or 0 when it may resume.
+long conn_rxcharge(void* conn_handle, size_t msgs, size_t len);
+long conn_rxwait(void* conn_handle);
 
 
 
@@ -0,0 +1,158 @@
+/*  Copyright 2020, JP Norair
+  *
+  * Redistribution and use in source and binary forms, with or without 
+  * modification, are permitted provided that the following conditions are met:
+  *
+  * 1. Redistributions of source code must retain the above copyright notice, 
+  *    this list of conditions and the following disclaimer.
+  *
+  * 2. Redistributions in binary form must reproduce the above copyright 
+  *    notice, this list of conditions and the following disclaimer in the 
+  *    documentation and/or other materials provided with the distribution.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+  * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+  * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+  * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+  * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+  * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+  * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+  * POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef bigfile_h
+#define bigfile_h
+
+// Standard C & POSIX Libraries
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+/// A file of the mount origin that is too large for the asset cache, which is
+/// sent without copying it through a userspace buffer.  On plain HTTP/1, the
+/// kernel sends it from the page cache with sendfile().  Otherwise (TLS, or a 
+/// HTTP/2 stream, where lws must frame or encrypt the body), it is read 
+/// through a window that is mapped into memory, one slice per write.
+///
+/// The window is WFEDD_PARAM(MMAP_PAGESIZE) bytes, and it is placed after a 
+/// "headroom" reservation, so that the bytes ahead of any slice are writable,
+/// as lws_write() requires.  The mapping is private, so what lws writes there
+/// never reaches the file.
+typedef struct {
+    int         fd;
+    uint64_t    size;       // bytes in file, when it was opened
+    uint64_t    offset;     // next byte to send
+    uint64_t    end;        // one past the last byte to send
+    uint8_t*    base;       // reservation: headroom, then the window
+    size_t      reserve;    // bytes of the reservation
+    size_t      headroom;   // bytes ahead of the window, page aligned
+    uint64_t    winoff;     // file offset of the window
+    size_t      winlen;     // bytes of file in the window, 0 if unmapped
+} bigfile_t;
+
+
+typedef struct {
+    unsigned long       files;          // files opened
+    unsigned long long  sentbytes;      // bytes sent with sendfile()
+    unsigned long       sendcalls;
+    unsigned long long  mapbytes;       // bytes written from the window
+    unsigned long       maps;           // windows mapped
+    unsigned long       ranges;         // partial responses
+    unsigned long       unsatisfiable;  // ranges outside of the file
+} bigfile_stat_t;
+
+
+
+/** @brief Opens a large file for sending
+ *  @param bf           (bigfile_t*) file to open
+ *  @param path         (const char*) path of the file
+ *  @param headroom     (size_t) writable bytes needed ahead of each slice
+ *  @param st           (struct stat*) output, the status of the file. May be NULL.
+ *  @retval (int)       0 on success, negative on failure
+ *
+ *  The whole file is selected for sending.  A file that is opened must be 
+ *  closed with bigfile_close(), even if nothing is sent.
+ */
+int bigfile_open(bigfile_t* bf, const char* path, size_t headroom, struct stat* st);
+
+/** @brief Closes a file from bigfile_open(), and unmaps its window
+ *  @retval None
+ */
+void bigfile_close(bigfile_t* bf);
+
+/** @brief Selects the bytes of the file to send
+ *  @param bf           (bigfile_t*) open file
+ *  @param first        (uint64_t) offset of the first byte
+ *  @param last         (uint64_t) offset of the last byte, inclusive
+ *  @retval None
+ *
+ *  The range must be in the file, as from bigfile_range().
+ */
+void bigfile_select(bigfile_t* bf, uint64_t first, uint64_t last);
+
+/** @brief Tests if sendfile() is supported on this platform
+ *  @retval (bool)      true if bigfile_sendfile() may be used
+ */
+bool bigfile_cansendfile(void);
+
+/** @brief Sends the next bytes of the file to a socket, with sendfile()
+ *  @param bf           (bigfile_t*) open file
+ *  @param sockfd       (int) non-blocking socket
+ *  @param max          (size_t) most bytes to send in this call
+ *  @retval (long)      bytes sent, 0 if the socket is full, negative on error
+ *
+ *  The file offset advances by the bytes that were sent.  A file that was 
+ *  truncated while it is sent is an error.
+ */
+long bigfile_sendfile(bigfile_t* bf, int sockfd, size_t max);
+
+/** @brief Gets the next slice of the file, from the mapped window
+ *  @param bf           (bigfile_t*) open file
+ *  @param max          (size_t) most bytes in the slice
+ *  @param len          (size_t*) output, bytes in the slice
+ *  @retval (uint8_t*)  data of the slice, or NULL on error
+ *
+ *  The window is mapped again when the offset leaves it.  The headroom bytes
+ *  ahead of the slice may be written.  The offset is not advanced, so it is 
+ *  advanced with bigfile_advance() by the bytes that were written.
+ */
+uint8_t* bigfile_window(bigfile_t* bf, size_t max, size_t* len);
+
+/** @brief Advances the offset of the file, after a slice is written
+ *  @retval None
+ */
+void bigfile_advance(bigfile_t* bf, size_t len);
+
+/** @brief Tests if all of the selected bytes have been sent
+ *  @retval (bool)      true when the offset is at the end
+ */
+bool bigfile_done(const bigfile_t* bf);
+
+/** @brief Parses an HTTP Range header
+ *  @param range        (const char*) value of the Range header
+ *  @param size         (uint64_t) bytes in the file
+ *  @param first        (uint64_t*) output, offset of the first byte
+ *  @param last         (uint64_t*) output, offset of the last byte, inclusive
+ *  @retval (int)       0 for a partial response, 1 to send the whole file, or
+ *                      negative if the range is not satisfiable (416)
+ *
+ *  One byte range is supported: "bytes=first-last", "bytes=first-", or 
+ *  "bytes=-suffix".  A range that can't be parsed, or a set of ranges, is 
+ *  ignored, and the whole file is sent, which RFC 9110 allows.
+ */
+int bigfile_range(const char* range, uint64_t size, uint64_t* first, uint64_t* last);
+
+/** @brief Copies the counters of large file sending
+ *  @param stats        (bigfile_stat_t*) output
+ *  @retval None
+ */
+void bigfile_getstats(bigfile_stat_t* stats);
+
+
+#endif
@@ -54,6 +54,13 @@ typedef struct {
     bool        quiet_on;
     FORMAT_Type format;
     INTF_Type   intf;
+    size_t      qbudget;
+    size_t      assetcache;
+    bool        preload_on;
+    unsigned int maxage;
+    const char* bundle;
+    unsigned int h2streams;
+    size_t      h2window;
 } cliopt_t;
 
 
@@ -66,5 +73,13 @@ bool cliopt_isquiet(void);
 FORMAT_Type cliopt_getformat(void);
 INTF_Type cliopt_getintf(void);
 
+size_t cliopt_getqbudget(void);
+size_t cliopt_getassetcache(void);
+bool cliopt_ispreload(void);
+unsigned int cliopt_getmaxage(void);
+const char* cliopt_getbundle(void);
+unsigned int cliopt_geth2streams(void);
+size_t cliopt_geth2window(void);
+
 
 #endif /* cliopt_h */
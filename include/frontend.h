@@ -31,6 +31,10 @@
 // Libwebsockets
 #include <libwebsockets.h>
 
+#include "backend.h"
+#include "assets.h"
+#include "bigfile.h"
+
 // Standard C & POSIX Libraries
 #include <stdbool.h>
 #include <stdint.h>
@@ -45,13 +49,37 @@
 //} msg_t;
 
 
+/// Reasons for wfedd to apply rx flow control to a wsi.  lws keeps rx 
+/// disabled while any reason bit is set.  Bits 1-5 are unused by lws itself.
+#define WFEDD_RXFLOW_QUEUE      (1 << 1)    // destination queue is full
+#define WFEDD_RXFLOW_GOVERN     (1 << 2)    // too many bytes queued overall
+#define WFEDD_RXFLOW_RATE       (1 << 3)    // a token bucket is empty
+
+
+
 /// one of these is created for each client connecting to us
 /// Basic idea: each session/client maps to a client socket for a corresponding daemon.
 struct per_session_data {
     struct per_session_data*    pss_list;
     //struct lws*                 wsi;
     struct lws*                 lwsi;
-    void*                       conn_handle;        // connection handle (from backend data)
+    void*                       conn_handle;        // &conn while it is open, else NULL
+    int                         zlevel;             // deflate level set, or -1 if not deflating
+    conn_t                      conn;               // connection storage
+};
+
+
+
+/// one of these is created for each http transaction served from the asset
+/// cache.  The asset is referenced until it is sent, or the wsi closes.  A 
+/// file that is too large for the cache is open until it is sent instead.
+struct per_http_data {
+    asset_t*                    asset;
+    asset_enc_t                 enc;        // coding that is sent
+    size_t                      offset;     // bytes of body sent
+    bool                        isfile;     // sending file, not asset
+    bool                        usesendfile;
+    bigfile_t                   file;
 };
 
 
@@ -62,6 +90,8 @@ struct per_vhost_data {
     struct lws_context*         context;
     struct lws_vhost*           vhost;
     const struct lws_protocols* protocol;
+    sockmap_t*                  map;        // mapping of the protocol
+    struct lws*                 hubwsi;     // shared daemon wsi, if fan-out
     struct per_session_data*    pss_list;   // linked-list of live pss
 };
 
@@ -110,15 +140,6 @@ int frontend_ws_callback(   struct lws *wsi,
 //int frontend_queuemsg(void* ws_handle, void* in, size_t len);
 
 
-/** @brief Creates a message applicable to a mq, suitable for websocket
- *  @retval (mq_msg_t*)
- *
- *  The client is responsible for adding the msg to a mq, and for freeing.
- */
-mq_msg_t* frontend_createmsg(void* in, size_t len);
-
-
-
 /** @brief Starts the frontend (libwebsockets)
  *  @retval (int)
  *
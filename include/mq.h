@@ -35,34 +35,194 @@
 
 ///@todo find a way to support queue.h in Linux.  It's a BSD library.
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 
+/// The key of a message in a conflating queue: its hash, and where it is in
+/// the payload.  It is found once per message, by the owner of the queue.
+typedef struct {
+    uint32_t    hash;
+    uint32_t    off;            // offset of the key in the payload
+    uint32_t    len;            // length of the key, 0 if there is none
+} mq_key_t;
+
+/// Messages are single allocations: the payload is stored inline, after the
+/// header.  Blocks come from a pool of size classes (see msgpool_*), so in 
+/// steady-state there are no calls to malloc() or free().  A message may be
+/// shared: msg_ref() adds a reference, and msg_free() drops one.
 struct mq_msg {
-    void* data;
-    size_t size;
     STAILQ_ENTRY(mq_msg) entries;
+    size_t size;                // bytes of payload in use
+    size_t alloc;               // bytes of payload available
+    int pclass;                 // pool size class, or -1 for a heap block
+    unsigned int refs;          // references, 1 from msg_new()
+    mq_key_t key;               // key, in a conflating queue
+    uint8_t data[];
 };
 
 typedef struct mq_msg mq_msg_t;
 
-typedef STAILQ_HEAD(mq_head, mq_msg) mq_t;
-
-
+typedef STAILQ_HEAD(mq_head, mq_msg) mq_list_t;
+
+
+/// A message queue is a bounded, contiguous byte ring that stores 
+/// length-prefixed records.  The storage is a single pool block that is
+/// allocated by mq_init(), so a queue has a fixed memory footprint.  Records
+/// never wrap: a record that doesn't fit at the end of the ring is placed at 
+/// the start.  Each record reserves "headroom" bytes ahead of its payload,
+/// which is used for LWS_PRE on the websocket side.
+typedef struct {
+    mq_msg_t*   store;
+    uint8_t*    base;
+    size_t      size;       // capacity of the ring, in bytes
+    size_t      headroom;   // bytes reserved ahead of each payload
+    size_t      head;       // offset of the oldest record
+    size_t      tail;       // offset of the next record
+    size_t      end;        // end of the upper segment, when wrapped
+    bool        wrapped;
+    size_t      count;      // number of records queued
+    size_t      bytes;      // number of payload bytes queued
+    long        resv;       // offset of the reserved record, or -1
+    bool        resv_wrap;
+    size_t      hoff;       // payload bytes of the oldest record consumed
+} mq_t;
+
+
+/// Pool counters, one set per size class.  The final set returned by 
+/// msgpool_getstats() has blocksize = 0, and it covers oversize messages that
+/// bypass the pool.
+typedef struct {
+    size_t          blocksize;  // payload capacity of blocks in this class
+    unsigned long   hits;       // served from the free list
+    unsigned long   misses;     // had to be malloc'ed
+    unsigned long   inuse;      // blocks currently held by messages
+    unsigned long   highwater;  // maximum of inuse
+    unsigned long   cached;     // blocks currently on the free list
+} msgpool_stat_t;
+
+
+
+/** @brief Initializes the message pool and preallocates blocks
+ *  @param prealloc     (size_t) number of blocks to preallocate per size class
+ *  @retval (int)       0 on success, negative on allocation failure
+ *
+ *  Calling msgpool_init() is optional, it will be done implicitly by the 
+ *  first call to msg_new() if not done already.
+ */
+int msgpool_init(size_t prealloc);
+
+/** @brief Frees all blocks on the free lists of the message pool
+ *  @retval None
+ */
+void msgpool_deinit(void);
+
+/** @brief Copies pool counters into a caller array
+ *  @param stats        (msgpool_stat_t*) output array
+ *  @param max          (size_t) number of elements in stats
+ *  @retval (size_t)    number of elements written
+ */
+size_t msgpool_getstats(msgpool_stat_t* stats, size_t max);
 
 
 mq_msg_t* msg_new(size_t len);
 
+mq_msg_t* msg_ref(mq_msg_t* msg);
+
+/** @brief Drops a reference to a message, and frees it with the last one
+ *  @retval None
+ */
 void msg_free(mq_msg_t* msg);
 
 
-void mq_init(mq_t* mq);
 
-bool mq_isempty(mq_t* mq);
+/** @brief Initializes a queue, allocating its ring storage from the pool
+ *  @param mq           (mq_t*) queue to initialize
+ *  @param size         (size_t) capacity of the ring, in bytes
+ *  @param headroom     (size_t) bytes to reserve ahead of each payload
+ *  @retval (int)       0 on success, negative on allocation failure
+ */
+int mq_init(mq_t* mq, size_t size, size_t headroom);
 
-mq_msg_t* mq_getmsg(mq_t* mq);
+/** @brief Discards all queued records and frees the ring storage
+ *  @retval None
+ */
+void mq_deinit(mq_t* mq);
 
-void mq_putmsg(mq_t* mq, mq_msg_t* msg);
+bool mq_isempty(mq_t* mq);
 
+/** @brief Tests if a record with a payload of len bytes can be queued now
+ *  @retval (bool)
+ */
+bool mq_hasroom(mq_t* mq, size_t len);
+
+/** @brief Copies a payload into a new record at the tail of the queue
+ *  @retval (int)       0 on success, negative if there is no room
+ */
+int mq_putmsg(mq_t* mq, const void* data, size_t len);
+
+/** @brief Copies a payload into a new record, which is tagged with flags
+ *  @param flags        (uint32_t) caller-defined flags of the record
+ *  @retval (int)       0 on success, negative if there is no room
+ *
+ *  mq_putmsg() and mq_commit() tag records with flags = 0.
+ */
+int mq_putmsg_flags(mq_t* mq, const void* data, size_t len, uint32_t flags);
+
+/** @brief Reserves a record at the tail of the queue, to be written in place
+ *  @param len          (size_t) maximum payload length of the record
+ *  @retval (void*)     payload pointer, or NULL if there is no room
+ *
+ *  The caller may write up to len bytes to the payload, for example by read()
+ *  directly into it, and then must call mq_commit().  Only one record may be
+ *  reserved at a time.
+ */
+void* mq_reserve(mq_t* mq, size_t len);
+
+/** @brief Commits the reserved record, with its actual payload length
+ *  @param len          (size_t) payload length, not more than was reserved.
+ *                      If 0, the reservation is cancelled.
+ *  @retval None
+ */
+void mq_commit(mq_t* mq, size_t len);
+
+/** @brief Returns the payload of the oldest record, without removing it
+ *  @param len          (size_t*) output for payload length
+ *  @retval (void*)     payload pointer, or NULL if the queue is empty
+ *
+ *  The payload pointer is preceded by the headroom given to mq_init(), which
+ *  the caller may write into.  It is valid until the next call to mq_pop().
+ */
+void* mq_peek(mq_t* mq, size_t* len);
+
+/** @brief Returns the flags of the oldest record, or 0 if the queue is empty
+ *  @retval (uint32_t)
+ */
+uint32_t mq_peekflags(mq_t* mq);
+
+/** @brief Removes the oldest record from the queue
+ *  @retval None
+ */
+void mq_pop(mq_t* mq);
+
+/** @brief Gathers the payloads of the oldest records, without removing them
+ *  @param iov          (struct iovec*) output array, for writev()
+ *  @param max          (size_t) number of elements in iov
+ *  @retval (size_t)    number of elements written
+ *
+ *  The first element excludes any bytes of the oldest record that were 
+ *  already removed by mq_consume().
+ */
+size_t mq_peekv(mq_t* mq, struct iovec* iov, size_t max);
+
+/** @brief Removes len payload bytes from the front of the queue
+ *  @param len          (size_t) bytes to remove, as written by writev()
+ *  @retval None
+ *
+ *  Records that are removed entirely are popped.  If the last one is only 
+ *  partly removed, the rest of it stays at the front of the queue, and 
+ *  mq_peek() returns the rest.
+ */
+void mq_consume(mq_t* mq, size_t len);
 
 
 
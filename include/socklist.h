@@ -26,6 +26,8 @@
 #ifndef socklist_h
 #define socklist_h
 
+#include "wfedd_cfg.h"
+
 // Standard C & POSIX Libraries
 #include <stdbool.h>
 #include <stdint.h>
@@ -33,9 +35,76 @@
 
 
 
+/// Framing splits the byte stream from a daemon into messages, and each 
+/// message is sent as one websocket frame.  Delimiters and length prefixes 
+/// are removed.  Length prefixes are big-endian.
+typedef enum {
+    FRAMING_RAW = 0,        // each read from the daemon is a message
+    FRAMING_NEWLINE,        // messages end with '\n'
+    FRAMING_NUL,            // messages end with '\0'
+    FRAMING_LEN16,          // messages begin with a 16 bit length
+    FRAMING_LEN32,          // messages begin with a 32 bit length
+    FRAMING_SEQPACKET,      // SOCK_SEQPACKET socket, which keeps boundaries
+    FRAMING_MUX             // sessions share a socket, with channel headers
+} framing_type;
+
+/// The payload mode selects the websocket opcode of frames to the browser, 
+/// and which frames from the browser are forwarded to the daemon.
+typedef enum {
+    PAYLOAD_TEXT = 0,       // TEXT frames only
+    PAYLOAD_BINARY,         // BINARY frames only
+    PAYLOAD_AUTO            // TEXT if the frame is valid UTF-8, else BINARY
+} payload_type;
+
+/// The conflation mode selects how the key of a message is found, when only
+/// the newest message of each key is kept in the queue of a session.
+typedef enum {
+    CONFLATE_OFF = 0,       // every message is queued
+    CONFLATE_PREFIX,        // the key is the first conflatelen bytes
+    CONFLATE_JSON           // the key is the value of a JSON member
+} conflate_type;
+
+/// The slow-consumer policy selects what happens when a session's queue to 
+/// the browser is above its high-water mark.
+typedef enum {
+    SLOW_BLOCK = 0,         // pause reads from the daemon until it drains
+    SLOW_DROPOLD,           // drop the oldest queued messages
+    SLOW_DROPNEW,           // drop the new message
+    SLOW_CLOSE              // close the session
+} slow_policy;
+
 typedef struct {
-    int     l_type;
-    size_t  pagesize;
+    int     l_type;         // socket type: SOCK_STREAM or SOCK_SEQPACKET
+    int     framing;        // framing_type
+    int     payload;        // payload_type
+    int     stream;         // stream messages larger than msgmax, 0 = off
+    size_t  pagesize;       // initial size of a read from the daemon
+    size_t  pagemax;        // cap on the size of a read from the daemon
+    size_t  webqueue;       // capacity of the daemon->websocket queue (bytes)
+    size_t  localqueue;     // capacity of the websocket->daemon queue (bytes)
+    size_t  budget;         // cap on bytes queued by all sessions, 0 = none
+    size_t  msgmax;         // cap on the size of a framed message
+    size_t  ctimeout;       // connect timeout to the daemon (ms)
+    size_t  coalesce;       // byte budget of a coalesced frame, 0 = off
+    size_t  linger;         // latency a message may wait to coalesce (us)
+    int     deflate;        // negotiate permessage-deflate, 0 = off
+    size_t  zmin;           // smaller messages are sent stored, not deflated
+    size_t  zwbits;         // deflate window bits
+    size_t  zmem;           // deflate memory level
+    int     znoctx;         // reset the deflate context after each message
+    int     fanout;         // sessions share one daemon connection, 0 = off
+    size_t  poolmin;        // warm daemon connections kept ready
+    size_t  poolmax;        // cap on warm connections, 0 = no pool
+    int     slowpolicy;     // slow_policy
+    size_t  slowmark;       // high-water mark of the web queue (bytes)
+    int     conflate;       // conflate_type
+    size_t  conflatelen;    // length of a prefix key
+    size_t  conflatekeys;   // keys queued per session
+    char    conflatekey[WFEDD_PARAM(CONFLATE_KEYLEN)];  // name of a JSON key
+    size_t  rxrate;         // messages/s from a session's websocket, 0 = any
+    size_t  rxbytes;        // bytes/s from a session's websocket, 0 = any
+    size_t  maprxrate;      // messages/s from all sessions, 0 = any
+    size_t  maprxbytes;     // bytes/s from all sessions, 0 = any
     char*   l_socket;
     char*   websocket;
 } sockmap_t;
@@ -51,6 +120,45 @@ typedef struct {
 
 int socklist_init(socklist_t** sl_handle, size_t maxsize);
 
+/** @brief Adds a daemon socket to websocket mapping to the socklist
+ *  @param socklist     (socklist_t*) socklist to add to
+ *  @param mapstr       (const char*) mapping string, see below
+ *  @retval (int)       0 on success, negative on error
+ *
+ *  The mapping string has the form: local-socket-path:websocket-path[:options]
+ *  The options are a comma separated list of key=value pairs.  Sizes may have
+ *  a k or M suffix.
+ *  - pagesize=size     initial size of a read from the daemon
+ *  - pagemax=size      cap on the size of a read, which grows from pagesize
+ *  - webqueue=size     capacity of the daemon->websocket queue
+ *  - localqueue=size   capacity of the websocket->daemon queue
+ *  - budget=size       cap on bytes queued by all sessions of the mapping
+ *  - framing=type      raw, newline, nul, len16, len32, seqpacket, or mux
+ *  - payload=type      text, binary, or auto
+ *  - msgmax=size       cap on the size of a framed message
+ *  - stream=on|off     send larger messages as fragments, instead of dropping
+ *  - ctimeout=ms       timeout for connecting to the daemon, in milliseconds
+ *  - coalesce=size     pack queued messages into frames up to this size
+ *  - linger=us         latency a message may wait to be coalesced
+ *  - deflate=on|off    negotiate permessage-deflate with the browser
+ *  - deflatemin=size   messages smaller than this are not compressed (noctx)
+ *  - deflatewbits=n    deflate window bits, 9-15
+ *  - deflatemem=n      deflate memory level, 1-9
+ *  - deflatenoctx=on|off  don't keep the deflate context between messages
+ *  - fanout=on|off     sessions share one daemon connection (broadcast)
+ *  - poolmin=n         warm daemon connections kept ready for new sessions
+ *  - poolmax=n         cap on warm connections, after a burst of sessions
+ *  - slowpolicy=type   block, dropold, dropnew, or close
+ *  - slowmark=size     high-water mark of a session's web queue
+ *  - conflate=type     off, prefix, or json: keep the newest message per key
+ *  - conflatelen=n     length of a prefix key
+ *  - conflatekey=name  name of a JSON key
+ *  - conflatekeys=n    cap on the keys queued for a session
+ *  - rxrate=n          messages per second from the websocket of a session
+ *  - rxbytes=size      bytes per second from the websocket of a session
+ *  - maprxrate=n       messages per second from all sessions of the mapping
+ *  - maprxbytes=size   bytes per second from all sessions of the mapping
+ */
 int socklist_addmap(socklist_t* socklist, const char* mapstr);
 
 void socklist_deinit(socklist_t* socklist);
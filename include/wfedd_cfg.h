@@ -110,7 +110,133 @@
 #   define WFEDD_PARAM_BYLINE       "JP Norair (indigresso.com)"
 #endif
 #ifndef WFEDD_PARAM_MMAP_PAGESIZE
-#   define WFEDD_PARAM_MMAP_PAGESIZE (128*1024)
+#   define WFEDD_PARAM_MMAP_PAGESIZE (128*1024)    // bytes mapped per large file window
+#endif
+#ifndef WFEDD_PARAM_MSGPOOL_PREALLOC
+#   define WFEDD_PARAM_MSGPOOL_PREALLOC 4
+#endif
+#ifndef WFEDD_PARAM_MSGPOOL_RETAIN
+#   define WFEDD_PARAM_MSGPOOL_RETAIN   64
+#endif
+#ifndef WFEDD_PARAM_WEBQUEUE_SIZE
+#   define WFEDD_PARAM_WEBQUEUE_SIZE    (32*1024)
+#endif
+#ifndef WFEDD_PARAM_LOCALQUEUE_SIZE
+#   define WFEDD_PARAM_LOCALQUEUE_SIZE  (8*1024)
+#endif
+#ifndef WFEDD_PARAM_QUEUE_MIN
+#   define WFEDD_PARAM_QUEUE_MIN        (4*1024)
+#endif
+#ifndef WFEDD_PARAM_QUEUE_MAX
+#   define WFEDD_PARAM_QUEUE_MAX        (16*1024*1024)
+#endif
+#ifndef WFEDD_PARAM_QBUDGET
+#   define WFEDD_PARAM_QBUDGET          (2*1024*1024)
+#endif
+#ifndef WFEDD_PARAM_QBUDGET_LOWATER
+#   define WFEDD_PARAM_QBUDGET_LOWATER  75      // percent of budget
+#endif
+#ifndef WFEDD_PARAM_PAGESIZE
+#   define WFEDD_PARAM_PAGESIZE         (4*1024)
+#endif
+#ifndef WFEDD_PARAM_PAGEMAX
+#   define WFEDD_PARAM_PAGEMAX          (64*1024)
+#endif
+#ifndef WFEDD_PARAM_READ_BUDGET
+#   define WFEDD_PARAM_READ_BUDGET      (256*1024)  // per daemon rx callback
+#endif
+#ifndef WFEDD_PARAM_WRITEV_MAX
+#   define WFEDD_PARAM_WRITEV_MAX       64          // messages per daemon write
+#endif
+#ifndef WFEDD_PARAM_COALESCE_LINGER
+#   define WFEDD_PARAM_COALESCE_LINGER  2000        // us
+#endif
+#ifndef WFEDD_PARAM_COALESCE_MAX
+#   define WFEDD_PARAM_COALESCE_MAX     64          // messages per websocket frame
+#endif
+#ifndef WFEDD_PARAM_DEFLATE_MIN
+#   define WFEDD_PARAM_DEFLATE_MIN      128         // bytes
+#endif
+#ifndef WFEDD_PARAM_DEFLATE_WBITS
+#   define WFEDD_PARAM_DEFLATE_WBITS    15
+#endif
+#ifndef WFEDD_PARAM_DEFLATE_MEMLEVEL
+#   define WFEDD_PARAM_DEFLATE_MEMLEVEL 8
+#endif
+#ifndef WFEDD_PARAM_DEFLATE_LEVEL
+#   define WFEDD_PARAM_DEFLATE_LEVEL    1           // zlib level when deflating
+#endif
+#ifndef WFEDD_PARAM_DEFLATE_SAMPLE
+#   define WFEDD_PARAM_DEFLATE_SAMPLE   64          // 1 in N messages measured
+#endif
+#ifndef WFEDD_PARAM_FANOUT_DEPTH
+#   define WFEDD_PARAM_FANOUT_DEPTH     256         // messages per subscriber
+#endif
+#ifndef WFEDD_PARAM_CONFLATE_KEYS
+#   define WFEDD_PARAM_CONFLATE_KEYS    1024        // keys queued per session
+#endif
+#ifndef WFEDD_PARAM_CONFLATE_KEYLEN
+#   define WFEDD_PARAM_CONFLATE_KEYLEN  32          // JSON key name, with NUL
+#endif
+#ifndef WFEDD_PARAM_POOL_MAX
+#   define WFEDD_PARAM_POOL_MAX         256         // warm connections per mapping
+#endif
+#ifndef WFEDD_PARAM_POOL_INTERVAL
+#   define WFEDD_PARAM_POOL_INTERVAL    100         // ms between pool refills
+#endif
+#ifndef WFEDD_PARAM_POOL_IDLE
+#   define WFEDD_PARAM_POOL_IDLE        30000       // ms after a miss at poolmax
+#endif
+#ifndef WFEDD_PARAM_ASSET_CACHE
+#   define WFEDD_PARAM_ASSET_CACHE      4096        // kB of cached files
+#endif
+#ifndef WFEDD_PARAM_ASSET_FILEMAX
+#   define WFEDD_PARAM_ASSET_FILEMAX    (1024*1024) // larger files aren't cached
+#endif
+#ifndef WFEDD_PARAM_ASSET_CHUNK
+#   define WFEDD_PARAM_ASSET_CHUNK      (16*1024)   // bytes per http write
+#endif
+#ifndef WFEDD_PARAM_ASSET_GZIP_MIN
+#   define WFEDD_PARAM_ASSET_GZIP_MIN   256         // smaller files aren't gzipped
+#endif
+#ifndef WFEDD_PARAM_ASSET_GZIP_LEVEL
+#   define WFEDD_PARAM_ASSET_GZIP_LEVEL 9           // zlib level, once per load
+#endif
+#ifndef WFEDD_PARAM_ASSET_MAXAGE
+#   define WFEDD_PARAM_ASSET_MAXAGE     0           // s, 0 revalidates each use
+#endif
+#ifndef WFEDD_PARAM_ASSET_IMMUTABLE
+#   define WFEDD_PARAM_ASSET_IMMUTABLE  31536000    // s, for fingerprinted files
+#endif
+#ifndef WFEDD_PARAM_ASSET_FINGERPRINT
+#   define WFEDD_PARAM_ASSET_FINGERPRINT 8          // chars of a name hash
+#endif
+#ifndef WFEDD_PARAM_ASSET_HEADERS
+#   define WFEDD_PARAM_ASSET_HEADERS    1024        // bytes of response headers
+#endif
+#ifndef WFEDD_PARAM_BUNDLE_HEADROOM
+#   define WFEDD_PARAM_BUNDLE_HEADROOM  32          // bytes ahead of each chunk, >= LWS_PRE
+#endif
+#ifndef WFEDD_PARAM_BIGFILE_SENDMAX
+#   define WFEDD_PARAM_BIGFILE_SENDMAX  (256*1024)  // bytes per sendfile() call
+#endif
+#ifndef WFEDD_PARAM_H2_STREAMS
+#   define WFEDD_PARAM_H2_STREAMS       32          // per connection, 0 = HTTP/1.1 only
+#endif
+#ifndef WFEDD_PARAM_H2_WINDOW
+#   define WFEDD_PARAM_H2_WINDOW        128         // kB, initial flow control window
+#endif
+#ifndef WFEDD_PARAM_ASSET_BUCKETS
+#   define WFEDD_PARAM_ASSET_BUCKETS    256         // power of two
+#endif
+#ifndef WFEDD_PARAM_ASSET_INTERVAL
+#   define WFEDD_PARAM_ASSET_INTERVAL   250         // ms between change checks
+#endif
+#ifndef WFEDD_PARAM_CONNECT_TIMEOUT
+#   define WFEDD_PARAM_CONNECT_TIMEOUT  5000        // ms
+#endif
+#ifndef WFEDD_PARAM_CONNECT_RETRY
+#   define WFEDD_PARAM_CONNECT_RETRY    20000       // us
 #endif
 
 
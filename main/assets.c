@@ -0,0 +1,1368 @@
+/*  Copyright 2020, JP Norair
+  *
+  * Redistribution and use in source and binary forms, with or without 
+  * modification, are permitted provided that the following conditions are met:
+  *
+  * 1. Redistributions of source code must retain the above copyright notice, 
+  *    this list of conditions and the following disclaimer.
+  *
+  * 2. Redistributions in binary form must reproduce the above copyright 
+  *    notice, this list of conditions and the following disclaimer in the 
+  *    documentation and/or other materials provided with the distribution.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+  * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+  * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+  * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+  * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+  * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+  * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+  * POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include "wfedd_cfg.h"
+#include "assets.h"
+
+// Libwebsockets
+#include <libwebsockets.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__linux__)
+#   include <sys/inotify.h>
+#   define ASSETS_WATCH     1
+#   define ASSETS_EVENTS    (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+                             IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                             IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#else
+#   define ASSETS_WATCH     0
+#endif
+
+
+/// Each watched directory of the origin, by inotify watch descriptor.  The
+/// root of the origin has path "".
+typedef struct {
+    int     wd;
+    char*   path;
+} watch_t;
+
+
+/// The cache is a single instance, like the message pool.  The hash table is
+/// chained, and the LRU list runs from most recently used (head) to least 
+/// recently used (tail).  Only assets in the table are on the list.
+static struct {
+    bool            isopen;
+    char*           origin;
+    size_t          originlen;
+    asset_t*        table[WFEDD_PARAM(ASSET_BUCKETS)];
+    asset_t*        head;
+    asset_t*        tail;
+    assets_stat_t   stat;
+    int             ifd;
+    watch_t*        watch;
+    size_t          nwatches;
+    size_t          walloc;
+    uint64_t        nextservice;
+    char            cachecontrol[48];
+    char            immutable[48];
+    uint8_t*        bundle;         // mapping, if serving from a bundle
+    size_t          bundlesize;
+} cache = { .ifd = -1 };
+
+
+
+
+static uint64_t sub_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000) + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+
+static uint32_t sub_hash(const char* path) {
+/// FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*path != 0) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+
+static bool sub_checkpath(const char* path) {
+/// Paths are relative, and no segment may be "..".  lws collapses these in 
+/// URIs already, so this is a second check.
+    const char* seg = path;
+    
+    if ((*path == '/') || (*path == 0)) {
+        return false;
+    }
+    while (seg != NULL) {
+        if ((seg[0] == '.') && (seg[1] == '.') && ((seg[2] == '/') || (seg[2] == 0))) {
+            return false;
+        }
+        seg = strchr(seg, '/');
+        if (seg != NULL) {
+            seg++;
+        }
+    }
+    return true;
+}
+
+
+
+
+/// Table & LRU List ----------------------------------------------------------
+
+static asset_t* sub_find(const char* path, uint32_t hash) {
+    asset_t* asset = cache.table[hash & (WFEDD_PARAM(ASSET_BUCKETS)-1)];
+    
+    while (asset != NULL) {
+        if ((asset->hash == hash) && (strcmp(asset->path, path) == 0)) {
+            break;
+        }
+        asset = asset->hnext;
+    }
+    return asset;
+}
+
+
+static void sub_lru_unlink(asset_t* asset) {
+    if (asset->prev != NULL)    asset->prev->next = asset->next;
+    else                        cache.head = asset->next;
+    if (asset->next != NULL)    asset->next->prev = asset->prev;
+    else                        cache.tail = asset->prev;
+    asset->prev = NULL;
+    asset->next = NULL;
+}
+
+
+static void sub_lru_push(asset_t* asset) {
+    asset->prev = NULL;
+    asset->next = cache.head;
+    if (cache.head != NULL)     cache.head->prev = asset;
+    else                        cache.tail = asset;
+    cache.head = asset;
+}
+
+
+static void sub_body_free(asset_body_t* body, bool owned) {
+    if (body->chunk != NULL) {
+        for (size_t i=0; owned && (i<body->nchunks); i++) {
+            free(body->chunk[i]);
+        }
+        free(body->chunk);
+    }
+    body->chunk     = NULL;
+    body->nchunks   = 0;
+    body->size      = 0;
+}
+
+
+static void sub_free(asset_t* asset) {
+    for (int i=0; i<ASSET_ENCODINGS; i++) {
+        sub_body_free(&asset->body[i], !asset->bundled);
+    }
+    free(asset->path);
+    free(asset);
+}
+
+
+static void sub_link(asset_t* asset) {
+    asset_t** bucket = &cache.table[asset->hash & (WFEDD_PARAM(ASSET_BUCKETS)-1)];
+    
+    asset->hnext = *bucket;
+    *bucket = asset;
+    sub_lru_push(asset);
+    cache.stat.bytes += asset->bytes;
+    cache.stat.entries++;
+}
+
+
+static void sub_drop(asset_t* asset) {
+/// Removes an asset from the cache.  Responses that are sending it still hold
+/// a reference, and the last one frees it.
+    asset_t** link = &cache.table[asset->hash & (WFEDD_PARAM(ASSET_BUCKETS)-1)];
+    
+    while (*link != asset) {
+        link = &(*link)->hnext;
+    }
+    *link = asset->hnext;
+    asset->hnext = NULL;
+    sub_lru_unlink(asset);
+    cache.stat.bytes -= asset->bytes;
+    cache.stat.entries--;
+    assets_put(asset);
+}
+
+
+static void sub_flush(void) {
+    while (cache.head != NULL) {
+        sub_drop(cache.head);
+        cache.stat.invalidations++;
+    }
+}
+
+
+static void sub_invalidate(const char* path) {
+    asset_t* asset = sub_find(path, sub_hash(path));
+    
+    if (asset != NULL) {
+        sub_drop(asset);
+        cache.stat.invalidations++;
+    }
+}
+
+
+static bool sub_issidecar(const char* path, size_t* stem) {
+    size_t len = strlen(path);
+    
+    if ((len > 3) && (strcmp(&path[len-3], ".gz") == 0)) {
+        *stem = len - 3;
+        return true;
+    }
+    if ((len > 3) && (strcmp(&path[len-3], ".br") == 0)) {
+        *stem = len - 3;
+        return true;
+    }
+    return false;
+}
+
+
+static void sub_invalidate_file(const char* path) {
+/// A change to a sidecar changes the file it belongs to.
+    char stem[PATH_MAX];
+    size_t len;
+    
+    sub_invalidate(path);
+    if (sub_issidecar(path, &len) && (len < sizeof(stem))) {
+        memcpy(stem, path, len);
+        stem[len] = 0;
+        sub_invalidate(stem);
+    }
+}
+
+
+
+
+/// File Loading --------------------------------------------------------------
+
+static const char* const enc_names[ASSET_ENCODINGS] = { NULL, "gzip", "br" };
+static const char* const enc_exts[ASSET_ENCODINGS]  = { "", ".gz", ".br" };
+
+
+static void sub_etag_format(asset_t* asset, uint64_t hash) {
+/// Each coding is a different representation, so each has its own strong ETag.
+    asset->etaghash = hash;
+    for (int i=0; i<ASSET_ENCODINGS; i++) {
+        snprintf(asset->etag[i], sizeof(asset->etag[i]), "\"%016llx%s%s\"", 
+                    (unsigned long long)hash, (i == ASSET_IDENTITY) ? "" : "-", &enc_exts[i][(i == ASSET_IDENTITY) ? 0 : 1]);
+    }
+}
+
+
+static void sub_etag(asset_t* asset) {
+/// The ETag is a FNV-1a hash of the file, computed once at load.
+    const asset_body_t* body = &asset->body[ASSET_IDENTITY];
+    uint64_t hash = 14695981039346656037ull;
+    
+    for (size_t i=0; i<body->nchunks; i++) {
+        const uint8_t* data = &body->chunk[i][LWS_PRE];
+        size_t clen = (i == (body->nchunks-1)) ? 
+                        (body->size - (i * WFEDD_PARAM(ASSET_CHUNK))) : WFEDD_PARAM(ASSET_CHUNK);
+        while (clen-- != 0) {
+            hash = (hash ^ *data++) * 1099511628211ull;
+        }
+    }
+    sub_etag_format(asset, hash);
+}
+
+
+static int sub_body_alloc(asset_body_t* body, size_t size) {
+    size_t clen;
+    
+    body->size      = size;
+    body->nchunks   = (size + WFEDD_PARAM(ASSET_CHUNK) - 1) / WFEDD_PARAM(ASSET_CHUNK);
+    if (body->nchunks == 0) {
+        return 0;
+    }
+    body->chunk = calloc(body->nchunks, sizeof(uint8_t*));
+    if (body->chunk == NULL) {
+        return -1;
+    }
+    for (size_t i=0; i<body->nchunks; i++, size-=clen) {
+        clen = (size > WFEDD_PARAM(ASSET_CHUNK)) ? WFEDD_PARAM(ASSET_CHUNK) : size;
+        body->chunk[i] = malloc(LWS_PRE + clen);
+        if (body->chunk[i] == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int sub_body_read(asset_body_t* body, int fd, size_t size) {
+/// A file that is shorter than its stat is being written.  It is loaded again
+/// after the write closes it.
+    if (sub_body_alloc(body, size) != 0) {
+        return -1;
+    }
+    for (size_t i=0; i<body->nchunks; i++) {
+        uint8_t* data   = &body->chunk[i][LWS_PRE];
+        size_t clen     = (i == (body->nchunks-1)) ? 
+                            (size - (i * WFEDD_PARAM(ASSET_CHUNK))) : WFEDD_PARAM(ASSET_CHUNK);
+        while (clen != 0) {
+            ssize_t n = read(fd, data, clen);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (n == 0) {
+                return -1;
+            }
+            data += n;
+            clen -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+
+static int sub_body_gzip(asset_body_t* gz, const asset_body_t* src) {
+/// Builds the gzip body of a file, once, when it is loaded.  It is kept only
+/// if it saves at least 1/8 of the file, so types that are compressed 
+/// already (images, fonts) are sent as they are.
+    z_stream zs;
+    uint8_t* out;
+    size_t bound, outlen;
+    int zrc = Z_OK;
+    
+    if (src->size < WFEDD_PARAM(ASSET_GZIP_MIN)) {
+        return 0;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, WFEDD_PARAM(ASSET_GZIP_LEVEL), Z_DEFLATED, 
+                     15+16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    bound   = deflateBound(&zs, src->size);
+    out     = malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_out     = out;
+    zs.avail_out    = (uInt)bound;
+    for (size_t i=0; (i<src->nchunks) && (zrc == Z_OK); i++) {
+        zs.next_in  = &src->chunk[i][LWS_PRE];
+        zs.avail_in = (uInt)((i == (src->nchunks-1)) ? 
+                        (src->size - (i * WFEDD_PARAM(ASSET_CHUNK))) : WFEDD_PARAM(ASSET_CHUNK));
+        zrc = deflate(&zs, (i == (src->nchunks-1)) ? Z_FINISH : Z_NO_FLUSH);
+    }
+    outlen = zs.total_out;
+    deflateEnd(&zs);
+    
+    if ((zrc != Z_STREAM_END) || (outlen > (src->size - (src->size / 8)))) {
+        free(out);
+        return 0;
+    }
+    if (sub_body_alloc(gz, outlen) != 0) {
+        free(out);
+        return -1;
+    }
+    for (size_t i=0, off=0; i<gz->nchunks; i++) {
+        size_t clen = ((outlen - off) > WFEDD_PARAM(ASSET_CHUNK)) ? WFEDD_PARAM(ASSET_CHUNK) : (outlen - off);
+        memcpy(&gz->chunk[i][LWS_PRE], &out[off], clen);
+        off += clen;
+    }
+    free(out);
+    return 0;
+}
+
+
+static void sub_load_sidecar(asset_t* asset, asset_enc_t enc, const char* fullpath, 
+                             const struct stat* st) {
+/// Loads the compressed body of a file from its sidecar.  A sidecar that is
+/// older than its file is stale, and it is ignored.
+    char sidepath[PATH_MAX];
+    struct stat sst;
+    int fd;
+    
+    if (snprintf(sidepath, sizeof(sidepath), "%s%s", fullpath, enc_exts[enc]) >= (int)sizeof(sidepath)) {
+        return;
+    }
+    fd = open(sidepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if ((fstat(fd, &sst) == 0) && S_ISREG(sst.st_mode) 
+    &&  (sst.st_mtime >= st->st_mtime)
+    &&  ((size_t)sst.st_size <= WFEDD_PARAM(ASSET_FILEMAX))) {
+        if (sub_body_read(&asset->body[enc], fd, (size_t)sst.st_size) == 0) {
+            cache.stat.sidecars++;
+        }
+        else {
+            sub_body_free(&asset->body[enc], true);
+        }
+    }
+    close(fd);
+}
+
+
+static int sub_load(const char* path, uint32_t hash, asset_t** out) {
+/// Reads a file of the origin into a new asset, with its compressed bodies.
+/// Files that are too large are left for the filesystem.  The LRU tail is 
+/// evicted until the file fits.
+    char fullpath[PATH_MAX];
+    struct stat st;
+    const char* mimetype;
+    asset_t* asset;
+    int fd;
+    
+    mimetype = lws_get_mimetype(path, NULL);
+    if (mimetype == NULL) {
+        return ASSETS_FORBIDDEN;
+    }
+    if (snprintf(fullpath, sizeof(fullpath), "%s/%s", cache.origin, path) >= (int)sizeof(fullpath)) {
+        return ASSETS_NOTFOUND;
+    }
+    fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return (errno == EACCES) ? ASSETS_FORBIDDEN : ASSETS_NOTFOUND;
+    }
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return ASSETS_NOTFOUND;
+    }
+    if (((size_t)st.st_size > WFEDD_PARAM(ASSET_FILEMAX)) || ((size_t)st.st_size > cache.stat.cap)) {
+        close(fd);
+        return ASSETS_UNCACHED;
+    }
+    
+    asset = calloc(1, sizeof(asset_t));
+    if (asset == NULL) {
+        close(fd);
+        return ASSETS_UNCACHED;
+    }
+    asset->path         = strdup(path);
+    asset->hash         = hash;
+    asset->mimetype     = mimetype;
+    asset->cachecontrol = assets_cachecontrol(path);
+    asset->mtime        = st.st_mtime;
+    asset->refs         = 1;
+    if ((asset->path == NULL) 
+    ||  (sub_body_read(&asset->body[ASSET_IDENTITY], fd, (size_t)st.st_size) != 0)) {
+        close(fd);
+        sub_free(asset);
+        return ASSETS_UNCACHED;
+    }
+    close(fd);
+    
+    sub_load_sidecar(asset, ASSET_BR, fullpath, &st);
+    sub_load_sidecar(asset, ASSET_GZIP, fullpath, &st);
+    if (asset->body[ASSET_GZIP].chunk == NULL) {
+        if (sub_body_gzip(&asset->body[ASSET_GZIP], &asset->body[ASSET_IDENTITY]) != 0) {
+            sub_body_free(&asset->body[ASSET_GZIP], true);
+        }
+        else if (asset->body[ASSET_GZIP].chunk != NULL) {
+            cache.stat.built++;
+        }
+    }
+    
+    sub_etag(asset);
+    
+    // The compressed bodies are dropped if the file can't fit with them.
+    for (int i=0; i<ASSET_ENCODINGS; i++) {
+        asset->bytes += asset->body[i].size;
+    }
+    if (asset->bytes > cache.stat.cap) {
+        sub_body_free(&asset->body[ASSET_GZIP], true);
+        sub_body_free(&asset->body[ASSET_BR], true);
+        asset->bytes = asset->body[ASSET_IDENTITY].size;
+    }
+    
+    while ((cache.tail != NULL) && ((cache.stat.bytes + asset->bytes) > cache.stat.cap)) {
+        sub_drop(cache.tail);
+        cache.stat.evictions++;
+    }
+    sub_link(asset);
+    cache.stat.loads++;
+    *out = asset;
+    return 0;
+}
+
+
+static bool sub_accepts(const char* accept, const char* coding) {
+/// Tests if an Accept-Encoding header accepts a coding, by name or by "*".  
+/// A coding named with q=0 is refused, even if "*" would accept it.
+    size_t clen = strlen(coding);
+    int named   = -1;
+    int star    = -1;
+    
+    while ((accept != NULL) && (*accept != 0)) {
+        const char* item;
+        size_t ilen;
+        bool zero = false;
+        
+        while ((*accept == ' ') || (*accept == '\t') || (*accept == ',')) {
+            accept++;
+        }
+        item = accept;
+        while ((*accept != 0) && (*accept != ',') && (*accept != ';') 
+        &&     (*accept != ' ') && (*accept != '\t')) {
+            accept++;
+        }
+        ilen = (size_t)(accept - item);
+        
+        // Parameters: only q matters, and only whether it is zero
+        while ((*accept != 0) && (*accept != ',')) {
+            if (((accept[0] == 'q') || (accept[0] == 'Q')) && (accept[1] == '=')) {
+                const char* q = &accept[2];
+                zero = (*q == '0');
+                for (q++; zero && (*q != 0) && (*q != ',') && (*q != ';') && (*q != ' '); q++) {
+                    zero = (*q == '.') || (*q == '0');
+                }
+            }
+            accept++;
+        }
+        
+        if ((ilen == clen) && (strncasecmp(item, coding, clen) == 0)) {
+            named = !zero;
+        }
+        else if ((ilen == 1) && (*item == '*')) {
+            star = !zero;
+        }
+    }
+    
+    return (named >= 0) ? (named != 0) : (star > 0);
+}
+
+
+/// Change Watching -----------------------------------------------------------
+
+#if ASSETS_WATCH
+
+static const char* sub_relpath(const char* fpath) {
+    if (strlen(fpath) <= cache.originlen) {
+        return "";
+    }
+    return &fpath[cache.originlen + 1];
+}
+
+
+static watch_t* sub_watch_find(int wd) {
+    for (size_t i=0; i<cache.nwatches; i++) {
+        if (cache.watch[i].wd == wd) {
+            return &cache.watch[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void sub_watch_remove(watch_t* watch) {
+    free(watch->path);
+    *watch = cache.watch[--cache.nwatches];
+}
+
+
+static int sub_watch_add(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+/// nftw() callback.  Adding a watch to a directory that is watched already 
+/// gives back its descriptor, and the path is updated.
+    watch_t* watch;
+    char* path;
+    int wd;
+    
+    if (typeflag != FTW_D) {
+        return 0;
+    }
+    wd = inotify_add_watch(cache.ifd, fpath, ASSETS_EVENTS);
+    if (wd < 0) {
+        return 0;
+    }
+    path = strdup(sub_relpath(fpath));
+    if (path == NULL) {
+        return 0;
+    }
+    watch = sub_watch_find(wd);
+    if (watch == NULL) {
+        if (cache.nwatches == cache.walloc) {
+            size_t walloc = (cache.walloc == 0) ? 16 : (cache.walloc * 2);
+            watch_t* grow = realloc(cache.watch, walloc * sizeof(watch_t));
+            if (grow == NULL) {
+                free(path);
+                return 0;
+            }
+            cache.watch  = grow;
+            cache.walloc = walloc;
+        }
+        watch = &cache.watch[cache.nwatches++];
+    }
+    else {
+        free(watch->path);
+    }
+    watch->wd   = wd;
+    watch->path = path;
+    return 0;
+}
+
+
+static void sub_watch_tree(const char* path) {
+    char fullpath[PATH_MAX];
+    
+    if (*path == 0) {
+        snprintf(fullpath, sizeof(fullpath), "%s", cache.origin);
+    }
+    else if (snprintf(fullpath, sizeof(fullpath), "%s/%s", cache.origin, path) >= (int)sizeof(fullpath)) {
+        return;
+    }
+    nftw(fullpath, &sub_watch_add, 16, FTW_PHYS);
+}
+
+
+static void sub_watch_event(const struct inotify_event* ev) {
+/// A changed file is dropped.  A directory that goes away, or an overflow of
+/// the event queue, drops everything, which is rare enough to not be worth 
+/// being exact about.
+    char path[PATH_MAX];
+    watch_t* watch;
+    
+    if (ev->mask & IN_Q_OVERFLOW) {
+        sub_flush();
+        sub_watch_tree("");
+        return;
+    }
+    watch = sub_watch_find(ev->wd);
+    if (watch == NULL) {
+        return;
+    }
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (!(ev->mask & IN_IGNORED)) {
+            inotify_rm_watch(cache.ifd, ev->wd);
+        }
+        sub_watch_remove(watch);
+        sub_flush();
+        return;
+    }
+    if (ev->len == 0) {
+        return;
+    }
+    if (*watch->path == 0) {
+        snprintf(path, sizeof(path), "%s", ev->name);
+    }
+    else if (snprintf(path, sizeof(path), "%s/%s", watch->path, ev->name) >= (int)sizeof(path)) {
+        return;
+    }
+    
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            sub_watch_tree(path);
+        }
+        if (ev->mask & IN_MOVED_FROM) {
+            sub_flush();
+        }
+    }
+    else {
+        sub_invalidate_file(path);
+    }
+}
+
+#endif
+
+
+static int sub_preload(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+/// nftw() callback.  Files are loaded while they fit, without evicting.  
+/// Sidecars are loaded with the files they belong to.
+    asset_t* asset;
+    size_t stem;
+    
+    if ((typeflag != FTW_F) || (strlen(fpath) <= cache.originlen)) {
+        return 0;
+    }
+    if (sub_issidecar(fpath, &stem)) {
+        return 0;
+    }
+    if ((size_t)sb->st_size > (cache.stat.cap - cache.stat.bytes)) {
+        return 0;
+    }
+    if (assets_get(&fpath[cache.originlen + 1], &asset) == 0) {
+        assets_put(asset);
+    }
+    return 0;
+}
+
+
+
+
+static int sub_open(const char* origin, size_t cap, unsigned int maxage) {
+    size_t len = strlen(origin);
+    
+    if (cache.isopen) {
+        return -1;
+    }
+    while ((len > 1) && (origin[len-1] == '/')) {
+        len--;
+    }
+    cache.origin = strndup(origin, len);
+    if (cache.origin == NULL) {
+        return -2;
+    }
+    cache.originlen = len;
+    memset(cache.table, 0, sizeof(cache.table));
+    memset(&cache.stat, 0, sizeof(cache.stat));
+    cache.head          = NULL;
+    cache.tail          = NULL;
+    cache.stat.cap      = cap;
+    snprintf(cache.immutable, sizeof(cache.immutable), "public, max-age=%u, immutable", 
+                (unsigned int)WFEDD_PARAM(ASSET_IMMUTABLE));
+    if (maxage == 0) {
+        snprintf(cache.cachecontrol, sizeof(cache.cachecontrol), "no-cache");
+    }
+    else {
+        snprintf(cache.cachecontrol, sizeof(cache.cachecontrol), "public, max-age=%u", maxage);
+    }
+    cache.nextservice   = 0;
+    cache.isopen        = true;
+    return 0;
+}
+
+
+
+
+/// Bundles -------------------------------------------------------------------
+
+/// A bundle is a single file: a header, the bodies, and an index.  Each chunk
+/// of a body is stored after BUNDLE_HEADROOM bytes, which become the LWS_PRE
+/// of the chunk when the bundle is mapped privately, so chunks are written 
+/// from the mapping as they are from the cache.  Integers are little-endian,
+/// so a bundle can be packed on a build host for a target of any byte order.
+///
+/// header: magic[8], version, chunk, headroom, count (u32), indexoff, 
+///         indexlen (u64)
+/// entry:  pathlen, mimelen (u32), mtime, etaghash, {size, off}[3] (u64), 
+///         path, mimetype (with NUL)
+#define BUNDLE_MAGIC        "WFEDDBN1"
+#define BUNDLE_VERSION      1
+#define BUNDLE_HEADERLEN    40
+#define BUNDLE_ENTRYLEN     (24 + (16 * ASSET_ENCODINGS))
+
+
+static void sub_put32(uint8_t* p, uint32_t val) {
+    for (int i=0; i<4; i++) {
+        p[i] = (uint8_t)(val >> (8*i));
+    }
+}
+
+static void sub_put64(uint8_t* p, uint64_t val) {
+    for (int i=0; i<8; i++) {
+        p[i] = (uint8_t)(val >> (8*i));
+    }
+}
+
+static uint32_t sub_get32(const uint8_t* p) {
+    uint32_t val = 0;
+    for (int i=3; i>=0; i--) {
+        val = (val << 8) | p[i];
+    }
+    return val;
+}
+
+static uint64_t sub_get64(const uint8_t* p) {
+    uint64_t val = 0;
+    for (int i=7; i>=0; i--) {
+        val = (val << 8) | p[i];
+    }
+    return val;
+}
+
+
+static uint64_t sub_body_disklen(const asset_body_t* body) {
+    return (uint64_t)body->nchunks * WFEDD_PARAM(BUNDLE_HEADROOM) + body->size;
+}
+
+
+static int sub_pack_load(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+/// nftw() callback.  Sidecars are packed with the files they belong to.
+    const char* path;
+    asset_t* asset;
+    size_t stem;
+    int rc;
+    
+    if ((typeflag != FTW_F) || (strlen(fpath) <= cache.originlen) || sub_issidecar(fpath, &stem)) {
+        return 0;
+    }
+    path = &fpath[cache.originlen + 1];
+    rc = assets_get(path, &asset);
+    if (rc == 0) {
+        assets_put(asset);
+    }
+    else if (rc == ASSETS_UNCACHED) {
+        printf("Warning: %s is too large to bundle\n", path);
+    }
+    else if (rc == ASSETS_FORBIDDEN) {
+        printf("Warning: %s has an unknown type, and it is not bundled\n", path);
+    }
+    return 0;
+}
+
+
+int assets_pack(const char* origin, const char* path) {
+    static const uint8_t pad[WFEDD_PARAM(BUNDLE_HEADROOM)];
+    uint8_t header[BUNDLE_HEADERLEN];
+    uint8_t entry[BUNDLE_ENTRYLEN];
+    char tmppath[PATH_MAX];
+    uint64_t off, indexoff;
+    uint32_t count = 0;
+    asset_t* asset;
+    FILE* fp;
+    int rc;
+    
+    if (sub_open(origin, SIZE_MAX/2, 0) != 0) {
+        return -1;
+    }
+    nftw(cache.origin, &sub_pack_load, 16, FTW_PHYS);
+    
+    if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath)) {
+        rc = -2;
+        goto assets_pack_TERM;
+    }
+    fp = fopen(tmppath, "wb");
+    if (fp == NULL) {
+        rc = -2;
+        goto assets_pack_TERM;
+    }
+    
+    // Bodies, after a placeholder for the header
+    memset(header, 0, sizeof(header));
+    fwrite(header, 1, sizeof(header), fp);
+    for (asset=cache.head; asset!=NULL; asset=asset->next) {
+        for (int enc=0; enc<ASSET_ENCODINGS; enc++) {
+            asset_body_t* body = &asset->body[enc];
+            for (size_t i=0; i<body->nchunks; i++) {
+                size_t clen = (i == (body->nchunks-1)) ? 
+                                (body->size - (i * WFEDD_PARAM(ASSET_CHUNK))) : WFEDD_PARAM(ASSET_CHUNK);
+                fwrite(pad, 1, sizeof(pad), fp);
+                fwrite(&body->chunk[i][LWS_PRE], 1, clen, fp);
+            }
+        }
+        count++;
+    }
+    
+    // Index, with the body offsets worked out again in the same order
+    off = BUNDLE_HEADERLEN;
+    for (asset=cache.head; asset!=NULL; asset=asset->next) {
+        size_t pathlen = strlen(asset->path) + 1;
+        size_t mimelen = strlen(asset->mimetype) + 1;
+        
+        sub_put32(&entry[0], (uint32_t)pathlen);
+        sub_put32(&entry[4], (uint32_t)mimelen);
+        sub_put64(&entry[8], (uint64_t)asset->mtime);
+        sub_put64(&entry[16], asset->etaghash);
+        for (int enc=0; enc<ASSET_ENCODINGS; enc++) {
+            sub_put64(&entry[24 + (16*enc)], asset->body[enc].size);
+            sub_put64(&entry[32 + (16*enc)], off);
+            off += sub_body_disklen(&asset->body[enc]);
+        }
+        fwrite(entry, 1, sizeof(entry), fp);
+        fwrite(asset->path, 1, pathlen, fp);
+        fwrite(asset->mimetype, 1, mimelen, fp);
+    }
+    indexoff = off;
+    
+    memcpy(&header[0], BUNDLE_MAGIC, 8);
+    sub_put32(&header[8], BUNDLE_VERSION);
+    sub_put32(&header[12], WFEDD_PARAM(ASSET_CHUNK));
+    sub_put32(&header[16], WFEDD_PARAM(BUNDLE_HEADROOM));
+    sub_put32(&header[20], count);
+    sub_put64(&header[24], indexoff);
+    sub_put64(&header[32], (uint64_t)ftell(fp) - indexoff);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), fp);
+    
+    rc = (int)count;
+    if (ferror(fp) | fclose(fp)) {
+        remove(tmppath);
+        rc = -3;
+    }
+    else if (rename(tmppath, path) != 0) {
+        remove(tmppath);
+        rc = -3;
+    }
+    
+    assets_pack_TERM:
+    assets_deinit();
+    return rc;
+}
+
+
+static int sub_bundle_entry(const uint8_t** cursor, const uint8_t* end, 
+                            uint32_t headroom, uint64_t bodyend) {
+/// Reads an index entry into an asset, and links it.  The bodies stay in the
+/// mapping.  Every length and offset is checked against the bundle.
+    const uint8_t* p = *cursor;
+    const char* path;
+    const char* mimetype;
+    uint32_t pathlen, mimelen;
+    asset_t* asset;
+    
+    if ((end - p) < BUNDLE_ENTRYLEN) {
+        return -1;
+    }
+    pathlen     = sub_get32(&p[0]);
+    mimelen     = sub_get32(&p[4]);
+    path        = (const char*)&p[BUNDLE_ENTRYLEN];
+    mimetype    = path + pathlen;
+    if ((pathlen == 0) || (mimelen == 0) 
+    ||  ((uint64_t)(end - p) < ((uint64_t)BUNDLE_ENTRYLEN + pathlen + mimelen))
+    ||  (path[pathlen-1] != 0) || (mimetype[mimelen-1] != 0)
+    ||  !sub_checkpath(path) || (sub_find(path, sub_hash(path)) != NULL)) {
+        return -1;
+    }
+    
+    asset = calloc(1, sizeof(asset_t));
+    if (asset == NULL) {
+        return -1;
+    }
+    asset->bundled      = true;
+    asset->path         = strdup(path);
+    asset->hash         = sub_hash(path);
+    asset->mimetype     = mimetype;
+    asset->cachecontrol = assets_cachecontrol(path);
+    asset->mtime        = (time_t)sub_get64(&p[8]);
+    asset->refs         = 1;
+    sub_etag_format(asset, sub_get64(&p[16]));
+    
+    for (int enc=0; enc<ASSET_ENCODINGS; enc++) {
+        asset_body_t* body  = &asset->body[enc];
+        uint64_t size       = sub_get64(&p[24 + (16*enc)]);
+        uint64_t off        = sub_get64(&p[32 + (16*enc)]);
+        
+        body->size      = (size_t)size;
+        body->nchunks   = (size_t)((size + WFEDD_PARAM(ASSET_CHUNK) - 1) / WFEDD_PARAM(ASSET_CHUNK));
+        if (body->nchunks == 0) {
+            continue;
+        }
+        if ((off < BUNDLE_HEADERLEN) || (off > bodyend) || (size > bodyend) 
+        ||  ((off + ((uint64_t)body->nchunks * headroom) + size) > bodyend)) {
+            sub_free(asset);
+            return -1;
+        }
+        body->chunk = calloc(body->nchunks, sizeof(uint8_t*));
+        if (body->chunk == NULL) {
+            sub_free(asset);
+            return -1;
+        }
+        for (size_t i=0; i<body->nchunks; i++) {
+            body->chunk[i] = &cache.bundle[off + (i * (headroom + WFEDD_PARAM(ASSET_CHUNK))) + headroom - LWS_PRE];
+        }
+        asset->bytes += body->size;
+    }
+    if (asset->path == NULL) {
+        sub_free(asset);
+        return -1;
+    }
+    
+    sub_link(asset);
+    *cursor = (const uint8_t*)mimetype + mimelen;
+    return 0;
+}
+
+
+int assets_openbundle(const char* path, unsigned int maxage) {
+    struct stat st;
+    const uint8_t* cursor;
+    uint8_t* base;
+    uint64_t indexoff, indexlen;
+    uint32_t count, headroom;
+    int fd;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < BUNDLE_HEADERLEN)) {
+        close(fd);
+        return -1;
+    }
+    
+    // The mapping is private and writable, so lws can write into the 
+    // headroom of a chunk.  Only the pages that it writes are copied.
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    headroom    = sub_get32(&base[16]);
+    count       = sub_get32(&base[20]);
+    indexoff    = sub_get64(&base[24]);
+    indexlen    = sub_get64(&base[32]);
+    if ((memcmp(base, BUNDLE_MAGIC, 8) != 0)
+    ||  (sub_get32(&base[8]) != BUNDLE_VERSION)
+    ||  (sub_get32(&base[12]) != WFEDD_PARAM(ASSET_CHUNK))
+    ||  (headroom < LWS_PRE)
+    ||  (indexoff < BUNDLE_HEADERLEN) || (indexoff > (uint64_t)st.st_size)
+    ||  (indexlen > ((uint64_t)st.st_size - indexoff))) {
+        printf("Error: %s is not a bundle for this build of wfedd\n", path);
+        munmap(base, (size_t)st.st_size);
+        return -2;
+    }
+    
+    if (sub_open(path, (size_t)st.st_size, maxage) != 0) {
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+    cache.bundle        = base;
+    cache.bundlesize    = (size_t)st.st_size;
+    cursor              = &base[indexoff];
+    for (uint32_t i=0; i<count; i++) {
+        if (sub_bundle_entry(&cursor, &base[indexoff + indexlen], headroom, indexoff) != 0) {
+            printf("Error: %s has a bad index entry (%u)\n", path, i);
+            assets_deinit();
+            return -3;
+        }
+    }
+    cache.stat.loads = count;
+    return 0;
+}
+
+
+
+
+/// Public Functions ----------------------------------------------------------
+
+int assets_init(const char* origin, size_t cap, bool preload, unsigned int maxage) {
+    int rc = sub_open(origin, cap, maxage);
+    
+    if (rc != 0) {
+        return rc;
+    }
+    
+    // Without a watch, the cache still works, but files that change are 
+    // served stale until they are evicted.
+#   if ASSETS_WATCH
+    cache.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.ifd >= 0) {
+        sub_watch_tree("");
+        cache.stat.watching = (cache.nwatches != 0);
+    }
+#   endif
+    
+    if (preload) {
+        nftw(cache.origin, &sub_preload, 16, FTW_PHYS);
+    }
+    return 0;
+}
+
+
+void assets_deinit(void) {
+    if (!cache.isopen) {
+        return;
+    }
+    while (cache.head != NULL) {
+        sub_drop(cache.head);
+    }
+    if (cache.ifd >= 0) {
+        close(cache.ifd);
+        cache.ifd = -1;
+    }
+    while (cache.nwatches != 0) {
+        free(cache.watch[--cache.nwatches].path);
+    }
+    free(cache.watch);
+    cache.watch     = NULL;
+    cache.walloc    = 0;
+    if (cache.bundle != NULL) {
+        munmap(cache.bundle, cache.bundlesize);
+        cache.bundle = NULL;
+    }
+    free(cache.origin);
+    cache.origin    = NULL;
+    cache.isopen    = false;
+}
+
+
+bool assets_isopen(void) {
+    return cache.isopen;
+}
+
+
+const char* assets_origin(void) {
+    return cache.origin;
+}
+
+
+int assets_get(const char* path, asset_t** asset) {
+    uint32_t hash;
+    asset_t* hit;
+    int rc;
+    
+    if (!cache.isopen) {
+        return ASSETS_UNCACHED;
+    }
+    if (!sub_checkpath(path)) {
+        return ASSETS_FORBIDDEN;
+    }
+    
+    hash    = sub_hash(path);
+    hit     = sub_find(path, hash);
+    if (hit != NULL) {
+        if (cache.head != hit) {
+            sub_lru_unlink(hit);
+            sub_lru_push(hit);
+        }
+        cache.stat.hits++;
+    }
+    else {
+        cache.stat.misses++;
+        if (cache.bundle != NULL) {
+            return ASSETS_NOTFOUND;
+        }
+        rc = sub_load(path, hash, &hit);
+        if (rc != 0) {
+            if (rc == ASSETS_UNCACHED) {
+                cache.stat.uncached++;
+            }
+            return rc;
+        }
+    }
+    
+    hit->refs++;
+    *asset = hit;
+    return 0;
+}
+
+
+void assets_put(asset_t* asset) {
+    if ((asset != NULL) && (--asset->refs == 0)) {
+        sub_free(asset);
+    }
+}
+
+
+asset_enc_t assets_select(asset_t* asset, const char* path, const char* accept) {
+    static const asset_enc_t prefer[] = { ASSET_BR, ASSET_GZIP };
+    asset_enc_t enc = ASSET_IDENTITY;
+    
+    for (size_t i=0; (i<(sizeof(prefer)/sizeof(prefer[0]))) && (enc == ASSET_IDENTITY); i++) {
+        if (!sub_accepts(accept, enc_names[prefer[i]])) {
+            continue;
+        }
+        if (asset != NULL) {
+            if (asset->body[prefer[i]].chunk != NULL) {
+                enc = prefer[i];
+            }
+        }
+        else if (cache.isopen) {
+            char sidepath[PATH_MAX];
+            struct stat st, sst;
+            int n = snprintf(sidepath, sizeof(sidepath), "%s/%s", cache.origin, path);
+            if ((n > 0) && ((size_t)n + 3 < sizeof(sidepath)) && (stat(sidepath, &st) == 0)) {
+                snprintf(&sidepath[n], sizeof(sidepath) - (size_t)n, "%s", enc_exts[prefer[i]]);
+                if ((stat(sidepath, &sst) == 0) && S_ISREG(sst.st_mode) && (sst.st_mtime >= st.st_mtime)) {
+                    enc = prefer[i];
+                }
+            }
+        }
+    }
+    cache.stat.sent[enc]++;
+    return enc;
+}
+
+
+const char* assets_encname(asset_enc_t enc) {
+    return ((unsigned)enc < ASSET_ENCODINGS) ? enc_names[enc] : NULL;
+}
+
+
+static bool sub_isfingerprint(const char* seg, size_t len) {
+/// A fingerprint is a hex or base64url run that is long enough to be a hash.
+/// A hex run has digits and letters, so a date isn't one.  A base64url run 
+/// has a letter after a digit, so a word with a number, such as "roboto400",
+/// isn't one.
+    bool hex    = true;
+    bool digit  = false;
+    bool letter = false;
+    bool mixed  = false;
+    
+    if (len < WFEDD_PARAM(ASSET_FINGERPRINT)) {
+        return false;
+    }
+    while (len-- != 0) {
+        uint8_t c = (uint8_t)*seg++;
+        if (isdigit(c)) {
+            digit = true;
+        }
+        else if (isalpha(c) || (c == '_')) {
+            hex     = hex && isxdigit(c);
+            letter  = true;
+            mixed   = mixed || digit;
+        }
+        else {
+            return false;
+        }
+    }
+    return digit && letter && (hex || mixed);
+}
+
+
+const char* assets_cachecontrol(const char* path) {
+    const char* name = strrchr(path, '/');
+    const char* ext;
+    
+    name = (name == NULL) ? path : (name + 1);
+    ext  = strrchr(name, '.');
+    if (ext == NULL) {
+        ext = &name[strlen(name)];
+    }
+    
+    // The name is split on '.' and '-'.  The leading segment is the name of
+    // the file, and it is skipped, as is the extension.
+    name += strcspn(name, ".-");
+    while (name < ext) {
+        size_t len = strcspn(++name, ".-");
+        if (sub_isfingerprint(name, len)) {
+            return cache.immutable;
+        }
+        name += len;
+    }
+    return cache.cachecontrol;
+}
+
+
+static bool sub_etag_match(const char* list, const char* etag) {
+/// If-None-Match uses the weak comparison, so a W/ prefix is ignored.
+    size_t elen = strlen(etag);
+    
+    while (*list != 0) {
+        const char* item;
+        size_t len;
+        
+        while ((*list == ' ') || (*list == '\t') || (*list == ',')) {
+            list++;
+        }
+        if (*list == '*') {
+            return true;
+        }
+        if ((list[0] == 'W') && (list[1] == '/')) {
+            list += 2;
+        }
+        item = list;
+        if (*list == '"') {
+            list = strchr(list + 1, '"');
+            list = (list == NULL) ? &item[strlen(item)] : (list + 1);
+        }
+        else {
+            list += strcspn(list, ", \t");
+        }
+        len = (size_t)(list - item);
+        if ((len == elen) && (memcmp(item, etag, len) == 0)) {
+            return true;
+        }
+        if ((*list != 0) && (*list != ',') && (*list != ' ') && (*list != '\t')) {
+            list++;
+        }
+    }
+    return false;
+}
+
+
+bool assets_notmodified(const char* etag, time_t mtime, const char* ifnonematch, const char* ifmodsince) {
+    bool fresh = false;
+    
+    if ((ifnonematch != NULL) && (*ifnonematch != 0)) {
+        fresh = (etag != NULL) && sub_etag_match(ifnonematch, etag);
+    }
+    else if ((ifmodsince != NULL) && (*ifmodsince != 0)) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(ifmodsince, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL) {
+            fresh = (mtime <= timegm(&tm));
+        }
+    }
+    if (fresh) {
+        cache.stat.notmodified++;
+    }
+    return fresh;
+}
+
+
+int assets_httpdate(time_t t, char* buf, size_t size) {
+    struct tm tm;
+    
+    gmtime_r(&t, &tm);
+    return (int)strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+
+const char* assets_encext(asset_enc_t enc) {
+    return ((unsigned)enc < ASSET_ENCODINGS) ? enc_exts[enc] : "";
+}
+
+
+uint8_t* assets_chunk(asset_t* asset, asset_enc_t enc, size_t offset, size_t* len) {
+    asset_body_t* body  = &asset->body[enc];
+    size_t i            = offset / WFEDD_PARAM(ASSET_CHUNK);
+    size_t coff         = offset % WFEDD_PARAM(ASSET_CHUNK);
+    size_t clen         = body->size - (i * WFEDD_PARAM(ASSET_CHUNK));
+    
+    if (clen > WFEDD_PARAM(ASSET_CHUNK)) {
+        clen = WFEDD_PARAM(ASSET_CHUNK);
+    }
+    *len = clen - coff;
+    return &body->chunk[i][LWS_PRE + coff];
+}
+
+
+void assets_service(void) {
+#   if ASSETS_WATCH
+    uint8_t buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint64_t now;
+    ssize_t n;
+    
+    if (cache.ifd < 0) {
+        return;
+    }
+    now = sub_now_ms();
+    if (now < cache.nextservice) {
+        return;
+    }
+    cache.nextservice = now + WFEDD_PARAM(ASSET_INTERVAL);
+    
+    while ((n = read(cache.ifd, buf, sizeof(buf))) > 0) {
+        for (uint8_t* p=buf; p<&buf[n]; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            sub_watch_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    cache.stat.watching = (cache.nwatches != 0);
+#   endif
+}
+
+
+void assets_getstats(assets_stat_t* stats) {
+    *stats = cache.stat;
+}
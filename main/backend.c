@@ -31,13 +31,16 @@
 #include "cliopt.h"
 #include "frontend.h"
 #include "backend.h"
+#include "assets.h"
+#include "bigfile.h"
 #include "debug.h"
-
-#include "../local_lib/uthash.h"
+#include "utf8.h"
 
 #include <libwebsockets.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
@@ -45,8 +48,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -62,6 +67,7 @@
 typedef enum {
     BIRQ_NONE       = 0x00,
     BIRQ_GLOBAL     = 0x01,
+    BIRQ_STATS      = 0x02,
     BIRQ_ALL        = 0xFF
 } birq_type;
 
@@ -73,15 +79,133 @@ typedef struct {
     useconds_t  wait_us;
 } fdsparam_t;
 
-typedef struct {
+/// A governor caps the message bytes queued by a group of connections: all of
+/// them (global), or those of one mapping.  When the cap is exceeded, the 
+/// governor throttles, and the inputs of the group are paused until the queued
+/// bytes drain to the low-water mark.  A limit of 0 means unlimited.
+typedef struct govern {
+    size_t          limit;
+    size_t          lowater;
+    size_t          queued;
+    size_t          peak;
+    bool            throttled;
+    unsigned long   throttles;
+    const struct lws_protocols* protocol;   // websocket protocol of a mapping
+} govern_t;
+
+/// Flags of web queue records that are fragments of a streamed message
+#define WEBF_MORE       0x01    // more fragments follow
+#define WEBF_CONT       0x02    // continues the previous fragment
+
+/// Multiplexed framing: each message to or from the daemon begins with an 8
+/// byte header, which is the channel (32 bits), the type (8 bits), and the 
+/// payload length (24 bits), all big-endian.  The channel is the ID of the 
+/// session.  OPEN and CLOSE have no payload.
+#define MUX_HDRLEN      8
+#define MUX_DATA        0
+#define MUX_OPEN        1
+#define MUX_CLOSE       2
+
+/// Counters of events of one mapping, which are printed with the statistics.
+typedef struct mapstat {
+    unsigned long   connects;       // connects that completed
+    unsigned long   connpending;    // connects that could not complete at once
+    unsigned long   connfails;      // connects that failed with an error
+    unsigned long   conntimeouts;   // connects that timed out
+    unsigned long   cframes;        // coalesced frames written
+    unsigned long   cmsgs;          // messages in coalesced frames
+    unsigned long   cheld;          // frames that were held to coalesce
+    unsigned long long clatency;    // total latency added by holding (us)
+    unsigned long   clatmax;        // largest latency added (us)
+    unsigned long   txtext;         // TEXT frames written to websockets
+    unsigned long   txbinary;       // BINARY frames written to websockets
+    unsigned long   rxdrops;        // websocket frames of the wrong payload type
+    unsigned long   streamed;       // messages sent as fragments
+    unsigned long   frags;          // fragments of those messages
+    unsigned long   zdeflated;      // messages deflated
+    unsigned long   zstored;        // messages below deflatemin, sent stored
+    unsigned long long zbytes;      // bytes of messages deflated
+    unsigned long long zcpu;        // CPU time writing those messages (ns)
+    unsigned long long zsampin;     // bytes of sampled messages
+    unsigned long long zsampout;    // bytes of sampled messages, deflated
+    unsigned long   poolhits;       // sessions that took a warm connection
+    unsigned long   poolmisses;     // sessions that found the pool empty
+    unsigned long   pooldrops;      // warm connections the daemon closed
+    unsigned long   poolfills;      // warm connections made
+    unsigned long   poolfails;      // warm connections that failed to connect
+    unsigned long   slowblocks;     // times a session paused the daemon
+    unsigned long   slowdropold;    // old messages dropped for slow sessions
+    unsigned long   slowdropnew;    // new messages dropped for slow sessions
+    unsigned long   slowcloses;     // sessions closed for being slow
+    unsigned long   conflated;      // queued messages replaced by newer ones
+    unsigned long   rxthrottles;    // pauses of sessions by their own buckets
+    unsigned long   rxmapthrottles; // pauses of sessions by the mapping's
+    unsigned long long rxwait;      // total time of those pauses (us)
+} mapstat_t;
+
+/// Warm daemon connections of a mapping, which are connected before the
+/// sessions that take them.  The pool refills to poolmin, or to poolmax for
+/// a while after a session found it empty.
+typedef struct pool {
+    int*            fd;             // connected, non-blocking sockets
+    size_t          size;
+    uint64_t        lastmiss;       // time (ms) a session found it empty
+} pool_t;
+
+/// The hub of a fan-out or multiplexed mapping owns the daemon connection 
+/// that its sessions share.  A fan-out hub reads from the daemon into its own
+/// web queue, like any connection, and then it publishes each message: the 
+/// message is copied once into a pool block, and a reference to the block is
+/// queued to every subscriber.  The block is freed, and its bytes leave the 
+/// governors, when the last subscriber has written it.  A multiplexed hub 
+/// frames each message straight into the queue of the subscriber of its 
+/// channel, which it finds in a hash table keyed by the subscriber ID.
+typedef struct hub {
+    conn_t          conn;           // hub connection, id 0 while it is closed
+    conn_t**        subs;           // subscribers, dense like the conn table
+    size_t          nsubs;
+    size_t          asubs;
+    conn_t**        chan;           // subscribers by channel (mux), open hashing
+    size_t          chanmask;       // slots in chan, less 1
+    unsigned long   published;      // messages published to subscribers
+    unsigned long   refs;           // references queued to subscribers
+    unsigned long   stalls;         // publishes that waited for a subscriber
+    unsigned long   demuxed;        // messages routed to subscribers (mux)
+    unsigned long   ctllost;        // OPEN or CLOSE lost to a full queue (mux)
+} hub_t;
+
+typedef struct backend {
     struct lws_context* ws_context;
     socklist_t*         socklist;
-    void*               buf;
-    size_t              bufsize;
     volatile birq_type  irq;
     
-    // Dictionary is still used, but it's not fully required apart from storage
-    void*               filedict;
+    // Governors of queued bytes: global, and one per mapping in socklist
+    govern_t            govern;
+    govern_t*           mapgov;
+    struct lws_protocols* protocols;
+    
+    // Counters, one per mapping in socklist
+    mapstat_t*          mapstat;
+    
+    // Rate limits of websocket rx, one per mapping in socklist
+    rxlimit_t*          maprx;
+    
+    // Hubs, one per mapping in socklist, used if the mapping fans out or 
+    // multiplexes
+    hub_t*              hubs;
+    
+    // Pools of warm connections, one per mapping in socklist, and the time 
+    // (ms) of the next refill
+    pool_t*             pools;
+    uint64_t            poolnext;
+    
+    // Dense table of live connections
+    struct {
+        conn_t**        conn;
+        size_t          size;
+        size_t          alloc;
+        uint32_t        generation;
+    } conntab;
     
     // These are deprecated, and are pending delete
     struct pollfd*      fds;
@@ -94,482 +218,2557 @@ typedef struct {
 
 
 
-/// ----- Connection Dictionary ---------
-/// This is a connection to a backend client socket from a frontend websocket.
-/// Daemons are expected to be able to handle multiple client connections.
-/// Connections are stored in a hash table.
+/// ----- Connection Table ---------
+/// Connections are stored inline in the per-session data of their websockets,
+/// so the backend only keeps a table of pointers to the live ones.  The table
+/// is dense: each connection knows its slot, and a deleted connection is 
+/// replaced by the last one in the table.  Each connection is tagged with a 
+/// generation number when it is added, which is its ID.  The table is used 
+/// for introspection and to check for leftover connections at shutdown.
+
+static int sub_conntab_add(backend_t* backend, conn_t* conn) {
+    if (backend->conntab.size >= backend->conntab.alloc) {
+        size_t  alloc   = (backend->conntab.alloc != 0) ? (2 * backend->conntab.alloc) : 16;
+        conn_t** table  = realloc(backend->conntab.conn, alloc * sizeof(conn_t*));
+        if (table == NULL) {
+            return -1;
+        }
+        backend->conntab.conn   = table;
+        backend->conntab.alloc  = alloc;
+    }
+    
+    // ID 0 means that the connection is not in the table
+    if (++backend->conntab.generation == 0) {
+        backend->conntab.generation = 1;
+    }
+    conn->id    = backend->conntab.generation;
+    conn->slot  = backend->conntab.size++;
+    backend->conntab.conn[conn->slot] = conn;
+    return 0;
+}
 
-typedef struct cs {
-    int         fd_ds;
-    sockmap_t*  sock_handle;
-    mq_t        mqweb;
-    mq_t        mqlocal;
-} conn_t;
 
+static void sub_conntab_del(backend_t* backend, conn_t* conn) {
+    conn_t* last;
+    
+    if ((conn->id == 0) || (conn->slot >= backend->conntab.size) 
+    || (backend->conntab.conn[conn->slot] != conn)) {
+        return;
+    }
+    last        = backend->conntab.conn[--backend->conntab.size];
+    last->slot  = conn->slot;
+    backend->conntab.conn[last->slot] = last;
+    conn->id    = 0;
+}
 
-typedef union {
-    void* pointer;
-    int64_t integer;
-    double number;
-} dict_union;
+/// --------------------------------------
 
-struct itemstruct {
-    int id;
-    void* data;
-    UT_hash_handle hh;
-};
 
-typedef struct {
-    size_t size;
-    struct itemstruct* base;
-} dict_t;
 
 
+/// ----- Queue Governors ---------
 
-static struct itemstruct* sub_finditem(dict_t* dict, int id) {
-    struct itemstruct* item;
-    HASH_FIND_INT(dict->base, &id, item);
-    return item;
+static void sub_govern_init(govern_t* gov, size_t limit, const struct lws_protocols* protocol) {
+    gov->limit      = limit;
+    gov->lowater    = (limit / 100) * WFEDD_PARAM(QBUDGET_LOWATER);
+    gov->queued     = 0;
+    gov->peak       = 0;
+    gov->throttled  = false;
+    gov->throttles  = 0;
+    gov->protocol   = protocol;
 }
 
 
-void* dict_init(void) {
-    dict_t* dict;
-    
-    dict = malloc(sizeof(dict_t));
-    if (dict != NULL) {
-        dict->size = 0;
-        dict->base = NULL;
+static void sub_govern_add(govern_t* gov, size_t len) {
+    gov->queued += len;
+    if (gov->queued > gov->peak) {
+        gov->peak = gov->queued;
+    }
+    if ((gov->limit != 0) && !gov->throttled && (gov->queued > gov->limit)) {
+        gov->throttled = true;
+        gov->throttles++;
     }
-
-    return dict;
 }
 
 
-void dict_deinit(void* handle) {
-    struct itemstruct* tmp;
-    struct itemstruct* item;
-    
-    if (handle != NULL) {
-        struct itemstruct* itemtab = ((dict_t*)handle)->base;
-        
-        HASH_ITER(hh, itemtab, item, tmp) {
-            HASH_DEL(itemtab, item);         // delete item (vartab advances to next)
-            free(item);
-        }
-        
-        free(handle);
+static bool sub_govern_sub(govern_t* gov, size_t len) {
+/// Returns true when the governor stops throttling
+    gov->queued = (len < gov->queued) ? (gov->queued - len) : 0;
+    if (gov->throttled && (gov->queued <= gov->lowater)) {
+        gov->throttled = false;
+        return true;
     }
+    return false;
 }
 
 
-int dict_del(void* handle, int id) {
-    struct itemstruct* input;
-    dict_t* dict;
-    int dels = 0;
-    
-    if (handle != NULL) {
-        dict = handle;
-        if (dict->base != NULL) {
-            input = sub_finditem(dict, id);
-            if (input != NULL) {
-                HASH_DEL(dict->base, input);
-                free(input->data);
-                free(input);
-                dels = 1;
-                dict->size--;
+static void sub_govern_wake(backend_t* backend, govern_t* gov) {
+/// Sessions that were paused by a governor may have nothing queued, so they
+/// are woken with a writeable callback, where they resume their inputs.
+    if (backend->ws_context == NULL) {
+        return;
+    }
+    if (gov->protocol != NULL) {
+        lws_callback_on_writable_all_protocol(backend->ws_context, gov->protocol);
+    }
+    else {
+        for (size_t i=0; i<backend->socklist->size; i++) {
+            if (backend->mapgov[i].protocol != NULL) {
+                lws_callback_on_writable_all_protocol(backend->ws_context, backend->mapgov[i].protocol);
             }
         }
     }
-    return dels;
 }
 
 
-void* dict_new(int* err, void* handle, int id) {
-    struct itemstruct* input;
-    dict_t* dict;
-    int rc;
-    void* rp = NULL;
-    
-    if (handle == NULL) {
-        rc = 1;
-        goto dict_new_EXIT;
-    }
-    dict = handle;
-    
-    input = sub_finditem(dict, id);
-    if (input != NULL) {
-        rc = 2;
-        rp = input->data;
-        goto dict_new_EXIT;
-    }
-    
-    input = malloc(sizeof(struct itemstruct));
-    if (input == NULL) {
-        rc = 3;
-        goto dict_new_EXIT;
-    }
-    
-    input->data = malloc(sizeof(conn_t));
-    if (input->data == NULL) {
-        free(input);
-        rc = 4;
-        goto dict_new_EXIT;
-    }
-    
-    input->id = id;
-    dict->size++;
-    rp = input->data;
-    rc = 0;
-    
-    dict_new_EXIT:
-    if (err != NULL) *err = rc;
-    return rp;
+static void sub_queued(conn_t* conn, size_t len) {
+    sub_govern_add(&conn->backend->govern, len);
+    sub_govern_add(conn->mapgov, len);
 }
 
 
+static uint64_t sub_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000) + (uint64_t)(now.tv_nsec / 1000);
+}
 
-void* dict_get(void* handle, int id) {
-    struct itemstruct* item;
-    dict_t* dict;
-    
-    if (handle != NULL) {
-        dict = handle;
-        if (dict->base != NULL) {
-            item = sub_finditem(dict, id);
-            if (item != NULL) {
-                return item->data;
-            }
-        }
-    }
 
-    return NULL;
+static uint64_t sub_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000) + (uint64_t)(now.tv_nsec / 1000000);
 }
 
-/// --------------------------------------
 
+static void sub_webqueued(conn_t* conn, size_t len) {
+/// Messages queued for the websocket are timed for coalescing
+    if ((conn->cbuf != NULL) && (conn->cstamp == 0)) {
+        conn->cstamp = sub_now_us();
+    }
+    sub_queued(conn, len);
+}
 
 
+static void sub_dequeued(conn_t* conn, size_t len) {
+    if (sub_govern_sub(conn->mapgov, len)) {
+        sub_govern_wake(conn->backend, conn->mapgov);
+    }
+    if (sub_govern_sub(&conn->backend->govern, len)) {
+        sub_govern_wake(conn->backend, &conn->backend->govern);
+    }
+}
 
+/// --------------------------------------
 
 
 
 
+/// ----- Slow Consumers ---------
+/// A session whose web queue is above the high-water mark of its mapping is 
+/// slow.  The policy of the mapping decides what happens to the next message
+/// for it: the daemon waits (block), the oldest queued messages are dropped
+/// to make room (dropold), the message is dropped (dropnew), or the session 
+/// is closed and its messages are dropped until it is (close).  A queue that
+/// is empty takes any message, so a mark below msgmax can't stall a session.
+/// The web queue of a fan-out subscriber or a conflating session holds 
+/// references, so its mark is its depth.  A hub is not a session, and it 
+/// always waits.
 
+static bool sub_issubscriber(conn_t* conn);
+static bool sub_isfanout(conn_t* conn);
+static bool sub_isrefq(conn_t* conn);
+static void sub_unref(conn_t* conn);
 
-///@todo could have sig input correspond to some IRQs.
-volatile birq_type* birq_pointer;
-void backend_inthandler(int sig) {
-    *birq_pointer = BIRQ_GLOBAL;
+static bool sub_slow_hasroom(conn_t* conn, size_t len) {
+    size_t mark = conn->sock_handle->slowmark;
+    if (sub_isrefq(conn)) {
+        return mq_hasroom(&conn->mqweb, sizeof(mq_msg_t*));
+    }
+    if (!mq_hasroom(&conn->mqweb, len)) {
+        return false;
+    }
+    return (conn->mqweb.bytes == 0) || ((conn->mqweb.bytes + len) <= mark);
 }
 
 
-
-int backend_run(socklist_t* socklist, 
-                int intsignal,
-                int logs_mask,
-                bool do_hostcheck,
-                bool do_fastmonitoring,
-                const char* hostname,
-                int port_number,
-                const char* certpath,
-                const char* keypath,
-                struct lws_protocols* protocols,
-                struct lws_http_mount* mount) {
-
-    int rc = 0;
-    backend_t backend;
-    int lws_rc = 0;
+static int sub_slow_admit(conn_t* conn, size_t len) {
+/// Returns 1 if a message of len bytes may be queued for the session, 0 if it
+/// must wait for room, or -1 if it is dropped.
+    size_t oldlen;
     
-    /// 1. Initialize the backend object
-    
-    ///@todo take bufsize from cliopts.  Currently hardcoded to 1024.
-    backend.bufsize = 1024;
-    backend.buf = malloc(backend.bufsize);
-    if (backend.buf == NULL) {
+    if (conn->sclose) {
         return -1;
     }
-    
-    // Things that must be initialized externally
-    backend.socklist = socklist;
-
-    // initialize filedict
-    backend.filedict = dict_init();
-    if (backend.filedict == NULL) {
-        rc = -2;
-        goto backend_run_EXIT;
-    }
-
-    /// 2. Start the frontend.  These are the websockets.  Any messages that 
-    ///    are generated by the daemon sockets prior to frontend being online
-    ///    will be queued.  The frontend->backend path is more direct, thus 
-    ///    the backend is started before the frontend.
-    backend.ws_context = frontend_start(&backend, logs_mask, do_hostcheck, 
-                            do_fastmonitoring, hostname, port_number, certpath, 
-                            keypath, protocols, mount);
-    if (backend.ws_context == NULL) {
-        rc = -4;
-        goto backend_run_EXIT;
+    if ((conn->hub != NULL) && !sub_issubscriber(conn)) {
+        return mq_hasroom(&conn->mqweb, len) ? 1 : 0;
     }
     
-    /// 3. Configure an IRQ in order to stop wfedd asynchronously. 
-    backend.irq     = BIRQ_NONE;
-    birq_pointer    = &(backend.irq);
-    signal(intsignal, backend_inthandler);
-    
-    /// 4. Run the service loop.
-    while ((backend.irq == BIRQ_NONE) && (lws_rc >= 0)) {
-        lws_rc = lws_service(backend.ws_context, 0);
+    while (!sub_slow_hasroom(conn, len)) {
+        switch (conn->sock_handle->slowpolicy) {
+            case SLOW_DROPOLD:
+                if (mq_isempty(&conn->mqweb)) {
+                    conn->mapstat->slowdropnew++;
+                    return -1;
+                }
+                if (sub_isrefq(conn)) {
+                    sub_unref(conn);
+                }
+                else if (mq_peek(&conn->mqweb, &oldlen) != NULL) {
+                    mq_pop(&conn->mqweb);
+                    sub_dequeued(conn, oldlen);
+                }
+                conn->mapstat->slowdropold++;
+                break;
+                
+            case SLOW_DROPNEW:
+                conn->mapstat->slowdropnew++;
+                return -1;
+            
+            // The websocket closes from its writeable callback
+            case SLOW_CLOSE:
+                conn->sclose = true;
+                conn->mapstat->slowcloses++;
+                if (conn->wsi != NULL) {
+                    lws_callback_on_writable(conn->wsi);
+                }
+                return -1;
+            
+            default:
+                if (!conn->sblocked) {
+                    conn->sblocked = true;
+                    conn->mapstat->slowblocks++;
+                }
+                return 0;
+        }
     }
     
-    /// 5. Runtime loop is over, so first close the libwebsockets context, and 
-    ///    second, close all the backend socket fds.
-    ///@todo detach signal?
-    frontend_stop(backend.ws_context);
+    conn->sblocked = false;
+    return 1;
+}
 
-    {   struct itemstruct*  dict_item;
+/// --------------------------------------
 
-        // Start at the front of the filedict linked-list
-        dict_item = ((dict_t*)backend.filedict)->base;
-        while (dict_item != NULL) {
-            close( ((conn_t*)dict_item->data)->fd_ds );
-            dict_item = (struct itemstruct*)(dict_item->hh.next);
-        }
-    }
 
-    backend_run_EXIT:
-    switch (rc) {
-        default:    
-        case -4:    //free(backend.fds);
-        case -3:    dict_deinit(backend.filedict);
-        case -2:    free(backend.buf);
-        case -1:    break;
-    }
-    return rc;
-}
 
 
+/// ----- Reference Queues & Conflation ---------
+/// A reference record in a web queue is the pointer to a message block, whose
+/// payload is preceded by LWS_PRE bytes.  lws_write() uses that headroom for
+/// the frame header.  The blocks of a fan-out subscriber are shared, and the
+/// block of a conflating session is its own.
+/// A conflating mapping finds a key in each message: a byte prefix, or the 
+/// value of a JSON member.  A session keeps at most one queued message per 
+/// key: a new message replaces the queued one in place, so the session gets
+/// the current value where the old one was queued, and its queue is bounded
+/// by the number of keys instead of the message rate.  Messages without a key
+/// are queued as they are.  The key of a message is found once, and it is 
+/// kept in its block, which is shared by the subscribers of a fan-out hub.
+/// The key table is open-addressed by the hash of the key, and it holds the 
+/// records of the queued messages, so the keys are not copied.  It is sized
+/// to be at most half full when the queue is.
 
-int conn_putmsg_forweb(void* conn_handle, void* data, size_t len) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    conn_t* conn;
-    mq_msg_t* msg;
+typedef struct ckey {
+    uint32_t    hash;
+    uint8_t*    rec;        // reference record in the web queue, NULL if free
+} ckey_t;
 
-    if ((conn_handle == NULL) || (data == NULL) || (len == 0)) {
+static bool sub_isrefq(conn_t* conn) {
+    return sub_isfanout(conn) || (conn->ktab != NULL);
+}
+
+
+static int sub_refq_init(conn_t* conn) {
+/// A reference record is the pointer and its header.  The queue holds 
+/// conflatekeys of them in a conflating mapping, or else FANOUT_DEPTH.
+    sockmap_t* map  = conn->sock_handle;
+    size_t depth    = (map->conflate != CONFLATE_OFF) ? map->conflatekeys : WFEDD_PARAM(FANOUT_DEPTH);
+    size_t size;
+    
+    if (mq_init(&conn->mqweb, depth * (sizeof(uint64_t) + sizeof(mq_msg_t*)), 0) != 0) {
         return -1;
     }
-    
-    conn = conn_handle;
-    msg = frontend_createmsg(data, len);
-    if (msg == NULL) {
-        return -2;
+    if (map->conflate != CONFLATE_OFF) {
+        for (size = 32; size < (2 * depth); size *= 2);
+        conn->ktab = calloc(size, sizeof(ckey_t));
+        if (conn->ktab == NULL) {
+            mq_deinit(&conn->mqweb);
+            return -1;
+        }
+        conn->kmask = size - 1;
     }
-    
-    mq_putmsg(&conn->mqweb, msg);
     return 0;
 }
 
-int conn_putmsg_forlocal(void* conn_handle, void* data, size_t len) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    conn_t* conn;
+
+static mq_msg_t* sub_getref(const uint8_t* rec) {
+/// Records are only aligned to 32 bits, so the pointer is copied out
     mq_msg_t* msg;
+    memcpy(&msg, rec, sizeof(mq_msg_t*));
+    return msg;
+}
 
-    if ((conn_handle == NULL) || (data == NULL) || (len == 0)) {
-        return -1;
+
+static mq_msg_t* sub_peekref(conn_t* conn) {
+    size_t len;
+    uint8_t* rec = mq_peek(&conn->mqweb, &len);
+    return (rec != NULL) ? sub_getref(rec) : NULL;
+}
+
+
+static void sub_release(conn_t* conn, mq_msg_t* msg) {
+/// The last reference to a message frees it, and its bytes leave the governors
+    if (msg->refs == 1) {
+        sub_dequeued(conn, msg->size - LWS_PRE);
     }
+    msg_free(msg);
+}
 
-    conn = conn_handle;
-    msg = msg_new(len);
-    if (msg == NULL) {
-        return -2;
+
+static const uint8_t* sub_ckey_parse(const sockmap_t* map, const uint8_t* data, size_t len, size_t* klen) {
+/// Returns the key of a message, or NULL if it has none.  A JSON key is the 
+/// value of the first member with the name, as it is written, so a string 
+/// keeps its quotes, and "1" and 1 are different keys.
+    const uint8_t* p    = data;
+    const uint8_t* end  = data + len;
+    size_t nlen         = strlen(map->conflatekey);
+    
+    if (map->conflate == CONFLATE_PREFIX) {
+        *klen = (len < map->conflatelen) ? len : map->conflatelen;
+        return p;
     }
     
-    memcpy((void*)msg->data, data, len);
-    mq_putmsg(&conn->mqlocal, msg);
-    return 0;
+    while ((p = memchr(p, '"', end - p)) != NULL) {
+        const uint8_t* val;
+        p++;
+        if (((size_t)(end - p) <= nlen) || (memcmp(p, map->conflatekey, nlen) != 0) || (p[nlen] != '"')) {
+            continue;
+        }
+        for (val = p + nlen + 1; (val < end) && isspace(*val); val++);
+        if ((val >= end) || (*val != ':')) {
+            continue;
+        }
+        for (val++; (val < end) && isspace(*val); val++);
+        if ((val < end) && (*val == '"')) {
+            for (p = val + 1; (p < end) && (*p != '"'); p++) {
+                if (*p == '\\') {
+                    p++;
+                }
+            }
+            if (p >= end) {
+                return NULL;
+            }
+            p++;
+        }
+        else {
+            for (p = val; (p < end) && (*p != ',') && (*p != '}') && (*p != ']') && !isspace(*p); p++);
+        }
+        if (p == val) {
+            return NULL;
+        }
+        *klen = (size_t)(p - val);
+        return val;
+    }
+    return NULL;
 }
 
 
-mq_msg_t* conn_getmsg_forweb(void* conn_handle) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    mq_msg_t* msg = NULL;
-    if (conn_handle != NULL) {
-        msg = mq_getmsg( &(((conn_t*)conn_handle)->mqweb) );
+static void sub_ckey(const sockmap_t* map, const uint8_t* data, size_t len, mq_key_t* key) {
+/// Finds the key of a message, and its hash, which is FNV-1a.  The length of
+/// the key is 0 if it has none, or if the mapping doesn't conflate.
+    const uint8_t* k = NULL;
+    size_t klen = 0;
+    size_t i;
+    
+    if (map->conflate != CONFLATE_OFF) {
+        k = sub_ckey_parse(map, data, len, &klen);
+    }
+    key->hash   = 2166136261u;
+    key->off    = (k != NULL) ? (uint32_t)(k - data) : 0;
+    key->len    = (k != NULL) ? (uint32_t)klen : 0;
+    for (i=0; i<key->len; i++) {
+        key->hash = (key->hash ^ k[i]) * 16777619u;
     }
-    return msg;
 }
 
-mq_msg_t* conn_getmsg_forlocal(void* conn_handle) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    mq_msg_t* msg = NULL;
-    if (conn_handle != NULL) {
-        msg = mq_getmsg( &(((conn_t*)conn_handle)->mqlocal) );
+
+static ckey_t* sub_ckey_find(conn_t* conn, const uint8_t* data, const mq_key_t* key) {
+/// Returns the table entry of a key, found in the message data: the entry of
+/// the queued message of the key, or else the free entry where it goes.  
+/// Returns NULL if the message has no key.  The keys are compared in place.
+    size_t i;
+    
+    if (key->len == 0) {
+        return NULL;
     }
-    return msg;
+    for (i = key->hash & conn->kmask; conn->ktab[i].rec != NULL; i = (i + 1) & conn->kmask) {
+        if (conn->ktab[i].hash == key->hash) {
+            mq_msg_t* qmsg = sub_getref(conn->ktab[i].rec);
+            if ((qmsg->key.len == key->len) 
+            &&  (memcmp(&qmsg->data[LWS_PRE + qmsg->key.off], &data[key->off], key->len) == 0)) {
+                break;
+            }
+        }
+    }
+    return &conn->ktab[i];
 }
 
 
-bool conn_hasmsg_forweb(void* conn_handle) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    bool result = false;
-    if (conn_handle != NULL) {
-        result = !mq_isempty( &(((conn_t*)conn_handle)->mqweb) );
+static void sub_ckey_unlink(conn_t* conn, const uint8_t* rec) {
+/// Linear probing with backward shift, as for the mux channels
+    mq_msg_t* msg   = sub_getref(rec);
+    size_t mask     = conn->kmask;
+    ckey_t* e;
+    size_t i, j;
+    
+    e = sub_ckey_find(conn, &msg->data[LWS_PRE], &msg->key);
+    if ((e == NULL) || (e->rec != rec)) {
+        return;
+    }
+    i = (size_t)(e - conn->ktab);
+    e->rec = NULL;
+    for (j = (i + 1) & mask; conn->ktab[j].rec != NULL; j = (j + 1) & mask) {
+        size_t home = conn->ktab[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            conn->ktab[i]       = conn->ktab[j];
+            conn->ktab[j].rec   = NULL;
+            i = j;
+        }
     }
-    return result;
 }
 
-bool conn_hasmsg_forlocal(void* conn_handle) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    bool result = false;
-    if (conn_handle != NULL) {
-        result = !mq_isempty( &(((conn_t*)conn_handle)->mqlocal) );
+
+static bool sub_conflate_isqueued(conn_t* conn, const uint8_t* data, const mq_key_t* key) {
+/// True if a message of the same key is queued, which the message replaces 
+/// without needing room
+    ckey_t* e;
+    if (conn->ktab == NULL) {
+        return false;
     }
-    return result;
+    e = sub_ckey_find(conn, data, key);
+    return (e != NULL) && (e->rec != NULL);
 }
 
 
+static int sub_putref(conn_t* conn, mq_msg_t* msg, uint32_t flags) {
+/// Queues a reference to a message, which the caller counts.  In a 
+/// conflating mapping, it replaces the queued message of the same key, which
+/// is released.  The key of the message must be set.  Returns -1 if there is
+/// no room.
+    ckey_t* e = NULL;
+    uint8_t* rec;
+    
+    if (conn->ktab != NULL) {
+        e = sub_ckey_find(conn, &msg->data[LWS_PRE], &msg->key);
+        if ((e != NULL) && (e->rec != NULL)) {
+            mq_msg_t* old = sub_getref(e->rec);
+            memcpy(e->rec, &msg, sizeof(mq_msg_t*));
+            sub_release(conn, old);
+            conn->mapstat->conflated++;
+            return 0;
+        }
+    }
+    if (!mq_hasroom(&conn->mqweb, sizeof(mq_msg_t*))) {
+        return -1;
+    }
+    if (e == NULL) {
+        mq_putmsg_flags(&conn->mqweb, &msg, sizeof(mq_msg_t*), flags);
+        return 0;
+    }
+    rec = mq_reserve(&conn->mqweb, sizeof(mq_msg_t*));
+    memcpy(rec, &msg, sizeof(mq_msg_t*));
+    mq_commit(&conn->mqweb, sizeof(mq_msg_t*));
+    e->hash = msg->key.hash;
+    e->rec  = rec;
+    return 0;
+}
 
 
+static void sub_unref(conn_t* conn) {
+/// Pops the oldest reference, and releases its message
+    size_t len;
+    uint8_t* rec = mq_peek(&conn->mqweb, &len);
+    mq_msg_t* msg;
+    if (rec != NULL) {
+        msg = sub_getref(rec);
+        if (conn->ktab != NULL) {
+            sub_ckey_unlink(conn, rec);
+        }
+        mq_pop(&conn->mqweb);
+        sub_release(conn, msg);
+    }
+}
 
+/// --------------------------------------
 
 
 
-void* conn_new(void* backend_handle, const char* ws_name) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    backend_t*  backend = backend_handle;
-    conn_t*     conn    = NULL;
-    sockmap_t*  lsock   = NULL;
-    int fd_ds;
-    int err;
 
-    if ((backend_handle == NULL) || (ws_name == NULL)) {
-        return NULL;
-    }
+/// ----- Shared Connections ---------
+/// A subscriber is a session of a fan-out or multiplexed mapping.  Its hub is
+/// the shared connection, which is not a subscriber of itself.  In fan-out, a
+/// reference record in the web queue of a subscriber is the pointer to a 
+/// shared message block, whose payload is preceded by LWS_PRE bytes.  
+/// lws_write() uses that headroom for the frame header, which is written 
+/// again by each subscriber.  In mux, the web queue of a subscriber is a 
+/// normal one.
 
-    // Create a new client socket to the daemon mapped to the specified websocket
-    fd_ds = socklist_newclient(&lsock, backend->socklist, ws_name);
-    if (fd_ds < 0) {
-        goto conn_new_TERM1;
-    }
+static void* sub_conn_init(backend_t* backend, conn_t* conn, const char* ws_name);
+static int sub_unframe(conn_t* conn);
 
-    // Create a new connection entry based on the new client socket
-    conn = (conn_t*)dict_new(&err, backend->filedict, fd_ds);
-    if (err != 0) {
-        if (conn != NULL) {
-            // this fd already exists in the filedict.  That's a problem that needs to be debugged
-            printf("fd collision in filedict (fd = %i)\n", fd_ds);
-        }
-        goto conn_new_TERM2;
-    }
+static bool sub_issubscriber(conn_t* conn) {
+    return (conn->hub != NULL) && (conn != &conn->hub->conn);
+}
 
-    conn->fd_ds         = fd_ds;
-    conn->sock_handle   = lsock;
-    mq_init(&conn->mqweb);
-    mq_init(&conn->mqlocal);
-    return conn;
-    
-    // De-allocate on failures
-    dict_del(backend->filedict, fd_ds);
-    conn_new_TERM2:
-    close(fd_ds);
-    conn_new_TERM1:
-    return NULL;
+static bool sub_isfanout(conn_t* conn) {
+    return sub_issubscriber(conn) && (conn->sock_handle->fanout != 0);
 }
 
+static bool sub_ismux(conn_t* conn) {
+    return sub_issubscriber(conn) && (conn->sock_handle->framing == FRAMING_MUX);
+}
 
-void conn_del(void* backend_handle, void* conn_handle) {
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    backend_t*  backend = backend_handle;
-    conn_t*     conn    = conn_handle;
 
-    if ((backend_handle != NULL) && (conn_handle != NULL)) {
-        // Remap the poll array without the removed connection
-        dict_del(backend->filedict, conn->fd_ds);
+static conn_t* sub_upstream(conn_t* conn) {
+/// Returns the connection that owns the daemon socket, or NULL if the hub of
+/// a subscriber is closed.
+    if ((conn != NULL) && sub_issubscriber(conn)) {
+        return (conn->hub->conn.id != 0) ? &conn->hub->conn : NULL;
     }
+    return conn;
 }
 
 
-
-
-int conn_open(void* conn_handle) {
-/// Used by frontend when a websocket opens a client connection.
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    int rc;
-    conn_t* conn;
-    struct sockaddr_un addr;
+static int sub_mux_put(conn_t* up, uint32_t chan, uint8_t type, const void* data, size_t len) {
+/// Queues a message for a multiplexed daemon, behind its header
+    uint8_t* rec;
     
-    if (conn_handle == NULL) {
+    if (len > 0xFFFFFF) {
         return -1;
     }
-    conn = conn_handle;
-    
-    // Open a connection to the client socket
-    ///@todo the connection procedure could be different for different conn types
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, conn->sock_handle->l_socket, UNIX_PATH_MAX);
-    
-    rc = connect(conn->fd_ds, (struct sockaddr *)&addr, sizeof(struct sockaddr_un));
-    return rc;
+    rec = mq_reserve(&up->mqlocal, MUX_HDRLEN + len);
+    if (rec == NULL) {
+        return -2;
+    }
+    rec[0] = (uint8_t)(chan >> 24);
+    rec[1] = (uint8_t)(chan >> 16);
+    rec[2] = (uint8_t)(chan >> 8);
+    rec[3] = (uint8_t)chan;
+    rec[4] = type;
+    rec[5] = (uint8_t)(len >> 16);
+    rec[6] = (uint8_t)(len >> 8);
+    rec[7] = (uint8_t)len;
+    if (len != 0) {
+        memcpy(&rec[MUX_HDRLEN], data, len);
+    }
+    mq_commit(&up->mqlocal, MUX_HDRLEN + len);
+    sub_queued(up, MUX_HDRLEN + len);
+    return 0;
 }
 
 
-
-void conn_close(void* conn_handle) {
-/// Used by frontend when a websocket closes a client connection
-    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    if (conn_handle == NULL) {
-        return;
+static void sub_mux_ctl(hub_t* hub, conn_t* sub, uint8_t type) {
+/// The daemon is told when a channel opens and closes.  Control messages 
+/// share the queue with data, and they are counted if it is full.
+    if ((hub->conn.id != 0) && (sub_mux_put(&hub->conn, sub->id, type, NULL, 0) != 0)) {
+        hub->ctllost++;
     }
-    
-    // Close this connection
-    ///@todo might be different ways to close based on different connection types
-    close ( ((conn_t*)conn_handle)->fd_ds );
 }
 
 
+static void sub_mux_link(hub_t* hub, conn_t* sub) {
+    size_t i = sub->id & hub->chanmask;
+    while (hub->chan[i] != NULL) {
+        i = (i + 1) & hub->chanmask;
+    }
+    hub->chan[i] = sub;
+}
 
-int conn_readraw_local(void** data, void* backend_handle, void* conn_handle) {
-/// returns the number of bytes read, or negative on error.
-/// "data" parameter stores a void* output
-/// backend_handle is needed to locate the read buffer
-/// conn_handle is needed to determine the type of read to be done.
+
+static void sub_mux_unlink(hub_t* hub, conn_t* sub) {
+/// Linear probing with backward shift: the entries after the hole move into
+/// it, unless that would put them ahead of their home slot.
+    size_t mask = hub->chanmask;
+    size_t i, j;
+    
+    for (i = sub->id & mask; hub->chan[i] != sub; i = (i + 1) & mask) {
+        if (hub->chan[i] == NULL) {
+            return;
+        }
+    }
+    hub->chan[i] = NULL;
+    for (j = (i + 1) & mask; hub->chan[j] != NULL; j = (j + 1) & mask) {
+        size_t home = hub->chan[j]->id & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            hub->chan[i] = hub->chan[j];
+            hub->chan[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+
+static int sub_mux_reserve(hub_t* hub) {
+/// The channel table is kept at most half full, and it doubles as needed.
+/// Subscriber IDs are sequential, so they hash well by their low bits.
+    conn_t** table;
+    size_t size = hub->chanmask + 1;
+    
+    if ((hub->chan != NULL) && ((2 * (hub->nsubs + 1)) <= size)) {
+        return 0;
+    }
+    size    = (hub->chan != NULL) ? (2 * size) : 32;
+    table   = calloc(size, sizeof(conn_t*));
+    if (table == NULL) {
+        return -1;
+    }
+    free(hub->chan);
+    hub->chan       = table;
+    hub->chanmask   = size - 1;
+    for (size_t i=0; i<hub->nsubs; i++) {
+        sub_mux_link(hub, hub->subs[i]);
+    }
+    return 0;
+}
+
+
+static conn_t* sub_mux_route(conn_t* conn, const uint8_t* hdr) {
+/// Returns the subscriber of a DATA message from the daemon, or NULL if its 
+/// channel is closed.  A CLOSE ends the channel of a subscriber, which is 
+/// woken to close its websocket.
+    uint32_t chan = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16)
+                  | ((uint32_t)hdr[2] << 8)  | (uint32_t)hdr[3];
+    conn_t* sub = NULL;
+    
+    if ((chan != 0) && (conn->hub->chan != NULL)) {
+        size_t mask = conn->hub->chanmask;
+        for (size_t i = chan & mask; conn->hub->chan[i] != NULL; i = (i + 1) & mask) {
+            if (conn->hub->chan[i]->id == chan) {
+                sub = conn->hub->chan[i];
+                break;
+            }
+        }
+    }
+    if ((sub != NULL) && (hdr[4] == MUX_CLOSE) && (sub->state != CONN_ENDED)) {
+        sub->state = CONN_ENDED;
+        if (sub->wsi != NULL) {
+            lws_callback_on_writable(sub->wsi);
+        }
+    }
+    return (hdr[4] == MUX_DATA) ? sub : NULL;
+}
+
+
+static conn_t* sub_hub_open(backend_t* backend, hub_t* hub, sockmap_t* lsock) {
+/// Returns the hub connection, which is created again if it has closed.  A 
+/// new multiplexed connection opens the channels of the subscribers that are
+/// still open.
+    if (hub->conn.id == 0) {
+        if (sub_conn_init(backend, &hub->conn, lsock->websocket) == NULL) {
+            return NULL;
+        }
+        hub->conn.hub = hub;
+        if (lsock->framing == FRAMING_MUX) {
+            for (size_t i=0; i<hub->nsubs; i++) {
+                if (hub->subs[i]->state != CONN_ENDED) {
+                    sub_mux_ctl(hub, hub->subs[i], MUX_OPEN);
+                }
+            }
+        }
+    }
+    return &hub->conn;
+}
+
+
+static void sub_fanout_wake(conn_t* conn) {
+/// Subscribers are woken together, by the websocket protocol of the mapping
+    if ((conn->backend->ws_context != NULL) && (conn->mapgov->protocol != NULL)) {
+        lws_callback_on_writable_all_protocol(conn->backend->ws_context, conn->mapgov->protocol);
+    }
+}
+
+
+static size_t sub_fanout_publish(hub_t* hub) {
+/// Publishes the messages queued by the hub, and then the framed messages 
+/// that were waiting for room in its queue.  It stops when a subscriber with
+/// the block policy has no room for another reference, so the slowest one 
+/// paces the hub.  Subscribers with other policies drop references instead.
+/// Messages are discarded while there are no subscribers.  Returns the number
+/// of messages published.
+    conn_t* conn = &hub->conn;
+    mq_msg_t* msg;
+    mq_key_t key;
+    uint8_t* data;
+    uint32_t flags;
+    size_t len, i;
+    size_t count = 0;
+    
+    if (conn->id == 0) {
+        return 0;
+    }
+    do {
+        while ((data = mq_peek(&conn->mqweb, &len)) != NULL) {
+            sub_ckey(conn->sock_handle, data, len, &key);
+            for (i=0; i<hub->nsubs; i++) {
+                if (!sub_conflate_isqueued(hub->subs[i], data, &key)
+                &&  (sub_slow_admit(hub->subs[i], sizeof(mq_msg_t*)) == 0)) {
+                    hub->stalls++;
+                    return count;
+                }
+            }
+            flags   = mq_peekflags(&conn->mqweb);
+            msg     = NULL;
+            if (hub->nsubs != 0) {
+                msg = msg_new(LWS_PRE + len);
+                if (msg == NULL) {
+                    return count;
+                }
+                memcpy(&msg->data[LWS_PRE], data, len);
+                msg->key = key;
+                hub->published++;
+                count++;
+            }
+            
+            // A subscriber that joined during a streamed message starts with
+            // the next message.
+            for (i=0; i<hub->nsubs; i++) {
+                conn_t* sub = hub->subs[i];
+                if ((flags & WEBF_CONT) && !sub->fcont) {
+                    continue;
+                }
+                if (sub->sclose || (sub_putref(sub, msg, flags) != 0)) {
+                    continue;
+                }
+                sub->fcont = ((flags & WEBF_MORE) != 0);
+                msg_ref(msg);
+                hub->refs++;
+            }
+            
+            // The bytes stay with the governors while the message is referenced
+            mq_pop(&conn->mqweb);
+            if ((msg == NULL) || (msg->refs == 1)) {
+                sub_dequeued(conn, len);
+            }
+            msg_free(msg);
+        }
+    } while ((conn->fwant != 0) && (sub_unframe(conn) > 0));
+    
+    return count;
+}
+
+
+static void* sub_hub_join(backend_t* backend, conn_t* conn, sockmap_t* lsock) {
+/// A session subscribes to the hub of its mapping, which is created with the
+/// first subscriber.  A fan-out subscriber only has a queue of references.  A
+/// mux subscriber has a web queue, and its ID is its channel.
+    hub_t* hub  = &backend->hubs[lsock - backend->socklist->map];
+    bool mux    = (lsock->framing == FRAMING_MUX);
+    int rc;
+    
+    if (hub->nsubs >= hub->asubs) {
+        size_t  alloc   = (hub->asubs != 0) ? (2 * hub->asubs) : 16;
+        conn_t** subs   = realloc(hub->subs, alloc * sizeof(conn_t*));
+        if (subs == NULL) {
+            return NULL;
+        }
+        hub->subs   = subs;
+        hub->asubs  = alloc;
+    }
+    if (mux && (sub_mux_reserve(hub) != 0)) {
+        return NULL;
+    }
+    if (sub_hub_open(backend, hub, lsock) == NULL) {
+        return NULL;
+    }
+    
+    memset(conn, 0, sizeof(conn_t));
+    conn->fd_ds         = -1;
+    conn->sock_handle   = lsock;
+    conn->backend       = backend;
+    conn->mapgov        = hub->conn.mapgov;
+    conn->mapstat       = hub->conn.mapstat;
+    conn->maprx         = hub->conn.maprx;
+    conn->state         = CONN_OPEN;
+    conn->hub           = hub;
+    if (mux) {
+        rc = mq_init(&conn->mqweb, lsock->webqueue, LWS_PRE);
+    }
+    else {
+        rc = sub_refq_init(conn);
+    }
+    if (rc != 0) {
+        return NULL;
+    }
+    if (sub_conntab_add(backend, conn) != 0) {
+        mq_deinit(&conn->mqweb);
+        return NULL;
+    }
+    conn->subslot = hub->nsubs;
+    hub->subs[hub->nsubs++] = conn;
+    if (mux) {
+        sub_mux_link(hub, conn);
+        sub_mux_ctl(hub, conn, MUX_OPEN);
+    }
+    return conn;
+}
+
+
+static void sub_hub_leave(backend_t* backend, conn_t* conn) {
+/// The references of a fan-out subscriber are released when it leaves.  The
+/// hub may have been waiting for it, so the hub publishes again.  A mux 
+/// subscriber closes its channel, and a message that was waiting for room in
+/// its queue is discarded by the next framing.
+    hub_t* hub = conn->hub;
+    conn_t* last;
+    
+    if (sub_isfanout(conn)) {
+        while (!mq_isempty(&conn->mqweb)) {
+            sub_unref(conn);
+        }
+        free(conn->ktab);
+        conn->ktab = NULL;
+    }
+    else {
+        sub_dequeued(conn, conn->mqweb.bytes);
+        sub_mux_unlink(hub, conn);
+        if (conn->state != CONN_ENDED) {
+            sub_mux_ctl(hub, conn, MUX_CLOSE);
+        }
+        if (hub->conn.fdest == conn) {
+            hub->conn.fdest = NULL;
+            hub->conn.fwant = 0;
+        }
+    }
+    mq_deinit(&conn->mqweb);
+    last            = hub->subs[--hub->nsubs];
+    last->subslot   = conn->subslot;
+    hub->subs[last->subslot] = last;
+    sub_conntab_del(backend, conn);
+    
+    if (sub_fanout_publish(hub) != 0) {
+        sub_fanout_wake(&hub->conn);
+    }
+}
+
+/// --------------------------------------
+
+
+
+
+/// ----- Connection Pools ---------
+/// Daemon sockets are AF_UNIX, whose connect completes at once or fails, so
+/// the pool is refilled from the service loop without blocking it.  A warm 
+/// socket may be closed by the daemon while it waits, or the daemon may exit,
+/// so each one is tested when it's taken, and the pool is swept as it's 
+/// refilled.  A connect that fails stops the refill of the mapping until the
+/// next interval.
+
+static int sub_pool_connect(sockmap_t* lsock) {
+    struct sockaddr_un addr;
+    int flags;
+    int fd;
+    
+    fd = socket(AF_UNIX, lsock->l_type, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        close(fd);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, lsock->l_socket, UNIX_PATH_MAX);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool sub_pool_alive(int fd) {
+/// A socket the daemon has closed reads EOF.  Data that the daemon sent is 
+/// left in the socket, for the session.
+    uint8_t byte;
+    ssize_t rc = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (rc > 0) || ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)));
+}
+
+
+static int sub_pool_take(backend_t* backend, sockmap_t* lsock) {
+/// Returns a warm socket, or -1 if the pool of the mapping is empty.  Taking
+/// one brings the next refill forward.
+    size_t index    = lsock - backend->socklist->map;
+    pool_t* pool    = &backend->pools[index];
+    mapstat_t* stat = &backend->mapstat[index];
+    
+    backend->poolnext = 0;
+    while (pool->size != 0) {
+        int fd = pool->fd[--pool->size];
+        if (sub_pool_alive(fd)) {
+            stat->poolhits++;
+            return fd;
+        }
+        close(fd);
+        stat->pooldrops++;
+    }
+    stat->poolmisses++;
+    pool->lastmiss = sub_now_ms();
+    return -1;
+}
+
+
+static void sub_pool_service(backend_t* backend) {
+/// Sweeps and refills the pools, once per interval.  Sockets above the target
+/// are closed, newest first.
+    uint64_t now = sub_now_ms();
+    
+    if (now < backend->poolnext) {
+        return;
+    }
+    backend->poolnext = now + WFEDD_PARAM(POOL_INTERVAL);
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        sockmap_t* lsock    = &backend->socklist->map[i];
+        pool_t* pool        = &backend->pools[i];
+        mapstat_t* stat     = &backend->mapstat[i];
+        size_t target, j, k;
+        
+        if (lsock->poolmax == 0) {
+            continue;
+        }
+        target = ((pool->lastmiss != 0) && ((now - pool->lastmiss) < WFEDD_PARAM(POOL_IDLE))) ?
+                    lsock->poolmax : lsock->poolmin;
+        
+        for (j=0, k=0; j<pool->size; j++) {
+            if (sub_pool_alive(pool->fd[j])) {
+                pool->fd[k++] = pool->fd[j];
+            }
+            else {
+                close(pool->fd[j]);
+                stat->pooldrops++;
+            }
+        }
+        pool->size = k;
+        while (pool->size > target) {
+            close(pool->fd[--pool->size]);
+        }
+        
+        while (pool->size < target) {
+            int fd = sub_pool_connect(lsock);
+            if (fd < 0) {
+                stat->poolfails++;
+                break;
+            }
+            pool->fd[pool->size++] = fd;
+            stat->poolfills++;
+        }
+    }
+}
+
+
+static void sub_pool_deinit(backend_t* backend) {
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        pool_t* pool = &backend->pools[i];
+        while (pool->size != 0) {
+            close(pool->fd[--pool->size]);
+        }
+        free(pool->fd);
+        pool->fd = NULL;
+    }
+}
+
+/// --------------------------------------
+
+
+
+
+
+
+
+
+
+
+static void sub_printgovern(const char* name, govern_t* gov) {
+    printf("govern %-8s: queued=%zu peak=%zu limit=%zu state=%s throttles=%lu\n",
+                name, gov->queued, gov->peak, gov->limit, 
+                gov->throttled ? "throttled" : "open", gov->throttles);
+}
+
+
+static void sub_printstats(backend_t* backend) {
+    msgpool_stat_t stats[16];
+    size_t nstats;
+    
+    nstats = msgpool_getstats(stats, sizeof(stats)/sizeof(msgpool_stat_t));
+    for (size_t i=0; i<nstats; i++) {
+        if (stats[i].blocksize != 0) {
+            printf("msgpool %5zu B: hits=%lu misses=%lu inuse=%lu highwater=%lu cached=%lu\n",
+                        stats[i].blocksize, stats[i].hits, stats[i].misses, 
+                        stats[i].inuse, stats[i].highwater, stats[i].cached);
+        }
+        else {
+            printf("msgpool  heap : misses=%lu inuse=%lu highwater=%lu\n",
+                        stats[i].misses, stats[i].inuse, stats[i].highwater);
+        }
+    }
+    
+    sub_printgovern("(global)", &backend->govern);
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        sub_printgovern(backend->socklist->map[i].websocket, &backend->mapgov[i]);
+    }
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        printf("connect %-7s: connects=%lu pending=%lu fails=%lu timeouts=%lu\n",
+                    backend->socklist->map[i].websocket, stat->connects, 
+                    stat->connpending, stat->connfails, stat->conntimeouts);
+    }
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        if (backend->socklist->map[i].coalesce != 0) {
+            printf("coalesce %-6s: frames=%lu msgs=%lu saved=%lu held=%lu latency=%lluus max=%luus\n",
+                        backend->socklist->map[i].websocket, stat->cframes, 
+                        stat->cmsgs, stat->cmsgs - stat->cframes, stat->cheld,
+                        stat->clatency, stat->clatmax);
+        }
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        printf("payload %-7s: text=%lu binary=%lu rxdrops=%lu\n",
+                    backend->socklist->map[i].websocket, stat->txtext, 
+                    stat->txbinary, stat->rxdrops);
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        if (backend->socklist->map[i].stream != 0) {
+            printf("stream %-8s: messages=%lu fragments=%lu\n",
+                        backend->socklist->map[i].websocket, stat->streamed, 
+                        stat->frags);
+        }
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        if (backend->socklist->map[i].deflate != 0) {
+            printf("deflate %-7s: deflated=%lu stored=%lu bytes=%llu cpu=%lluus ratio=%.2f\n",
+                        backend->socklist->map[i].websocket, stat->zdeflated, 
+                        stat->zstored, stat->zbytes, stat->zcpu / 1000,
+                        (stat->zsampout != 0) ? ((double)stat->zsampin / (double)stat->zsampout) : 0.0);
+        }
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        if (backend->socklist->map[i].poolmax != 0) {
+            printf("pool %-10s: warm=%zu hits=%lu misses=%lu drops=%lu fills=%lu fails=%lu\n",
+                        backend->socklist->map[i].websocket, backend->pools[i].size,
+                        stat->poolhits, stat->poolmisses, stat->pooldrops, 
+                        stat->poolfills, stat->poolfails);
+        }
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        mapstat_t* stat = &backend->mapstat[i];
+        static const char* const policy[] = { "block", "dropold", "dropnew", "close" };
+        printf("slow %-10s: policy=%s mark=%zu blocks=%lu dropold=%lu dropnew=%lu closes=%lu\n",
+                    backend->socklist->map[i].websocket, 
+                    policy[backend->socklist->map[i].slowpolicy & 3],
+                    backend->socklist->map[i].slowmark, stat->slowblocks,
+                    stat->slowdropold, stat->slowdropnew, stat->slowcloses);
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        sockmap_t* map  = &backend->socklist->map[i];
+        mapstat_t* stat = &backend->mapstat[i];
+        if ((map->rxrate | map->rxbytes | map->maprxrate | map->maprxbytes) != 0) {
+            printf("rxrate %-8s: throttles=%lu mapthrottles=%lu wait=%llums\n",
+                        map->websocket, stat->rxthrottles, stat->rxmapthrottles, 
+                        stat->rxwait / 1000);
+        }
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        if (backend->socklist->map[i].conflate != CONFLATE_OFF) {
+            printf("conflate %-6s: replaced=%lu\n",
+                        backend->socklist->map[i].websocket, backend->mapstat[i].conflated);
+        }
+    }
+    
+    for (size_t i=0; i<backend->socklist->size; i++) {
+        hub_t* hub = &backend->hubs[i];
+        if (backend->socklist->map[i].fanout != 0) {
+            printf("fanout %-8s: upstream=%s subscribers=%zu published=%lu refs=%lu stalls=%lu\n",
+                        backend->socklist->map[i].websocket, 
+                        (hub->conn.id != 0) ? "open" : "closed", hub->nsubs,
+                        hub->published, hub->refs, hub->stalls);
+        }
+        if (backend->socklist->map[i].framing == FRAMING_MUX) {
+            printf("mux %-11s: upstream=%s channels=%zu demuxed=%lu drops=%lu ctllost=%lu\n",
+                        backend->socklist->map[i].websocket, 
+                        (hub->conn.id != 0) ? "open" : "closed", hub->nsubs,
+                        hub->demuxed, hub->conn.fdrops, hub->ctllost);
+        }
+    }
+    
+    if (assets_isopen()) {
+        assets_stat_t astat;
+        bigfile_stat_t bstat;
+        assets_getstats(&astat);
+        bigfile_getstats(&bstat);
+        printf("assets      : files=%zu bytes=%zu/%zu hits=%lu misses=%lu loads=%lu evictions=%lu invalidations=%lu uncached=%lu watch=%s\n",
+                    astat.entries, astat.bytes, astat.cap, astat.hits, 
+                    astat.misses, astat.loads, astat.evictions, 
+                    astat.invalidations, astat.uncached, 
+                    astat.watching ? "on" : "off");
+        printf("encoding    : identity=%lu gzip=%lu br=%lu sidecars=%lu built=%lu notmodified=%lu\n",
+                    astat.sent[ASSET_IDENTITY], astat.sent[ASSET_GZIP], 
+                    astat.sent[ASSET_BR], astat.sidecars, astat.built, 
+                    astat.notmodified);
+        printf("large files : files=%lu sendfile=%llu/%lu mapped=%llu/%lu ranges=%lu unsatisfiable=%lu\n",
+                    bstat.files, bstat.sentbytes, bstat.sendcalls, 
+                    bstat.mapbytes, bstat.maps, bstat.ranges, 
+                    bstat.unsatisfiable);
+    }
+    
+    printf("connections : live=%zu\n", backend->conntab.size);
+    for (size_t i=0; i<backend->conntab.size; i++) {
+        conn_t* conn = backend->conntab.conn[i];
+        printf("conn %-8u: websocket=%s fd=%i forweb=%zu/%zu forlocal=%zu/%zu unframed=%zu drops=%lu\n",
+                    conn->id, conn->sock_handle->websocket, conn->fd_ds,
+                    conn->mqweb.count, conn->mqweb.bytes, 
+                    conn->mqlocal.count, conn->mqlocal.bytes,
+                    conn->ftail - conn->fhead, conn->fdrops);
+    }
+    fflush(stdout);
+}
+
+
+
+
+///@todo could have sig input correspond to some IRQs.
+volatile birq_type* birq_pointer;
+void backend_inthandler(int sig) {
+    if (sig == SIGUSR1) {
+        *birq_pointer = (birq_type)(*birq_pointer | BIRQ_STATS);
+    }
+    else {
+        *birq_pointer = (birq_type)(*birq_pointer | BIRQ_GLOBAL);
+    }
+}
+
+
+
+int backend_run(socklist_t* socklist, 
+                int intsignal,
+                int logs_mask,
+                bool do_hostcheck,
+                bool do_fastmonitoring,
+                const char* hostname,
+                int port_number,
+                const char* certpath,
+                const char* keypath,
+                struct lws_protocols* protocols,
+                struct lws_http_mount* mount) {
+
+    int rc = 0;
+    backend_t backend;
+    int lws_rc = 0;
+    
+    /// 1. Initialize the backend object.  There is no shared read buffer: 
+    ///    daemon data is read directly into the queue of its connection.
+    
+    // Things that must be initialized externally
+    backend.socklist    = socklist;
+    backend.protocols   = protocols;
+    backend.ws_context  = NULL;
+    
+    // Governors: global budget comes from the command line, and each mapping
+    // has its own budget.  Mapping governors wake their websocket protocol.
+    sub_govern_init(&backend.govern, cliopt_getqbudget(), NULL);
+    backend.mapgov = calloc(socklist->size + 1, sizeof(govern_t));
+    if (backend.mapgov == NULL) {
+        return -1;
+    }
+    backend.mapstat = calloc(socklist->size + 1, sizeof(mapstat_t));
+    if (backend.mapstat == NULL) {
+        free(backend.mapgov);
+        return -1;
+    }
+    backend.maprx = calloc(socklist->size + 1, sizeof(rxlimit_t));
+    if (backend.maprx == NULL) {
+        free(backend.mapstat);
+        free(backend.mapgov);
+        return -1;
+    }
+    backend.hubs = calloc(socklist->size + 1, sizeof(hub_t));
+    if (backend.hubs == NULL) {
+        free(backend.maprx);
+        free(backend.mapstat);
+        free(backend.mapgov);
+        return -1;
+    }
+    backend.pools = calloc(socklist->size + 1, sizeof(pool_t));
+    if (backend.pools == NULL) {
+        free(backend.hubs);
+        free(backend.maprx);
+        free(backend.mapstat);
+        free(backend.mapgov);
+        return -1;
+    }
+    backend.poolnext = 0;
+    for (size_t i=0; i<socklist->size; i++) {
+        const struct lws_protocols* proto = NULL;
+        for (struct lws_protocols* p=protocols; p->name != NULL; p++) {
+            if (strcmp(p->name, socklist->map[i].websocket) == 0) {
+                proto = p;
+                break;
+            }
+        }
+        sub_govern_init(&backend.mapgov[i], socklist->map[i].budget, proto);
+        if (socklist->map[i].poolmax != 0) {
+            backend.pools[i].fd = calloc(socklist->map[i].poolmax, sizeof(int));
+            if (backend.pools[i].fd == NULL) {
+                rc = -2;
+                goto backend_run_EXIT;
+            }
+        }
+    }
+    
+    // Message pool is preallocated, so early traffic avoids malloc()
+    if (msgpool_init(WFEDD_PARAM(MSGPOOL_PREALLOC)) != 0) {
+        rc = -2;
+        goto backend_run_EXIT;
+    }
+
+    // Connection table grows on demand
+    backend.conntab.conn        = NULL;
+    backend.conntab.size        = 0;
+    backend.conntab.alloc       = 0;
+    backend.conntab.generation  = 0;
+
+    /// 2. Start the frontend.  These are the websockets.  Any messages that 
+    ///    are generated by the daemon sockets prior to frontend being online
+    ///    will be queued.  The frontend->backend path is more direct, thus 
+    ///    the backend is started before the frontend.
+    backend.ws_context = frontend_start(&backend, logs_mask, do_hostcheck, 
+                            do_fastmonitoring, hostname, port_number, certpath, 
+                            keypath, protocols, mount);
+    if (backend.ws_context == NULL) {
+        rc = -4;
+        goto backend_run_EXIT;
+    }
+    
+    /// 3. Configure an IRQ in order to stop wfedd asynchronously.  SIGUSR1 
+    ///    prints the runtime statistics.
+    backend.irq     = BIRQ_NONE;
+    birq_pointer    = &(backend.irq);
+    signal(intsignal, backend_inthandler);
+    signal(SIGUSR1, backend_inthandler);
+    
+    /// 4. Run the service loop.  The connection pools are filled before it,
+    ///    and they are refilled between services.  Changes to cached web 
+    ///    resources are also picked up between services.
+    sub_pool_service(&backend);
+    while (!(backend.irq & BIRQ_GLOBAL) && (lws_rc >= 0)) {
+        lws_rc = lws_service(backend.ws_context, 0);
+        sub_pool_service(&backend);
+        assets_service();
+        if (backend.irq & BIRQ_STATS) {
+            backend.irq = (birq_type)(backend.irq & ~BIRQ_STATS);
+            sub_printstats(&backend);
+        }
+    }
+    
+    /// 5. Runtime loop is over, so close the libwebsockets context.  This 
+    ///    closes every session, and the daemon client socket of each one.
+    ///    The connections are stored in the sessions, so any that remain in 
+    ///    the table would be dangling, and they are only reported.
+    ///@todo detach signal?
+    frontend_stop(backend.ws_context);
+    if (backend.conntab.size != 0) {
+        fprintf(stderr, "%zu connections were not closed at shutdown\n", backend.conntab.size);
+        backend.conntab.size = 0;
+    }
+
+    if (cliopt_isverbose()) {
+        sub_printstats(&backend);
+    }
+
+    backend_run_EXIT:
+    switch (rc) {
+        default:    
+        case -4:    //free(backend.fds);
+        case -3:    free(backend.conntab.conn);
+        case -2:    msgpool_deinit();
+                    sub_pool_deinit(&backend);
+                    free(backend.pools);
+                    for (size_t i=0; i<socklist->size; i++) {
+                        free(backend.hubs[i].subs);
+                        free(backend.hubs[i].chan);
+                    }
+                    free(backend.hubs);
+                    free(backend.maprx);
+                    free(backend.mapgov);
+                    free(backend.mapstat);
+        case -1:    break;
+    }
+    return rc;
+}
+
+
+
+sockmap_t* backend_getmap(void* backend_handle, const char* ws_name) {
+    if (backend_handle == NULL) {
+        return NULL;
+    }
+    return socklist_search(((backend_t*)backend_handle)->socklist, ws_name);
+}
+
+
+
+static int sub_putmsg(conn_t* conn, const void* data, size_t len, const mq_key_t* key) {
+/// Queues a message for the websocket, whose key was found by the caller.  
+/// The queue reserves LWS_PRE ahead of each payload, for lws_write().  A
+/// conflating queue references a block, which has the same headroom.
+    if (conn->ktab != NULL) {
+        mq_msg_t* msg = msg_new(LWS_PRE + len);
+        if (msg == NULL) {
+            return -2;
+        }
+        memcpy(&msg->data[LWS_PRE], data, len);
+        msg->key = *key;
+        if (sub_putref(conn, msg, 0) != 0) {
+            msg_free(msg);
+            return -2;
+        }
+    }
+    else if (mq_putmsg(&conn->mqweb, data, len) != 0) {
+        return -2;
+    }
+    sub_webqueued(conn, len);
+    return 0;
+}
+
+
+int conn_putmsg_forweb(void* conn_handle, void* data, size_t len) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    conn_t* conn;
+    mq_key_t key;
+
+    if ((conn_handle == NULL) || (data == NULL) || (len == 0)) {
+        return -1;
+    }
+    conn = conn_handle;
+    sub_ckey(conn->sock_handle, data, len, &key);
+    return sub_putmsg(conn, data, len, &key);
+}
+
+int conn_putmsg_forlocal(void* conn_handle, void* data, size_t len) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    conn_t* conn = sub_upstream(conn_handle);
+
+    if ((conn == NULL) || (data == NULL) || (len == 0)) {
+        return -1;
+    }
+    if (sub_ismux(conn_handle)) {
+        return sub_mux_put(conn, ((conn_t*)conn_handle)->id, MUX_DATA, data, len);
+    }
+
+    if (mq_putmsg(&conn->mqlocal, data, len) != 0) {
+        return -2;
+    }
+    sub_queued(conn, len);
+    return 0;
+}
+
+
+void* conn_peekmsg_forweb(void* conn_handle, size_t* len) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    void* data = NULL;
+    if (conn_handle != NULL) {
+        data = mq_peek( &(((conn_t*)conn_handle)->mqweb), len );
+    }
+    return data;
+}
+
+void* conn_peekmsg_forlocal(void* conn_handle, size_t* len) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    conn_t* conn = sub_upstream(conn_handle);
+    void* data = NULL;
+    if (conn != NULL) {
+        data = mq_peek(&conn->mqlocal, len);
+    }
+    return data;
+}
+
+
+void conn_popmsg_forweb(void* conn_handle) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    conn_t* conn;
+    size_t len;
+    if (conn_handle != NULL) {
+        conn = conn_handle;
+        if (mq_peek(&conn->mqweb, &len) != NULL) {
+            mq_pop(&conn->mqweb);
+            sub_dequeued(conn, len);
+        }
+    }
+}
+
+void conn_popmsg_forlocal(void* conn_handle) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    conn_t* conn = sub_upstream(conn_handle);
+    size_t len;
+    if (conn != NULL) {
+        if (mq_peek(&conn->mqlocal, &len) != NULL) {
+            mq_pop(&conn->mqlocal);
+            sub_dequeued(conn, len);
+        }
+    }
+}
+
+
+bool conn_hasmsg_forweb(void* conn_handle) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    bool result = false;
+    if (conn_handle != NULL) {
+        result = !mq_isempty( &(((conn_t*)conn_handle)->mqweb) );
+    }
+    return result;
+}
+
+bool conn_hasmsg_forlocal(void* conn_handle) {
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    conn_t* conn = sub_upstream(conn_handle);
+    bool result = false;
+    if (conn != NULL) {
+        result = !mq_isempty(&conn->mqlocal);
+    }
+    return result;
+}
+
+
+bool conn_hasroom_forweb(void* conn_handle) {
+/// There must be room for a message or a read that is waiting for room.  A
+/// hub, which a subscriber reads through, must have room for a full read.  A
+/// session reads while its queue is below the high-water mark, because the 
+/// slow-consumer policy applies to the bytes it reads, and a session whose
+/// policy drops messages never waits.
+    conn_t* conn = sub_upstream(conn_handle);
+    bool result = false;
+    if (conn != NULL) {
+        if (conn->fwant != 0) {
+            result = sub_slow_hasroom((conn->fdest != NULL) ? conn->fdest : conn, conn->fwant);
+        }
+        else if (conn->hub != NULL) {
+            result = sub_slow_hasroom(conn, (conn->sock_handle->framing == FRAMING_SEQPACKET) ? 
+                        conn->sock_handle->msgmax : conn->rdsize);
+        }
+        else if (conn->sock_handle->slowpolicy != SLOW_BLOCK) {
+            result = true;
+        }
+        else {
+            result = sub_slow_hasroom(conn, 1);
+        }
+    }
+    return result;
+}
+
+void* conn_peekframe_forweb(void* conn_handle, size_t* len) {
+/// Without coalescing, the frame is the oldest message, in place.  Otherwise
+/// the oldest messages are copied into the frame buffer, which is one more 
+/// copy, but one frame and one TLS record instead of many.  A raw message that
+/// is alone, or too large to pack with the next one, is still used in place.
+    struct iovec iov[WFEDD_PARAM(COALESCE_MAX)];
+    conn_t* conn;
+    uint8_t* frame;
+    size_t budget;
+    size_t flen = 0;
+    size_t n, i;
+    int delim;
+    
+    if (conn_handle == NULL) {
+        return NULL;
+    }
+    conn = conn_handle;
+    if (conn->cbuf == NULL) {
+        conn->cmsgs     = 1;
+        conn->cflags    = mq_peekflags(&conn->mqweb);
+        if (sub_isrefq(conn)) {
+            mq_msg_t* msg = sub_peekref(conn);
+            if (msg == NULL) {
+                return NULL;
+            }
+            *len = msg->size - LWS_PRE;
+            return &msg->data[LWS_PRE];
+        }
+        return mq_peek(&conn->mqweb, len);
+    }
+    conn->cflags = 0;
+    
+    n = mq_peekv(&conn->mqweb, iov, WFEDD_PARAM(COALESCE_MAX));
+    if (n == 0) {
+        return NULL;
+    }
+    budget  = conn->sock_handle->coalesce;
+    delim   = (conn->sock_handle->framing == FRAMING_NEWLINE) ? '\n' :
+              (conn->sock_handle->framing == FRAMING_NUL) ? 0 : -1;
+    if ((delim < 0) && ((n == 1) || ((iov[0].iov_len + iov[1].iov_len) > budget))) {
+        conn->cmsgs = 1;
+        *len        = iov[0].iov_len;
+        return iov[0].iov_base;
+    }
+    
+    // The first message always goes in the frame: the buffer is sized for
+    // the largest framed message and its delimiter.
+    frame = &conn->cbuf->data[LWS_PRE];
+    for (i=0; i<n; i++) {
+        size_t size = iov[i].iov_len + (delim >= 0);
+        if ((i != 0) && ((flen + size) > budget)) {
+            break;
+        }
+        memcpy(&frame[flen], iov[i].iov_base, iov[i].iov_len);
+        flen += iov[i].iov_len;
+        if (delim >= 0) {
+            frame[flen++] = (uint8_t)delim;
+        }
+    }
+    conn->cmsgs = i;
+    *len        = flen;
+    return frame;
+}
+
+
+void conn_popframe_forweb(void* conn_handle) {
+/// Removes the messages of the frame last peeked.  The latency added is the 
+/// age of the oldest message, counted only if the queue was held back.
+    conn_t* conn;
+    size_t len;
+    
+    if (conn_handle == NULL) {
+        return;
+    }
+    conn = conn_handle;
+    
+    // Room for another reference may let the hub publish, and the subscribers
+    // are woken to write what it published.
+    if (sub_isfanout(conn)) {
+        sub_unref(conn);
+        conn->cmsgs = 0;
+        if (sub_fanout_publish(conn->hub) != 0) {
+            sub_fanout_wake(conn);
+        }
+        return;
+    }
+    if (sub_isrefq(conn)) {
+        sub_unref(conn);
+        conn->cmsgs = 0;
+        return;
+    }
+    if (conn->cbuf != NULL) {
+        conn->mapstat->cframes++;
+        conn->mapstat->cmsgs += conn->cmsgs;
+        if (conn->cheld) {
+            uint64_t lat = sub_now_us() - conn->cstamp;
+            conn->mapstat->cheld++;
+            conn->mapstat->clatency += lat;
+            if (lat > conn->mapstat->clatmax) {
+                conn->mapstat->clatmax = (unsigned long)lat;
+            }
+            conn->cheld = false;
+        }
+    }
+    for (; conn->cmsgs != 0; conn->cmsgs--) {
+        if (mq_peek(&conn->mqweb, &len) == NULL) {
+            conn->cmsgs = 0;
+            break;
+        }
+        mq_pop(&conn->mqweb);
+        sub_dequeued(conn, len);
+    }
+    
+    // Messages that remain keep the time of the oldest one, so they are not
+    // held longer than the latency budget.
+    if (mq_isempty(&conn->mqweb)) {
+        conn->cstamp = 0;
+    }
+}
+
+
+long conn_holdus_forweb(void* conn_handle) {
+/// The queue is held while it is below the byte budget, and its oldest message
+/// is younger than the linger time.  It is never held when it can't take more
+/// data, because then nothing more would arrive to coalesce.
+    conn_t* conn;
+    uint64_t age;
+    
+    if (conn_handle == NULL) {
+        return 0;
+    }
+    conn = conn_handle;
+    if ((conn->cbuf == NULL) || mq_isempty(&conn->mqweb) 
+    ||  (conn->mqweb.bytes >= conn->sock_handle->coalesce)
+    ||  !conn_hasroom_forweb(conn) || conn_isthrottled(conn)) {
+        return 0;
+    }
+    age = sub_now_us() - conn->cstamp;
+    if (age >= conn->sock_handle->linger) {
+        return 0;
+    }
+    conn->cheld = true;
+    return (long)(conn->sock_handle->linger - age);
+}
+
+
+bool conn_hasroom_forlocal(void* conn_handle, size_t len) {
+    conn_t* conn = sub_upstream(conn_handle);
+    bool result = false;
+    if (conn != NULL) {
+        if (sub_ismux(conn_handle)) {
+            len += MUX_HDRLEN;
+        }
+        result = mq_hasroom(&conn->mqlocal, len);
+    }
+    return result;
+}
+
+
+enum lws_write_protocol conn_get_writeprotocol(void* conn_handle, const void* data, size_t len) {
+/// In auto mode, each frame is validated: a browser fails the websocket if a
+/// TEXT frame is not UTF-8, so anything else goes as BINARY.
+    conn_t* conn;
+    int nofin;
+    bool binary;
+    
+    if (conn_handle == NULL) {
+        return LWS_WRITE_TEXT;
+    }
+    conn    = conn_handle;
+    nofin   = (conn->cflags & WEBF_MORE) ? LWS_WRITE_NO_FIN : 0;
+    if (conn->cflags & WEBF_CONT) {
+        return (enum lws_write_protocol)(LWS_WRITE_CONTINUATION | nofin);
+    }
+    
+    switch (conn->sock_handle->payload) {
+        case PAYLOAD_BINARY:    binary = true; break;
+        case PAYLOAD_AUTO:      binary = (nofin != 0) || !utf8_isvalid(data, len); break;
+        default:                binary = false; break;
+    }
+    if (binary) {
+        conn->mapstat->txbinary++;
+        return (enum lws_write_protocol)(LWS_WRITE_BINARY | nofin);
+    }
+    conn->mapstat->txtext++;
+    return (enum lws_write_protocol)(LWS_WRITE_TEXT | nofin);
+}
+
+
+bool conn_accepts_forlocal(void* conn_handle, bool binary) {
+    conn_t* conn;
+    bool result = false;
+    if (conn_handle != NULL) {
+        conn    = conn_handle;
+        result  = (conn->sock_handle->payload == PAYLOAD_AUTO)
+               || (binary == (conn->sock_handle->payload == PAYLOAD_BINARY));
+        if (!result) {
+            conn->mapstat->rxdrops++;
+        }
+    }
+    return result;
+}
+
+
+static size_t sub_zsample(const sockmap_t* map, const void* data, size_t len) {
+/// Deflates a message alone, with the parameters of the mapping, and returns
+/// its compressed size, or 0 on error.  Without the context of the messages
+/// before it, the ratio is a lower bound of what the browser gets.
+    uint8_t out[4096];
+    z_stream zs;
+    size_t total = 0;
+    int zrc;
+    
+    memset(&zs, 0, sizeof(z_stream));
+    if (deflateInit2(&zs, WFEDD_PARAM(DEFLATE_LEVEL), Z_DEFLATED, -(int)map->zwbits, 
+                    (int)map->zmem, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    zs.next_in  = (Bytef*)data;
+    zs.avail_in = (uInt)len;
+    do {
+        zs.next_out     = out;
+        zs.avail_out    = sizeof(out);
+        zrc             = deflate(&zs, Z_FINISH);
+        total          += sizeof(out) - zs.avail_out;
+    } while (zrc == Z_OK);
+    deflateEnd(&zs);
+    
+    return (zrc == Z_STREAM_END) ? total : 0;
+}
+
+
+void conn_count_deflate(void* conn_handle, const void* data, size_t len, bool deflated, uint64_t cpu_ns) {
+    conn_t* conn;
+    mapstat_t* stat;
+    
+    if (conn_handle == NULL) {
+        return;
+    }
+    conn = conn_handle;
+    stat = conn->mapstat;
+    if (!deflated) {
+        stat->zstored++;
+        return;
+    }
+    stat->zbytes += len;
+    stat->zcpu   += cpu_ns;
+    if ((stat->zdeflated++ % WFEDD_PARAM(DEFLATE_SAMPLE)) == 0) {
+        size_t zlen = sub_zsample(conn->sock_handle, data, len);
+        if (zlen != 0) {
+            stat->zsampin  += len;
+            stat->zsampout += zlen;
+        }
+    }
+}
+
+
+bool conn_isthrottled(void* conn_handle) {
+/// True if the global governor or the mapping's governor is throttling
+    conn_t* conn;
+    bool result = false;
+    if (conn_handle != NULL) {
+        conn    = conn_handle;
+        result  = conn->backend->govern.throttled || conn->mapgov->throttled;
+    }
+    return result;
+}
+
+
+
+static long sub_bucket_take(bucket_t* b, size_t rate, size_t n, uint64_t now) {
+/// A bucket holds one second of its rate, and it refills continuously.  It 
+/// starts full.  Tokens are in millionths, so the refill of each microsecond 
+/// is whole.  Returns the time (us) until the bucket is out of debt.
+    int64_t cap = (int64_t)rate * 1000000;
+    uint64_t elapsed;
+    
+    if (rate == 0) {
+        return 0;
+    }
+    if (b->stamp == 0) {
+        b->tokens = cap;
+    }
+    else {
+        elapsed     = now - b->stamp;
+        elapsed     = (elapsed < 1000000) ? elapsed : 1000000;
+        b->tokens  += (int64_t)elapsed * (int64_t)rate;
+        b->tokens   = (b->tokens < cap) ? b->tokens : cap;
+    }
+    b->stamp    = now;
+    b->tokens  -= (int64_t)n * 1000000;
+    return (b->tokens < 0) ? (long)(((uint64_t)-b->tokens + rate - 1) / rate) : 0;
+}
+
+
+long conn_rxcharge(void* conn_handle, size_t msgs, size_t len) {
+/// A pause is counted against the buckets of the session if they need the
+/// longer wait, else against the mapping's.
+    conn_t* conn = conn_handle;
+    sockmap_t* map;
+    uint64_t now;
+    long wait, mapwait, w;
+    
+    if (conn == NULL) {
+        return 0;
+    }
+    map = conn->sock_handle;
+    if ((map->rxrate == 0) && (map->rxbytes == 0) && (map->maprxrate == 0) && (map->maprxbytes == 0)) {
+        return 0;
+    }
+    now     = sub_now_us();
+    wait    = sub_bucket_take(&conn->rx.msgs, map->rxrate, msgs, now);
+    w       = sub_bucket_take(&conn->rx.bytes, map->rxbytes, len, now);
+    wait    = (w > wait) ? w : wait;
+    mapwait = sub_bucket_take(&conn->maprx->msgs, map->maprxrate, msgs, now);
+    w       = sub_bucket_take(&conn->maprx->bytes, map->maprxbytes, len, now);
+    mapwait = (w > mapwait) ? w : mapwait;
+    
+    if ((wait == 0) && (mapwait == 0)) {
+        return 0;
+    }
+    if (wait >= mapwait) {
+        conn->mapstat->rxthrottles++;
+    }
+    else {
+        conn->mapstat->rxmapthrottles++;
+        wait = mapwait;
+    }
+    conn->mapstat->rxwait  += (unsigned long long)wait;
+    conn->rxuntil           = now + (uint64_t)wait;
+    return wait;
+}
+
+
+long conn_rxwait(void* conn_handle) {
+    conn_t* conn = conn_handle;
+    uint64_t now;
+    if ((conn == NULL) || (conn->rxuntil == 0)) {
+        return 0;
+    }
+    now = sub_now_us();
+    return (conn->rxuntil > now) ? (long)(conn->rxuntil - now) : 0;
+}
+
+
+
+
+
+
+
+
+void* conn_new(void* backend_handle, conn_t* conn, const char* ws_name) {
+/// The connection is stored by the caller (in the per-session data), so this
+/// only initializes it and adds it to the connection table.  In a fan-out or
+/// multiplexed mapping, the connection subscribes to the hub instead.
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    backend_t*  backend = backend_handle;
+    sockmap_t*  lsock;
+
+    if ((backend_handle == NULL) || (conn == NULL) || (ws_name == NULL)) {
+        return NULL;
+    }
+    lsock = socklist_search(backend->socklist, ws_name);
+    if ((lsock != NULL) && ((lsock->fanout != 0) || (lsock->framing == FRAMING_MUX))) {
+        return sub_hub_join(backend, conn, lsock);
+    }
+    return sub_conn_init(backend, conn, ws_name);
+}
+
+
+static void* sub_conn_init(backend_t* backend, conn_t* conn, const char* ws_name) {
+    sockmap_t*  lsock   = socklist_search(backend->socklist, ws_name);
+    int fd_ds           = -1;
+    bool warm;
+
+    // Take a warm socket from the pool of the mapping, which is connected, or
+    // else create a new client socket to the daemon mapped to the websocket.
+    if ((lsock != NULL) && (lsock->poolmax != 0)) {
+        fd_ds = sub_pool_take(backend, lsock);
+    }
+    warm = (fd_ds >= 0);
+    if (!warm) {
+        fd_ds = socklist_newclient(&lsock, backend->socklist, ws_name);
+        if (fd_ds < 0) {
+            goto conn_new_TERM1;
+        }
+    }
+
+    conn->fd_ds         = fd_ds;
+    conn->sock_handle   = lsock;
+    conn->backend       = backend;
+    conn->mapgov        = &backend->mapgov[lsock - backend->socklist->map];
+    conn->mapstat       = &backend->mapstat[lsock - backend->socklist->map];
+    conn->maprx         = &backend->maprx[lsock - backend->socklist->map];
+    conn->state         = warm ? CONN_OPEN : CONN_IDLE;
+    conn->deadline      = 0;
+    conn->id            = 0;
+    conn->rdsize        = lsock->pagesize;
+    conn->rdsmall       = 0;
+    conn->fbuf          = NULL;
+    conn->fhead         = 0;
+    conn->fscan         = 0;
+    conn->ftail         = 0;
+    conn->fskip         = 0;
+    conn->fwant         = 0;
+    conn->fdrops        = 0;
+    conn->fremain       = 0;
+    conn->fdest         = NULL;
+    conn->fstream       = false;
+    conn->fcont         = false;
+    conn->cbuf          = NULL;
+    conn->cstamp        = 0;
+    conn->cmsgs         = 0;
+    conn->cflags        = 0;
+    conn->cheld         = false;
+    conn->hub           = NULL;
+    conn->subslot       = 0;
+    conn->wsi           = NULL;
+    conn->sblocked      = false;
+    conn->sclose        = false;
+    conn->ktab          = NULL;
+    conn->kmask         = 0;
+    conn->rxuntil       = 0;
+    memset(&conn->rx, 0, sizeof(rxlimit_t));
+    
+    // Queues have a fixed capacity, set by the mapping.  A conflating session
+    // queues references, except for a fan-out hub, whose subscribers do.
+    if ((lsock->conflate != CONFLATE_OFF) && (lsock->fanout == 0)) {
+        if (sub_refq_init(conn) != 0) {
+            goto conn_new_TERM2;
+        }
+    }
+    else if (mq_init(&conn->mqweb, lsock->webqueue, LWS_PRE) != 0) {
+        goto conn_new_TERM2;
+    }
+    if (mq_init(&conn->mqlocal, lsock->localqueue, 0) != 0) {
+        goto conn_new_TERM3;
+    }
+    
+    // Stream framing needs a staging buffer that holds the largest message,
+    // its prefix (the mux header is the largest), and the next read behind it.
+    if ((lsock->framing != FRAMING_RAW) && (lsock->framing != FRAMING_SEQPACKET)) {
+        conn->fbuf = msg_new(lsock->msgmax + MUX_HDRLEN + lsock->pagemax);
+        if (conn->fbuf == NULL) {
+            goto conn_new_TERM4;
+        }
+    }
+    
+    // The coalescing buffer holds a full frame, or a message that is larger
+    // than the budget with its delimiter.
+    if (lsock->coalesce != 0) {
+        size_t csize = lsock->coalesce;
+        if ((lsock->framing != FRAMING_RAW) && (csize < (lsock->msgmax + 1))) {
+            csize = lsock->msgmax + 1;
+        }
+        conn->cbuf = msg_new(LWS_PRE + csize);
+        if (conn->cbuf == NULL) {
+            goto conn_new_TERM5;
+        }
+    }
+    if (sub_conntab_add(backend, conn) != 0) {
+        goto conn_new_TERM6;
+    }
+    return conn;
+    
+    // De-allocate on failures
+    conn_new_TERM6:
+    msg_free(conn->cbuf);
+    conn->cbuf = NULL;
+    conn_new_TERM5:
+    msg_free(conn->fbuf);
+    conn->fbuf = NULL;
+    conn_new_TERM4:
+    mq_deinit(&conn->mqlocal);
+    conn_new_TERM3:
+    mq_deinit(&conn->mqweb);
+    free(conn->ktab);
+    conn->ktab = NULL;
+    conn_new_TERM2:
+    close(fd_ds);
+    conn->fd_ds = -1;
+    conn_new_TERM1:
+    return NULL;
+}
+
+
+void conn_del(void* backend_handle, void* conn_handle) {
+/// Deleting a connection that is not in the table does nothing, so the raw 
+/// socket and the websocket may both delete it as they close.
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    backend_t*  backend = backend_handle;
+    conn_t*     conn    = conn_handle;
+
+    if ((backend_handle != NULL) && (conn_handle != NULL) && (conn->id != 0)) {
+        if (sub_issubscriber(conn)) {
+            sub_hub_leave(backend, conn);
+            return;
+        }
+        while ((conn->ktab != NULL) && !mq_isempty(&conn->mqweb)) {
+            sub_unref(conn);
+        }
+        free(conn->ktab);
+        conn->ktab = NULL;
+        sub_dequeued(conn, conn->mqweb.bytes + conn->mqlocal.bytes);
+        mq_deinit(&conn->mqweb);
+        mq_deinit(&conn->mqlocal);
+        msg_free(conn->fbuf);
+        conn->fbuf = NULL;
+        msg_free(conn->cbuf);
+        conn->cbuf = NULL;
+        sub_conntab_del(backend, conn);
+    }
+}
+
+
+
+int conn_open(void* conn_handle) {
+/// Used by frontend when a websocket opens a client connection.  The socket is
+/// non-blocking, so the connect never stalls the service loop.  An AF_UNIX 
+/// connect doesn't complete in the background: when the listen backlog of 
+/// the daemon is full, it fails with EAGAIN, and it must be tried again.  
+/// Other socket types complete in the background (EINPROGRESS), and trying
+/// again reports the result (EALREADY while pending, EISCONN when done).
     DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    backend_t* backend;
+    int rc;
+    bool first;
     conn_t* conn;
-    int bytes_in;
+    struct sockaddr_un addr;
+    
+    if (conn_handle == NULL) {
+        return -1;
+    }
+    conn = conn_handle;
+    
+    // A subscriber opens its hub, which is created again if it has closed.  
+    // A hub that fails is deleted, so the next subscriber tries a new one.
+    if (sub_issubscriber(conn)) {
+        conn_t* hub = sub_hub_open(conn->backend, conn->hub, conn->sock_handle);
+        if (hub == NULL) {
+            return -1;
+        }
+        rc = conn_open(hub);
+        if (rc < 0) {
+            conn_close(hub);
+            conn_del(conn->backend, hub);
+        }
+        return rc;
+    }
+    if (conn->state == CONN_OPEN) {
+        return 0;
+    }
+    
+    // On the first try, the socket is made non-blocking, and the timeout of
+    // the mapping begins.
+    first = (conn->state == CONN_IDLE);
+    if (first) {
+        int flags = fcntl(conn->fd_ds, F_GETFL, 0);
+        if ((flags < 0) || (fcntl(conn->fd_ds, F_SETFL, flags | O_NONBLOCK) < 0)) {
+            conn->mapstat->connfails++;
+            return -1;
+        }
+        conn->state     = CONN_CONNECTING;
+        conn->deadline  = sub_now_ms() + conn->sock_handle->ctimeout;
+    }
+    
+    // Open a connection to the client socket
+    ///@todo the connection procedure could be different for different conn types
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, conn->sock_handle->l_socket, UNIX_PATH_MAX);
+    
+    rc = connect(conn->fd_ds, (struct sockaddr *)&addr, sizeof(struct sockaddr_un));
+    if ((rc == 0) || (errno == EISCONN)) {
+        conn->state = CONN_OPEN;
+        conn->mapstat->connects++;
+        return 0;
+    }
+    if ((errno == EAGAIN) || (errno == EINPROGRESS) || (errno == EALREADY) || (errno == EINTR)) {
+        if (sub_now_ms() >= conn->deadline) {
+            conn->mapstat->conntimeouts++;
+            return -2;
+        }
+        if (first) {
+            conn->mapstat->connpending++;
+        }
+        return 1;
+    }
+    
+    conn->mapstat->connfails++;
+    return -1;
+}
+
+
+
+void conn_close(void* conn_handle) {
+/// Used by frontend when a websocket closes a client connection
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    if ((conn_handle == NULL) || sub_issubscriber(conn_handle)) {
+        return;
+    }
+    
+    // Close this connection, once
+    ///@todo might be different ways to close based on different connection types
+    if (((conn_t*)conn_handle)->fd_ds >= 0) {
+        close ( ((conn_t*)conn_handle)->fd_ds );
+        ((conn_t*)conn_handle)->fd_ds = -1;
+    }
+}
+
+
+
+static void sub_adaptread(conn_t* conn, size_t bytes_in) {
+/// The read size doubles after a read fills it, up to the cap of the mapping.
+/// After a run of reads that use less than a quarter of it, it halves, down 
+/// to the initial size of the mapping.
+    if (bytes_in >= conn->rdsize) {
+        conn->rdsmall = 0;
+        if (conn->rdsize < conn->sock_handle->pagemax) {
+            conn->rdsize *= 2;
+            if (conn->rdsize > conn->sock_handle->pagemax) {
+                conn->rdsize = conn->sock_handle->pagemax;
+            }
+        }
+    }
+    else if (bytes_in < (conn->rdsize / 4)) {
+        if ((++conn->rdsmall >= 16) && (conn->rdsize > conn->sock_handle->pagesize)) {
+            conn->rdsmall = 0;
+            conn->rdsize /= 2;
+            if (conn->rdsize < conn->sock_handle->pagesize) {
+                conn->rdsize = conn->sock_handle->pagesize;
+            }
+        }
+    }
+    else {
+        conn->rdsmall = 0;
+    }
+}
+
 
-    if ((data == NULL) || (backend_handle == NULL) || (conn_handle == NULL)) {
+static int sub_putfrag(conn_t* conn, const uint8_t* data, size_t len, bool final) {
+/// Queues a fragment of a streamed message.  The final one ends the stream.
+/// Streaming needs the block policy, so a fragment is never dropped: one that
+/// isn't queued is retried once there is room, and the stream is unchanged.
+    uint32_t flags = (conn->fcont ? WEBF_CONT : 0) | (final ? 0 : WEBF_MORE);
+    
+    if ((sub_slow_admit(conn, len) == 0)
+    ||  (mq_putmsg_flags(&conn->mqweb, data, len, flags) != 0)) {
+        conn->fwant = len;
         return -1;
     }
-    backend = backend_handle;
-    conn    = conn_handle;
+    sub_webqueued(conn, len);
+    conn->mapstat->frags++;
+    conn->fcont     = !final;
+    conn->fstream   = !final;
+    return 0;
+}
+
+
+static int sub_unframe(conn_t* conn) {
+/// Moves the complete messages in the staging buffer to the web queue, and 
+/// discards oversize messages, or streams them if the mapping allows it.  
+/// Delimiters are found with memchr(), which is vectorized by the C library,
+/// and the scan resumes where it stopped, so a large message is scanned once.
+/// If the queue has no room for the next message, its size is kept in fwant,
+/// and framing stops there, unless the slow-consumer policy drops messages.
+    uint8_t* buf    = conn->fbuf->data;
+    size_t msgmax   = conn->sock_handle->msgmax;
+    bool stream     = (conn->sock_handle->stream != 0);
+    bool delimited  = (conn->sock_handle->framing == FRAMING_NEWLINE) 
+                   || (conn->sock_handle->framing == FRAMING_NUL);
+    uint8_t delim   = (conn->sock_handle->framing == FRAMING_NUL) ? 0 : '\n';
+    int msgs        = 0;
     
-    ///@todo currently there is only one type of read, via read()
-    bytes_in = (int)read(conn->fd_ds, backend->buf, backend->bufsize);
+    conn->fwant = 0;
+    conn->fdest = NULL;
+    while (conn->fhead < conn->ftail) {
+        uint8_t* start  = &buf[conn->fhead];
+        size_t avail    = conn->ftail - conn->fhead;
+        size_t hdrlen   = 0;
+        size_t msglen;
+        conn_t* dest    = conn;
+        mq_key_t key;
+        int admit;
+        
+        // Discard the remainder of an oversize message.  With delimiters, 
+        // that is through the next delimiter.
+        if (conn->fskip != 0) {
+            size_t skip = (conn->fskip < avail) ? conn->fskip : avail;
+            if (delimited) {
+                uint8_t* end    = memchr(start, delim, avail);
+                skip            = (end != NULL) ? (size_t)(end - start) + 1 : avail;
+                conn->fskip     = (end != NULL) ? 0 : 1;
+            }
+            else {
+                conn->fskip -= skip;
+            }
+            conn->fhead += skip;
+            conn->fscan  = conn->fhead;
+            continue;
+        }
+        
+        // Continue a streamed message with the data that is here, in 
+        // fragments of up to msgmax.  The end of a delimited message isn't
+        // known until its delimiter, so its last byte is held back for the
+        // final fragment, which then is never empty.
+        if (conn->fstream) {
+            bool final;
+            size_t fraglen;
+            
+            if (delimited) {
+                uint8_t* end = memchr(&buf[conn->fscan], delim, conn->ftail - conn->fscan);
+                final   = (end != NULL);
+                fraglen = final ? (size_t)(end - start) : (avail - 1);
+                if (!final) {
+                    conn->fscan = conn->ftail;
+                }
+            }
+            else {
+                final   = (avail >= conn->fremain);
+                fraglen = final ? conn->fremain : avail;
+            }
+            if (fraglen > msgmax) {
+                fraglen = msgmax;
+                final   = false;
+            }
+            if ((fraglen == 0) || (sub_putfrag(conn, start, fraglen, final) != 0)) {
+                goto sub_unframe_EXIT;
+            }
+            conn->fhead    += fraglen + ((final && delimited) ? 1 : 0);
+            conn->fremain  -= delimited ? 0 : fraglen;
+            if (conn->fscan < conn->fhead) {
+                conn->fscan = conn->fhead;
+            }
+            continue;
+        }
+        
+        switch (conn->sock_handle->framing) {
+            case FRAMING_NEWLINE:
+            case FRAMING_NUL: {
+                uint8_t* end    = memchr(&buf[conn->fscan], delim, conn->ftail - conn->fscan);
+                if (end == NULL) {
+                    conn->fscan = conn->ftail;
+                    if (avail > msgmax) {
+                        if (stream) {
+                            conn->mapstat->streamed++;
+                            conn->fstream = true;
+                            continue;
+                        }
+                        conn->fdrops++;
+                        conn->fskip = 1;
+                        continue;
+                    }
+                    goto sub_unframe_EXIT;
+                }
+                msglen = (size_t)(end - start);
+                avail  = msglen + 1;
+                if (msglen > msgmax) {
+                    if (stream) {
+                        conn->mapstat->streamed++;
+                        conn->fstream = true;
+                        continue;
+                    }
+                    conn->fdrops++;
+                    conn->fhead += avail;
+                    conn->fscan  = conn->fhead;
+                    continue;
+                }
+            } break;
+            
+            case FRAMING_LEN16:
+                if (avail < 2) {
+                    goto sub_unframe_EXIT;
+                }
+                hdrlen  = 2;
+                msglen  = ((size_t)start[0] << 8) | (size_t)start[1];
+                goto sub_unframe_PREFIX;
+                
+            case FRAMING_LEN32:
+                if (avail < 4) {
+                    goto sub_unframe_EXIT;
+                }
+                hdrlen  = 4;
+                msglen  = ((size_t)start[0] << 24) | ((size_t)start[1] << 16)
+                        | ((size_t)start[2] << 8)  | (size_t)start[3];
+                goto sub_unframe_PREFIX;
+            
+            // A multiplexed message goes to the queue of its subscriber.  A
+            // message for a closed channel is discarded, and counted.
+            case FRAMING_MUX:
+                if (avail < MUX_HDRLEN) {
+                    goto sub_unframe_EXIT;
+                }
+                hdrlen  = MUX_HDRLEN;
+                msglen  = ((size_t)start[5] << 16) | ((size_t)start[6] << 8) | (size_t)start[7];
+                dest    = sub_mux_route(conn, start);
+            sub_unframe_PREFIX:
+                if ((msglen > msgmax) && stream) {
+                    conn->mapstat->streamed++;
+                    conn->fstream   = true;
+                    conn->fremain   = msglen;
+                    conn->fhead    += hdrlen;
+                    conn->fscan     = conn->fhead;
+                    continue;
+                }
+                if (msglen > msgmax) {
+                    conn->fdrops++;
+                    conn->fskip = hdrlen + msglen;
+                    continue;
+                }
+                if (avail < (hdrlen + msglen)) {
+                    goto sub_unframe_EXIT;
+                }
+                avail = hdrlen + msglen;
+                break;
+            
+            default:
+                goto sub_unframe_EXIT;
+        }
+        
+        // A complete message of msglen bytes is at start+hdrlen, and the 
+        // whole frame is avail bytes.  Empty messages are skipped.
+        if ((msglen != 0) && (dest == NULL)) {
+            conn->fdrops++;
+        }
+        else if (msglen != 0) {
+            // The key of a conflating session is found once, to admit the 
+            // message and to queue it.
+            key.len = 0;
+            if (dest->ktab != NULL) {
+                sub_ckey(dest->sock_handle, start + hdrlen, msglen, &key);
+            }
+            admit = sub_conflate_isqueued(dest, start + hdrlen, &key) ? 1 : sub_slow_admit(dest, msglen);
+            if (admit == 0) {
+                conn->fwant = msglen;
+                conn->fdest = (dest != conn) ? dest : NULL;
+                goto sub_unframe_EXIT;
+            }
+            if (admit > 0) {
+                sub_putmsg(dest, start + hdrlen, msglen, &key);
+                msgs++;
+                if (dest != conn) {
+                    conn->hub->demuxed++;
+                    if (dest->wsi != NULL) {
+                        lws_callback_on_writable(dest->wsi);
+                    }
+                }
+            }
+        }
+        conn->fhead += avail;
+        conn->fscan  = conn->fhead;
+    }
     
-    *data = backend->buf;
-    return bytes_in;
+    sub_unframe_EXIT:
+    if (conn->fhead == conn->ftail) {
+        conn->fhead = 0;
+        conn->fscan = 0;
+        conn->ftail = 0;
+    }
+    return msgs;
+}
+
+
+int conn_framemsg_forweb(void* conn_handle) {
+/// A mux subscriber frames the messages of its hub, because one of them may 
+/// be waiting for room in its queue.
+    conn_t* conn = conn_handle;
+    if ((conn != NULL) && sub_ismux(conn)) {
+        conn = sub_upstream(conn);
+    }
+    if ((conn == NULL) || (conn->fbuf == NULL)) {
+        return 0;
+    }
+    return sub_unframe(conn);
+}
+
+
+static int sub_readrc(ssize_t bytes_in) {
+/// Returns the result of a read from the daemon that got no data: 0 at end 
+/// of file, -3 if it would block, or -4 on error.
+    if (bytes_in == 0) {
+        return 0;
+    }
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+        return -3;
+    }
+    return -4;
 }
 
 
+static ssize_t sub_pending(conn_t* conn) {
+/// Returns the size of the next read from the daemon, without reading it: the
+/// length of the next SEQPACKET message, or the bytes pending on a stream, up
+/// to the read size.  Like recv(), it returns 0 at end of file, or -1 with 
+/// errno set when there is nothing to read.
+    uint8_t peek;
+    int avail = 0;
+    
+    if (conn->sock_handle->framing == FRAMING_SEQPACKET) {
+        return recv(conn->fd_ds, &peek, 0, MSG_PEEK | MSG_TRUNC);
+    }
+    if ((ioctl(conn->fd_ds, FIONREAD, &avail) == 0) && (avail > 0)) {
+        return ((size_t)avail < conn->rdsize) ? (ssize_t)avail : (ssize_t)conn->rdsize;
+    }
+    return recv(conn->fd_ds, &peek, 1, MSG_PEEK);
+}
+
 
-int conn_writeraw_local(void* backend_handle, void* conn_handle, void* data, size_t len) {
-/// returns the number of bytes read, or negative on error.
-/// "data" parameter stores a void* output
-/// backend_handle is needed to locate the read buffer
+int conn_readraw_local(void* backend_handle, void* conn_handle) {
+/// Reads from the daemon directly into the queue for the websocket.  The read
+/// buffer is a record reserved in the queue, which already has LWS_PRE 
+/// headroom, so the data is written to the websocket without another copy.
+/// Stream framing is the exception: data is read into the staging buffer,
+/// and the messages are copied from there into the queue.
+/// The socket is drained until it would block, unless the queue fills, a 
+/// governor throttles, or the read budget is used.  In those cases, the next
+/// rx callback continues where this one stopped.
 /// conn_handle is needed to determine the type of read to be done.
     DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    backend_t* backend;
+    static uint8_t discard[WFEDD_PARAM(QUEUE_MIN)];
+    conn_t* conn;
+    void* payload;
+    size_t size;
+    size_t total = 0;
+    size_t published = 0;
+    ssize_t pending;
+    ssize_t bytes_in;
+    int admit = 1;
+    int rc = -2;
+
+    if ((backend_handle == NULL) || (conn_handle == NULL)) {
+        return -1;
+    }
+    conn = conn_handle;
+    
+    while (total < WFEDD_PARAM(READ_BUDGET)) {
+        if (conn_isthrottled(conn)) {
+            rc = -2;
+            break;
+        }
+        
+        if (conn->fbuf != NULL) {
+            // Messages waiting for room must be queued before reading more.
+            // Then, the unframed data is moved to the front of the buffer.
+            sub_unframe(conn);
+            if (conn->fwant != 0) {
+                rc = -2;
+                break;
+            }
+            if (conn->fhead != 0) {
+                memmove(conn->fbuf->data, &conn->fbuf->data[conn->fhead], conn->ftail - conn->fhead);
+                conn->fscan -= conn->fhead;
+                conn->ftail -= conn->fhead;
+                conn->fhead  = 0;
+            }
+            size    = conn->fbuf->alloc - conn->ftail;
+            size    = (conn->rdsize < size) ? conn->rdsize : size;
+            payload = &conn->fbuf->data[conn->ftail];
+        }
+        else {
+            // A SEQPACKET read must hold the largest message.  When a full
+            // read would pass the high-water mark of a session, the data 
+            // pending on the socket is measured, so the slow-consumer policy
+            // applies to the bytes that are read.  A read that the policy 
+            // drops goes to the discard buffer, and MSG_TRUNC discards the
+            // rest of a packet.
+            size    = (conn->sock_handle->framing == FRAMING_SEQPACKET) ? 
+                        conn->sock_handle->msgmax : conn->rdsize;
+            pending = ((conn->hub != NULL) || sub_slow_hasroom(conn, size)) ? 
+                        (ssize_t)size : sub_pending(conn);
+            if (pending <= 0) {
+                rc = sub_readrc(pending);
+                break;
+            }
+            if ((size_t)pending > size) {
+                // SEQPACKET message is too large, so it is discarded
+                conn->fdrops++;
+                admit = -1;
+            }
+            else {
+                size    = (size_t)pending;
+                admit   = sub_slow_admit(conn, size);
+            }
+            if (admit == 0) {
+                conn->fwant = (conn->hub == NULL) ? size : 0;
+                rc = -2;
+                break;
+            }
+            conn->fwant = 0;
+            if (admit < 0) {
+                size    = (size < sizeof(discard)) ? size : sizeof(discard);
+                payload = discard;
+            }
+            else if ((payload = mq_reserve(&conn->mqweb, size)) == NULL) {
+                rc = -2;
+                break;
+            }
+        }
+        
+        ///@todo currently there is only one type of read, via recv()
+        bytes_in = recv(conn->fd_ds, payload, size, 
+                    (conn->sock_handle->framing == FRAMING_SEQPACKET) ? MSG_TRUNC : 0);
+        if (bytes_in <= 0) {
+            if ((conn->fbuf == NULL) && (admit > 0)) {
+                mq_commit(&conn->mqweb, 0);
+            }
+            rc = sub_readrc(bytes_in);
+            break;
+        }
+        
+        DEBUG_PRINTF("reading msg from daemon: %.*s\n", (int)bytes_in, (char*)payload);
+        if (conn->fbuf != NULL) {
+            conn->ftail += (size_t)bytes_in;
+            sub_unframe(conn);
+        }
+        else if (admit < 0) {
+            bytes_in = (bytes_in > (ssize_t)size) ? (ssize_t)size : bytes_in;
+        }
+        else if ((size_t)bytes_in > size) {
+            // SEQPACKET message was truncated, so it is discarded
+            mq_commit(&conn->mqweb, 0);
+            conn->fdrops++;
+        }
+        else {
+            mq_commit(&conn->mqweb, (size_t)bytes_in);
+            sub_webqueued(conn, (size_t)bytes_in);
+        }
+        if (conn->sock_handle->framing != FRAMING_SEQPACKET) {
+            sub_adaptread(conn, (size_t)bytes_in);
+        }
+        total += (size_t)bytes_in;
+        
+        // A fan-out hub publishes as it reads, which empties its queue for the
+        // next read
+        if ((conn->hub != NULL) && (conn->sock_handle->fanout != 0)) {
+            published += sub_fanout_publish(conn->hub);
+        }
+    }
+    if (published != 0) {
+        sub_fanout_wake(conn);
+    }
+    
+    return (total != 0) ? (int)total : rc;
+}
+
+
+
+int conn_writeraw_local(void* backend_handle, void* conn_handle) {
+/// Writes the messages queued for the daemon, as many as fit in one gathered
+/// write.  A short write leaves the unwritten bytes at the front of the 
+/// queue, for the next writeable callback.  SEQPACKET messages are each 
+/// written alone, because each write is a packet.
+/// returns the number of bytes written, or negative when nothing was written:
+/// -2 nothing queued, -3 would block, -4 write error.
+/// conn_handle is needed to determine the type of write to be done.
+    DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
+    struct iovec iov[WFEDD_PARAM(WRITEV_MAX)];
+    struct msghdr msg;
     conn_t* conn;
+    ssize_t bytes_out;
+    size_t total = 0;
+    int rc = -2;
 
-    if ((data == NULL) || (len == 0) || (backend_handle == NULL) || (conn_handle == NULL)) {
+    if ((backend_handle == NULL) || (conn_handle == NULL)) {
         return -1;
     }
-    backend = backend_handle;
-    conn    = conn_handle;
+    conn = conn_handle;
+    
+    while (!mq_isempty(&conn->mqlocal)) {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov     = iov;
+        msg.msg_iovlen  = mq_peekv(&conn->mqlocal, iov, 
+                            (conn->sock_handle->framing == FRAMING_SEQPACKET) ? 1 : WFEDD_PARAM(WRITEV_MAX));
+        
+        ///@todo currently there is only one type of write, via sendmsg()
+        ///@note sendmsg() is writev() with flags: SIGPIPE is not wanted
+        bytes_out = sendmsg(conn->fd_ds, &msg, MSG_NOSIGNAL);
+        if (bytes_out < 0) {
+            rc = ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? -3 : -4;
+            break;
+        }
+        
+        mq_consume(&conn->mqlocal, (size_t)bytes_out);
+        sub_dequeued(conn, (size_t)bytes_out);
+        total += (size_t)bytes_out;
+        
+        // One gathered write per call, unless SEQPACKET
+        if (conn->sock_handle->framing != FRAMING_SEQPACKET) {
+            break;
+        }
+    }
     
-    ///@todo currently there is only one type of write, via write()
-    return (int)write(conn->fd_ds, data, len);
+    return (total != 0) ? (int)total : rc;
 }
 
 
@@ -592,10 +2791,9 @@ lws_adoption_type conn_get_adoptiontype(void* conn_handle) {
 
 int conn_get_descriptor(void* conn_handle) {
     DEBUG_PRINTF("%s %i\n", __FUNCTION__, __LINE__);
-    conn_t* conn;
-    if (conn_handle) {
+    conn_t* conn = sub_upstream(conn_handle);
+    if (conn) {
         ///@todo there's only one type of conn at this moment.
-        conn = conn_handle;
         return conn->fd_ds;
     }
     return -1;
@@ -607,3 +2805,38 @@ const char* conn_get_protocolname(void* conn_handle) {
     static const char* pname = "CLI";
     return pname;
 }
+
+
+const char* conn_get_wsname(void* conn_handle) {
+    if (conn_handle == NULL) {
+        return NULL;
+    }
+    return ((conn_t*)conn_handle)->sock_handle->websocket;
+}
+
+
+void* conn_get_upstream(void* conn_handle) {
+    return sub_upstream(conn_handle);
+}
+
+
+bool conn_isshared(void* conn_handle) {
+    return (conn_handle != NULL) && sub_issubscriber(conn_handle);
+}
+
+
+void conn_set_websocket(void* conn_handle, struct lws* wsi) {
+    if (conn_handle != NULL) {
+        ((conn_t*)conn_handle)->wsi = wsi;
+    }
+}
+
+
+bool conn_isended(void* conn_handle) {
+    return (conn_handle != NULL) && (((conn_t*)conn_handle)->state == CONN_ENDED);
+}
+
+
+bool conn_isslow(void* conn_handle) {
+    return (conn_handle != NULL) && ((conn_t*)conn_handle)->sclose;
+}
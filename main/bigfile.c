@@ -0,0 +1,562 @@
+/*  Copyright 2020, JP Norair
+  *
+  * Redistribution and use in source and binary forms, with or without 
+  * modification, are permitted provided that the following conditions are met:
+  *
+  * 1. Redistributions of source code must retain the above copyright notice, 
+  *    this list of conditions and the following disclaimer.
+  *
+  * 2. Redistributions in binary form must reproduce the above copyright 
+  *    notice, this list of conditions and the following disclaimer in the 
+  *    documentation and/or other materials provided with the distribution.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+  * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+  * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+  * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+  * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+  * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+  * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+  * POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include "wfedd_cfg.h"
+#include "bigfile.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#   include <sys/sendfile.h>
+#   define BIGFILE_SENDFILE 1
+#else
+#   define BIGFILE_SENDFILE 0
+#endif
+
+
+static bigfile_stat_t bigstat;
+
+
+
+
+static size_t sub_pagesize(void) {
+    static size_t pagesize = 0;
+    
+    if (pagesize == 0) {
+        long n = sysconf(_SC_PAGESIZE);
+        pagesize = (n > 0) ? (size_t)n : 4096;
+    }
+    return pagesize;
+}
+
+
+static size_t sub_roundup(size_t n) {
+/// Rounds up to whole pages, which is the granularity of mmap()
+    size_t pagesize = sub_pagesize();
+    return ((n + pagesize - 1) / pagesize) * pagesize;
+}
+
+
+int bigfile_open(bigfile_t* bf, const char* path, size_t headroom, struct stat* st) {
+    struct stat fst;
+    
+    memset(bf, 0, sizeof(bigfile_t));
+    bf->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (bf->fd < 0) {
+        return -1;
+    }
+    if ((fstat(bf->fd, &fst) != 0) || !S_ISREG(fst.st_mode)) {
+        close(bf->fd);
+        bf->fd = -1;
+        return -2;
+    }
+    if (st != NULL) {
+        *st = fst;
+    }
+    bf->size        = (uint64_t)fst.st_size;
+    bf->end         = bf->size;
+    bf->headroom    = headroom;
+    bigstat.files++;
+    
+#   if defined(POSIX_FADV_SEQUENTIAL)
+    // Large files are read once, front to back, so read-ahead is worth more
+    // than keeping the pages that were sent.
+    posix_fadvise(bf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#   endif
+    return 0;
+}
+
+
+void bigfile_close(bigfile_t* bf) {
+    if (bf->base != NULL) {
+        munmap(bf->base, bf->reserve);
+        bf->base = NULL;
+    }
+    if (bf->fd >= 0) {
+        close(bf->fd);
+        bf->fd = -1;
+    }
+}
+
+
+void bigfile_select(bigfile_t* bf, uint64_t first, uint64_t last) {
+    bf->offset  = first;
+    bf->end     = last + 1;
+}
+
+
+bool bigfile_cansendfile(void) {
+    return (BIGFILE_SENDFILE != 0);
+}
+
+
+long bigfile_sendfile(bigfile_t* bf, int sockfd, size_t max) {
+#if BIGFILE_SENDFILE
+    off_t off = (off_t)bf->offset;
+    ssize_t n;
+    
+    if (max > (bf->end - bf->offset)) {
+        max = (size_t)(bf->end - bf->offset);
+    }
+    if (max == 0) {
+        return 0;
+    }
+    n = sendfile(sockfd, bf->fd, &off, max);
+    bigstat.sendcalls++;
+    if (n < 0) {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+    }
+    if (n == 0) {
+        // The file ended early, so it was truncated after it was opened
+        return -1;
+    }
+    bf->offset += (uint64_t)n;
+    bigstat.sentbytes += (unsigned long long)n;
+    return (long)n;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+uint8_t* bigfile_window(bigfile_t* bf, size_t max, size_t* len) {
+    size_t window = sub_roundup(WFEDD_PARAM(MMAP_PAGESIZE));
+    size_t avail;
+    
+    if (bf->offset >= bf->end) {
+        return NULL;
+    }
+    
+    // The reservation is made on first use, because a file that is sent with
+    // sendfile() never needs it.  Its headroom is anonymous memory.
+    if (bf->base == NULL) {
+        void* base;
+        bf->headroom    = sub_roundup(bf->headroom);
+        bf->reserve     = bf->headroom + window;
+        base = mmap(NULL, bf->reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        bf->base    = base;
+        bf->winlen  = 0;
+    }
+    
+    if ((bf->winlen == 0) 
+    ||  (bf->offset < bf->winoff) 
+    ||  (bf->offset >= (bf->winoff + bf->winlen))) {
+        struct stat st;
+        uint64_t winoff = bf->offset - (bf->offset % sub_pagesize());
+        size_t winlen   = window;
+        
+        // Pages past the end of a file that shrank would fault when they are
+        // read, so the file is checked each time the window moves.
+        if ((fstat(bf->fd, &st) != 0) || ((uint64_t)st.st_size < bf->end)) {
+            return NULL;
+        }
+        if ((bf->end - winoff) < winlen) {
+            winlen = (size_t)(bf->end - winoff);
+        }
+        if (mmap(&bf->base[bf->headroom], winlen, PROT_READ | PROT_WRITE, 
+                 MAP_PRIVATE | MAP_FIXED, bf->fd, (off_t)winoff) == MAP_FAILED) {
+            bf->winlen = 0;
+            return NULL;
+        }
+        bf->winoff  = winoff;
+        bf->winlen  = winlen;
+        bigstat.maps++;
+    }
+    
+    avail = (size_t)((bf->winoff + bf->winlen) - bf->offset);
+    *len = (avail < max) ? avail : max;
+    return &bf->base[bf->headroom + (size_t)(bf->offset - bf->winoff)];
+}
+
+
+void bigfile_advance(bigfile_t* bf, size_t len) {
+    bf->offset += len;
+    bigstat.mapbytes += len;
+}
+
+
+bool bigfile_done(const bigfile_t* bf) {
+    return (bf->offset >= bf->end);
+}
+
+
+
+
+static const char* sub_skipspace(const char* s) {
+    while ((*s == ' ') || (*s == '\t')) {
+        s++;
+    }
+    return s;
+}
+
+
+static const char* sub_number(const char* s, uint64_t* val) {
+/// Parses decimal digits.  NULL if there are none, or on overflow.
+    const char* start = s;
+    uint64_t n = 0;
+    
+    while (isdigit((unsigned char)*s)) {
+        uint64_t digit = (uint64_t)(*s - '0');
+        if (n > ((UINT64_MAX - digit) / 10)) {
+            return NULL;
+        }
+        n = (n * 10) + digit;
+        s++;
+    }
+    if (s == start) {
+        return NULL;
+    }
+    *val = n;
+    return s;
+}
+
+
+int bigfile_range(const char* range, uint64_t size, uint64_t* first, uint64_t* last) {
+    const char* s = sub_skipspace(range);
+    uint64_t a, b;
+    
+    if (strncasecmp(s, "bytes", 5) != 0) {
+        return 1;
+    }
+    s = sub_skipspace(s + 5);
+    if (*s != '=') {
+        return 1;
+    }
+    s = sub_skipspace(s + 1);
+    if (strchr(s, ',') != NULL) {
+        return 1;
+    }
+    
+    if (*s == '-') {
+        // Suffix range: the last b bytes
+        s = sub_number(s + 1, &b);
+        if ((s == NULL) || (*sub_skipspace(s) != 0)) {
+            return 1;
+        }
+        if ((b == 0) || (size == 0)) {
+            bigstat.unsatisfiable++;
+            return -1;
+        }
+        *first  = (b < size) ? (size - b) : 0;
+        *last   = size - 1;
+    }
+    else {
+        s = sub_number(s, &a);
+        if (s == NULL) {
+            return 1;
+        }
+        s = sub_skipspace(s);
+        if (*s != '-') {
+            return 1;
+        }
+        s = sub_skipspace(s + 1);
+        if (*s == 0) {
+            b = UINT64_MAX;
+        }
+        else {
+            s = sub_number(s, &b);
+            if ((s == NULL) || (*sub_skipspace(s) != 0) || (b < a)) {
+                return 1;
+            }
+        }
+        if (a >= size) {
+            bigstat.unsatisfiable++;
+            return -1;
+        }
+        *first  = a;
+        *last   = (b < size) ? b : (size - 1);
+    }
+    
+    bigstat.ranges++;
+    return 0;
+}
+
+
+void bigfile_getstats(bigfile_stat_t* stats) {
+    *stats = bigstat;
+}
+
+
+
+
+#ifdef BIGFILETEST
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/// Compares the ways that a large file may be written to a socket.  A child 
+/// process drains the other end of a socketpair and hashes what it reads, so
+/// each method is also checked for the bytes it sent.
+///
+///   read+write    a userspace buffer, as lws_serve_http_file() does
+///   mmap+write    slices of the mapped window (the TLS and HTTP/2 path)
+///   sendfile      the plain HTTP/1 path
+///
+/// "copies" are bytes that cross the user/kernel boundary in the server.
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t hash;
+} drain_t;
+
+enum { METHOD_READ = 0, METHOD_MMAP, METHOD_SENDFILE };
+
+
+static uint64_t sub_fnv64(uint64_t hash, const uint8_t* data, size_t len) {
+    while (len-- != 0) {
+        hash = (hash ^ *data++) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+static void sub_writeall(int fd, const uint8_t* data, size_t len) {
+    while (len != 0) {
+        ssize_t n = write(fd, data, len);
+        assert(n > 0);
+        data    += n;
+        len     -= (size_t)n;
+    }
+}
+
+
+static void sub_drain(int sockfd, int resultfd) {
+    static uint8_t buf[64*1024];
+    drain_t result = { 0, 0xcbf29ce484222325ULL };
+    ssize_t n;
+    
+    while ((n = read(sockfd, buf, sizeof(buf))) > 0) {
+        result.bytes   += (uint64_t)n;
+        result.hash     = sub_fnv64(result.hash, buf, (size_t)n);
+    }
+    sub_writeall(resultfd, (const uint8_t*)&result, sizeof(result));
+    _exit(0);
+}
+
+
+static double sub_tvsecs(const struct timeval* tv) {
+    return (double)tv->tv_sec + ((double)tv->tv_usec / 1e6);
+}
+
+
+static void sub_bench(const char* name, const char* path, int method, uint64_t size, uint64_t hash) {
+    static uint8_t buf[WFEDD_PARAM(ASSET_CHUNK)];
+    unsigned long calls = 0;
+    unsigned long long copies = 0;
+    struct rusage ru0, ru1;
+    struct timespec t0, t1;
+    bigfile_t bf;
+    drain_t result;
+    double secs;
+    int sv[2], pv[2];
+    pid_t pid;
+    
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(pipe(pv) == 0);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        close(sv[0]);
+        close(pv[0]);
+        sub_drain(sv[1], pv[1]);
+    }
+    close(sv[1]);
+    close(pv[1]);
+    
+    getrusage(RUSAGE_SELF, &ru0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    
+    if (method == METHOD_READ) {
+        int fd = open(path, O_RDONLY);
+        ssize_t n;
+        assert(fd >= 0);
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            sub_writeall(sv[0], buf, (size_t)n);
+            calls  += 2;
+            copies += 2 * (unsigned long long)n;
+        }
+        close(fd);
+    }
+    else {
+        bigfile_stat_t s0, s1;
+        bigfile_getstats(&s0);
+        assert(bigfile_open(&bf, path, 16, NULL) == 0);
+        while (!bigfile_done(&bf)) {
+            if (method == METHOD_MMAP) {
+                size_t len;
+                uint8_t* data = bigfile_window(&bf, sizeof(buf), &len);
+                assert(data != NULL);
+                sub_writeall(sv[0], data, len);
+                bigfile_advance(&bf, len);
+                calls++;
+                copies += len;
+            }
+            else {
+                assert(bigfile_sendfile(&bf, sv[0], WFEDD_PARAM(BIGFILE_SENDMAX)) > 0);
+            }
+        }
+        bigfile_close(&bf);
+        bigfile_getstats(&s1);
+        calls += (s1.maps - s0.maps) + (s1.sendcalls - s0.sendcalls);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    getrusage(RUSAGE_SELF, &ru1);
+    close(sv[0]);
+    
+    assert(read(pv[0], &result, sizeof(result)) == (ssize_t)sizeof(result));
+    close(pv[0]);
+    waitpid(pid, NULL, 0);
+    assert(result.bytes == size);
+    assert(result.hash == hash);
+    
+    secs = (double)(t1.tv_sec - t0.tv_sec) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e9);
+    printf("%-12s %9.1f MB/s  user=%.3fs sys=%.3fs  syscalls=%-7lu copies=%llu\n",
+            name, ((double)size / (1024.0*1024.0)) / secs,
+            sub_tvsecs(&ru1.ru_utime) - sub_tvsecs(&ru0.ru_utime),
+            sub_tvsecs(&ru1.ru_stime) - sub_tvsecs(&ru0.ru_stime),
+            calls, copies);
+}
+
+
+static void sub_test_range(void) {
+    uint64_t first, last;
+    
+    assert(bigfile_range("bytes=0-99", 1000, &first, &last) == 0);
+    assert((first == 0) && (last == 99));
+    assert(bigfile_range("bytes=500-", 1000, &first, &last) == 0);
+    assert((first == 500) && (last == 999));
+    assert(bigfile_range("bytes=-100", 1000, &first, &last) == 0);
+    assert((first == 900) && (last == 999));
+    assert(bigfile_range("bytes=-5000", 1000, &first, &last) == 0);
+    assert((first == 0) && (last == 999));
+    assert(bigfile_range("bytes=900-5000", 1000, &first, &last) == 0);
+    assert((first == 900) && (last == 999));
+    assert(bigfile_range(" Bytes = 1 - 2 ", 1000, &first, &last) == 0);
+    assert((first == 1) && (last == 2));
+    
+    // Unsatisfiable
+    assert(bigfile_range("bytes=1000-", 1000, &first, &last) < 0);
+    assert(bigfile_range("bytes=-0", 1000, &first, &last) < 0);
+    assert(bigfile_range("bytes=0-", 0, &first, &last) < 0);
+    
+    // Ignored, so the whole file is sent
+    assert(bigfile_range("bytes=0-1,5-9", 1000, &first, &last) == 1);
+    assert(bigfile_range("bytes=9-5", 1000, &first, &last) == 1);
+    assert(bigfile_range("bytes=a-5", 1000, &first, &last) == 1);
+    assert(bigfile_range("bytes=-", 1000, &first, &last) == 1);
+    assert(bigfile_range("items=0-5", 1000, &first, &last) == 1);
+    assert(bigfile_range("bytes=99999999999999999999-", 1000, &first, &last) == 1);
+}
+
+
+static void sub_test_window(const char* path, const uint8_t* data, uint64_t size) {
+/// Slices of a range that starts off a page boundary, and crosses windows, 
+/// have the bytes of the file and writable headroom.
+    uint64_t first  = 1000;
+    uint64_t last   = (3 * WFEDD_PARAM(MMAP_PAGESIZE)) + 77;
+    bigfile_t bf;
+    
+    assert(last < size);
+    assert(bigfile_open(&bf, path, 16, NULL) == 0);
+    bigfile_select(&bf, first, last);
+    while (!bigfile_done(&bf)) {
+        size_t len;
+        uint8_t* slice = bigfile_window(&bf, 5000, &len);
+        assert((slice != NULL) && (len != 0) && (len <= 5000));
+        assert((bf.offset + len) <= (last + 1));
+        assert(memcmp(slice, &data[bf.offset], len) == 0);
+        memset(slice - 16, 0xA5, 16);
+        bigfile_advance(&bf, len);
+    }
+    assert(bf.offset == (last + 1));
+    assert(bigfile_window(&bf, 5000, &first) == NULL);
+    bigfile_close(&bf);
+}
+
+
+int main(int argc, char** argv) {
+    char path[] = "/tmp/bigfileXXXXXX";
+    uint64_t size = 64;
+    uint64_t hash;
+    uint8_t* data;
+    int fd;
+    
+    if (argc > 1) {
+        size = strtoull(argv[1], NULL, 10);
+    }
+    size *= 1024 * 1024;
+    
+    sub_test_range();
+    
+    data = malloc((size_t)size);
+    assert(data != NULL);
+    srand(1);
+    for (uint64_t i=0; i<size; i++) {
+        data[i] = (uint8_t)rand();
+    }
+    hash = sub_fnv64(0xcbf29ce484222325ULL, data, (size_t)size);
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    sub_writeall(fd, data, (size_t)size);
+    close(fd);
+    
+    sub_test_window(path, data, size);
+    
+    printf("%llu MB file, %u byte writes, %u byte window\n", 
+            (unsigned long long)(size / (1024*1024)), 
+            WFEDD_PARAM(ASSET_CHUNK), WFEDD_PARAM(MMAP_PAGESIZE));
+    sub_bench("read+write", path, METHOD_READ, size, hash);
+    sub_bench("mmap+write", path, METHOD_MMAP, size, hash);
+    if (bigfile_cansendfile()) {
+        sub_bench("sendfile", path, METHOD_SENDFILE, size, hash);
+    }
+    
+    unlink(path);
+    free(data);
+    return 0;
+}
+
+#endif
@@ -58,5 +58,30 @@ INTF_Type cliopt_getintf(void) {
     return master->intf;
 }
 
+size_t cliopt_getqbudget(void) {
+    return master->qbudget;
+}
+
+size_t cliopt_getassetcache(void) {
+    return master->assetcache;
+}
 
+bool cliopt_ispreload(void) {
+    return master->preload_on;
+}
+
+unsigned int cliopt_getmaxage(void) {
+    return master->maxage;
+}
 
+const char* cliopt_getbundle(void) {
+    return master->bundle;
+}
+
+unsigned int cliopt_geth2streams(void) {
+    return master->h2streams;
+}
+
+size_t cliopt_geth2window(void) {
+    return master->h2window;
+}
@@ -24,13 +24,19 @@
   */
   
 
+#include "wfedd_cfg.h"
+#include "cliopt.h"
 #include "frontend.h"
 #include "backend.h"
 #include "debug.h"
 
 #include <libwebsockets.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
 
 
 /// 
@@ -45,6 +51,82 @@ static const lws_retry_bo_t retry = {
 };
 #endif
 
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+/// permessage-deflate is offered on every vhost, and each websocket declines it
+/// unless its mapping enables it.
+static const struct lws_extension extensions[] = {
+    {
+        "permessage-deflate",
+        lws_extension_callback_pm_deflate,
+        "permessage-deflate; client_no_context_takeover; client_max_window_bits"
+    },
+    { NULL, NULL, NULL }
+};
+#endif
+
+
+
+
+static size_t sub_rxmax(struct lws* wsi) {
+/// The largest message that a websocket delivers in one rx callback
+    size_t rxmax = lws_get_protocol(wsi)->rx_buffer_size;
+    return (rxmax != 0) ? rxmax : WFEDD_PARAM(QUEUE_MIN);
+}
+
+
+static struct lws* sub_rawwsi(struct per_session_data* pss, struct per_vhost_data* vhd) {
+/// The daemon wsi of a session, which is shared in a fan-out or multiplexed
+/// mapping
+    if ((pss->conn_handle != NULL) && conn_isshared(pss->conn_handle)) {
+        return vhd->hubwsi;
+    }
+    return pss->lwsi;
+}
+
+
+static struct per_vhost_data* sub_hubvhd(struct lws* wsi, void* conn) {
+/// The vhost data of a hub, whose daemon wsi has no parent session
+    struct lws_vhost* vhost = lws_get_vhost(wsi);
+    const struct lws_protocols* protocol;
+    
+    protocol = lws_vhost_name_to_protocol(vhost, conn_get_wsname(conn));
+    if (protocol == NULL) {
+        return NULL;
+    }
+    return lws_protocol_vh_priv_get(vhost, protocol);
+}
+
+
+static void sub_schedule_write(struct lws* wsi, void* conn) {
+/// Asks for a writeable callback on the websocket now or, while the queue is 
+/// held to coalesce messages, when the hold ends.  The hold is counted from 
+/// the oldest message, so re-arming the timer doesn't push the write back.
+/// The timer is shared with the rx rate limit, so it is armed for the one 
+/// that ends first, and the writeable callback checks both.
+    long hold = conn_holdus_forweb(conn);
+    long wait = conn_rxwait(conn);
+    if (hold > 0) {
+        lws_set_timer_usecs(wsi, ((wait > 0) && (wait < hold)) ? wait : hold);
+    }
+    else {
+        lws_callback_on_writable(wsi);
+    }
+}
+
+
+static void sub_rxresume(struct lws* wsi, void* conn) {
+/// Resumes receiving from the websocket once the token buckets allow it, or
+/// arms the timer to check again then, unless a coalescing hold ends first.
+    long wait = conn_rxwait(conn);
+    long hold;
+    if (wait == 0) {
+        lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_RATE);
+    }
+    else {
+        hold = conn_holdus_forweb(conn);
+        lws_set_timer_usecs(wsi, ((hold > 0) && (hold < wait)) ? hold : wait);
+    }
+}
 
 
 
@@ -55,7 +137,9 @@ int frontend_cli_callback(  struct lws *wsi,
                             size_t len      ) {
 /// Handles a raw client socket.  The purpose of this callback is to enqueue
 /// received messages for forwarding onto the associated websocket.
-/// The "user" pointer is the backend connection object (conn_t*).
+/// The "user" pointer is the backend connection object (conn_t*).  In a 
+/// fan-out or multiplexed mapping, it is the hub, and the wsi has no parent:
+/// the sessions are woken by the backend when it queues messages for them.
     void* backend   = lws_context_user(lws_get_context(wsi));
     void* conn      = lws_get_opaque_user_data(wsi);
     int rc = 0;
@@ -71,39 +155,101 @@ int frontend_cli_callback(  struct lws *wsi,
         //your code should do the read having been informed there is something to read now.
         case LWS_CALLBACK_RAW_RX_FILE: {
             DEBUG_PRINTF("%s LWS_CALLBACK_RAW_RX_FILE\n", __FUNCTION__);
+            struct lws* parent = lws_get_parent(wsi);
             int size;
-            void* data;
-            size = conn_readraw_local(&data, backend, conn);
-            DEBUG_PRINTF("reading msg frome otdb: %s\n", (char*)data);
-            if (size > 0) {
-                conn_putmsg_forweb(conn, data, (size_t)size);
-                lws_callback_on_writable(lws_get_parent(wsi));
+            
+            // If too much data is queued overall, stop reading from the 
+            // daemon until the governor releases.  The session is woken by a
+            // writeable callback when that happens.
+            if (conn_isthrottled(conn)) {
+                lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_GOVERN);
+                break;
+            }
+            
+            // If the queue to the websocket is full, stop reading from the 
+            // daemon until the websocket has drained it.
+            if (!conn_hasroom_forweb(conn)) {
+                lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_QUEUE);
+                if (parent != NULL) {
+                    lws_callback_on_writable(parent);
+                }
+                break;
+            }
+            
+            // The daemon data is read directly into the queue, until the
+            // socket would block or the read budget is used.  If the read
+            // stopped because the queue filled or a governor throttled, the
+            // daemon input is paused as above.
+            size = conn_readraw_local(backend, conn);
+            if ((size > 0) && (parent != NULL)) {
+                sub_schedule_write(parent, conn);
+            }
+            if (conn_isthrottled(conn)) {
+                lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_GOVERN);
+            }
+            else if (!conn_hasroom_forweb(conn)) {
+                lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_QUEUE);
             }
         } break;
     
-        //RAW mode file is writeable
-        case LWS_CALLBACK_RAW_WRITEABLE_FILE:
+        //RAW mode file is writeable.  The queued messages are written in
+        //one batch.  The writeable callback is only re-armed while data 
+        //remains, which includes the tail of a short write.
+        case LWS_CALLBACK_RAW_WRITEABLE_FILE: {
             DEBUG_PRINTF("%s LWS_CALLBACK_RAW_WRITEABLE_FILE\n", __FUNCTION__);
-            while (conn_hasmsg_forlocal(conn)) {
-                mq_msg_t* msg;
-                // Get the next message for this websocket.  Exit if no message.
-                msg = conn_getmsg_forlocal(conn);
-                if (msg == NULL)  {
-                    break;
+            struct lws* parent = lws_get_parent(wsi);
+            
+            if (conn_writeraw_local(backend, conn) == -4) {
+                lwsl_warn("error writing to daemon: %s\n", conn_get_protocolname(conn));
+                rc = -1;
+                break;
+            }
+            if (conn_hasmsg_forlocal(conn)) {
+                lws_callback_on_writable(wsi);
+            }
+            
+            // Once the queue is empty, or it can take another rx buffer, the
+            // websocket may resume receiving.
+            if ((parent != NULL) 
+            && (!conn_hasmsg_forlocal(conn) || conn_hasroom_forlocal(conn, sub_rxmax(parent)))) {
+                lws_rx_flow_control(parent, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_QUEUE);
+            }
+            
+            // The sessions of a hub resume receiving in their 
+            // writeable callbacks, once the shared queue is empty.
+            else if ((parent == NULL) && !conn_hasmsg_forlocal(conn)) {
+                struct per_vhost_data* vhd = sub_hubvhd(wsi, conn);
+                if (vhd != NULL) {
+                    lws_callback_on_writable_all_protocol(lws_get_context(wsi), vhd->protocol);
                 }
-                // Finally, write the message onto the raw socket and free it.
-                DEBUG_PRINTF("writing msg to otdb: %s\n", (char*)msg->data);
-                conn_writeraw_local(backend, conn, msg->data, msg->size);
-                msg_free(msg);
             }
-            break;
+        } break;
         
-        // RAW mode wsi that adopted a file is closing
-        case LWS_CALLBACK_RAW_CLOSE_FILE:
+        // RAW mode wsi that adopted a file is closing.  The connection is 
+        // stored in the session of the parent websocket, which stays open. 
+        // When the websocket is closing, lws closes this wsi first, and it
+        // detaches it from the parent beforehand.  A hub is stored in the 
+        // backend, and its sessions stay subscribed: the next session to
+        // connect opens it again.
+        case LWS_CALLBACK_RAW_CLOSE_FILE: {
             DEBUG_PRINTF("%s LWS_CALLBACK_RAW_CLOSE_FILE\n", __FUNCTION__);
+            struct lws* parent = lws_get_parent(wsi);
+            if (parent == NULL) {
+                struct per_vhost_data* vhd = sub_hubvhd(wsi, conn);
+                if ((vhd != NULL) && (vhd->hubwsi == wsi)) {
+                    vhd->hubwsi = NULL;
+                }
+            }
             conn_close(conn);   
             conn_del(backend, conn);
-            break;
+            if (parent != NULL) {
+                struct per_session_data* pss = lws_wsi_user(parent);
+                if (pss != NULL) {
+                    pss->conn_handle = NULL;
+                    pss->lwsi = NULL;
+                }
+            }
+        } break;
         
         default: 
             DEBUG_PRINTF("%s REASON=%i\n", __FUNCTION__, reason);
@@ -114,19 +260,566 @@ int frontend_cli_callback(  struct lws *wsi,
 }
 
 
+static int sub_http_finalize(struct lws* wsi, uint8_t* start, uint8_t** p, 
+                                uint8_t* end, bool body) {
+/// Writes the headers of a response.  On an HTTP/2 stream, a response with 
+/// no body ends the stream with its headers, because no final write follows.
+    int len;
+    
+    if (body || (lws_get_network_wsi(wsi) == wsi)) {
+        return lws_finalize_write_http_header(wsi, start, p, end);
+    }
+    if (lws_finalize_http_header(wsi, p, end)) {
+        return 1;
+    }
+    len = (int)(*p - start);
+    return (lws_write(wsi, start, (size_t)len, LWS_WRITE_HTTP_HEADERS | LWS_WRITE_H2_STREAM_END) != len);
+}
+
+
+static int sub_http_encheaders(struct lws* wsi, const char* encname, bool vary, 
+                                uint8_t** p, uint8_t* end) {
+/// Adds Content-Encoding for a compressed body, and Vary for any response 
+/// whose body depends on Accept-Encoding, so that caches keep them apart.
+    static const char vary_value[] = "Accept-Encoding";
+    
+    if ((encname != NULL) 
+    &&  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, 
+                            (const uint8_t*)encname, (int)strlen(encname), p, end)) {
+        return 1;
+    }
+    if (vary
+    &&  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_VARY, 
+                            (const uint8_t*)vary_value, sizeof(vary_value)-1, p, end)) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static int sub_http_cacheheaders(struct lws* wsi, const char* etag, time_t mtime, 
+                                const char* cachecontrol, uint8_t** p, uint8_t* end) {
+/// Adds the validators and the Cache-Control policy of a response.  etag is
+/// NULL for files that are served from the filesystem.
+    char date[40];
+    int dlen;
+    
+    if ((etag != NULL) 
+    &&  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_ETAG, 
+                            (const uint8_t*)etag, (int)strlen(etag), p, end)) {
+        return 1;
+    }
+    dlen = assets_httpdate(mtime, date, sizeof(date));
+    if ((dlen > 0)
+    &&  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_LAST_MODIFIED, 
+                            (const uint8_t*)date, dlen, p, end)) {
+        return 1;
+    }
+    if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, 
+                            (const uint8_t*)cachecontrol, (int)strlen(cachecontrol), p, end)) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static int sub_http_notmodified(struct lws* wsi, const char* etag, time_t mtime, 
+                                const char* cachecontrol, bool vary) {
+/// Answers a conditional request with 304, which has the headers that a 200
+/// would have, but no body.
+    uint8_t headers[LWS_PRE + WFEDD_PARAM(ASSET_HEADERS)];
+    uint8_t* start  = &headers[LWS_PRE];
+    uint8_t* p      = start;
+    uint8_t* end    = &headers[sizeof(headers) - 1];
+    
+    if (lws_add_http_header_status(wsi, HTTP_STATUS_NOT_MODIFIED, &p, end)
+    ||  sub_http_cacheheaders(wsi, etag, mtime, cachecontrol, &p, end)
+    ||  sub_http_encheaders(wsi, NULL, vary, &p, end)
+    ||  sub_http_finalize(wsi, start, &p, end, false)) {
+        return -1;
+    }
+    return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+
+static void sub_http_fileclose(struct per_http_data* phd) {
+    if (phd->isfile) {
+        bigfile_close(&phd->file);
+        phd->isfile = false;
+    }
+}
+
+
+static bool sub_http_ifrange(struct lws* wsi, const char* etag, time_t mtime) {
+/// A Range applies when there is no If-Range, or when If-Range names the 
+/// file that would be sent: by its ETag, or by its exact Last-Modified date.
+/// Otherwise the file changed since the client got the first part of it.
+    char ifrange[128];
+    char date[40];
+    int dlen;
+    
+    if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_IF_RANGE) <= 0) {
+        return true;
+    }
+    if (lws_hdr_copy(wsi, ifrange, sizeof(ifrange), WSI_TOKEN_HTTP_IF_RANGE) <= 0) {
+        return false;
+    }
+    if (ifrange[0] == '"') {
+        return (strcmp(ifrange, etag) == 0);
+    }
+    if ((ifrange[0] == 'W') && (ifrange[1] == '/')) {
+        return false;
+    }
+    dlen = assets_httpdate(mtime, date, sizeof(date));
+    return (dlen > 0) && (strcmp(ifrange, date) == 0);
+}
+
+
+static int sub_http_unsatisfiable(struct lws* wsi, uint64_t size) {
+/// Answers a Range that is outside of the file with 416, and the size.
+    uint8_t headers[LWS_PRE + WFEDD_PARAM(ASSET_HEADERS)];
+    uint8_t* start  = &headers[LWS_PRE];
+    uint8_t* p      = start;
+    uint8_t* end    = &headers[sizeof(headers) - 1];
+    char crange[48];
+    int n = snprintf(crange, sizeof(crange), "bytes */%llu", (unsigned long long)size);
+    
+    if (lws_add_http_header_status(wsi, HTTP_STATUS_REQ_RANGE_NOT_SATISFIABLE, &p, end)
+    ||  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_RANGE, 
+                            (const uint8_t*)crange, n, &p, end)
+    ||  lws_add_http_header_content_length(wsi, 0, &p, end)
+    ||  sub_http_finalize(wsi, start, &p, end, false)) {
+        return -1;
+    }
+    return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+
+static int sub_http_servefile(struct lws* wsi, struct per_http_data* phd, const char* path, 
+                                const char* accept, const char* ifnonematch, const char* ifmodsince) {
+/// Serves a file that is too large for the cache from the filesystem, or its
+/// sidecar.  Its ETag is made from the inode, size, and time of the file that
+/// is sent, because hashing the content would mean reading it each request.
+/// One byte range may be requested, so downloads can be resumed.  The body is
+/// written from the writeable callback, without copying it through a buffer.
+    uint8_t headers[LWS_PRE + WFEDD_PARAM(ASSET_HEADERS)];
+    uint8_t* start  = &headers[LWS_PRE];
+    uint8_t* p      = start;
+    uint8_t* end    = &headers[sizeof(headers) - 1];
+    char fullpath[PATH_MAX];
+    char etag[64];
+    char range[64];
+    char crange[64];
+    char clen[24];
+    const char* mimetype = lws_get_mimetype(path, NULL);
+    const char* cachecontrol = assets_cachecontrol(path);
+    unsigned int status = HTTP_STATUS_OK;
+    uint64_t first, last, size, len;
+    struct stat st, fst;
+    asset_enc_t enc;
+    bool body;
+    int rc;
+    
+    if ((mimetype == NULL)
+    ||  (snprintf(fullpath, sizeof(fullpath), "%s/%s", assets_origin(), path) >= (int)sizeof(fullpath))
+    ||  (stat(fullpath, &st) != 0)) {
+        lws_return_http_status(wsi, (mimetype == NULL) ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND, NULL);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    
+    enc = assets_select(NULL, path, accept);
+    if (snprintf(fullpath, sizeof(fullpath), "%s/%s%s", assets_origin(), path, 
+                 assets_encext(enc)) >= (int)sizeof(fullpath)) {
+        return -1;
+    }
+    if (bigfile_open(&phd->file, fullpath, LWS_PRE, &fst) != 0) {
+        lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    phd->isfile = true;
+    size        = phd->file.size;
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", (unsigned long long)fst.st_ino, 
+                (unsigned long long)fst.st_size, (unsigned long long)fst.st_mtime);
+    
+    if (assets_notmodified(etag, st.st_mtime, ifnonematch, ifmodsince)) {
+        sub_http_fileclose(phd);
+        return sub_http_notmodified(wsi, etag, st.st_mtime, cachecontrol, true);
+    }
+    
+    // A Range is of the body that is sent, which may be a sidecar.  One that
+    // is too long to copy is a set of ranges, which are ignored anyway.
+    if ((lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_RANGE) > 0)
+    &&  (lws_hdr_copy(wsi, range, sizeof(range), WSI_TOKEN_HTTP_RANGE) > 0)
+    &&  sub_http_ifrange(wsi, etag, st.st_mtime)) {
+        rc = bigfile_range(range, size, &first, &last);
+        if (rc < 0) {
+            sub_http_fileclose(phd);
+            return sub_http_unsatisfiable(wsi, size);
+        }
+        if (rc == 0) {
+            bigfile_select(&phd->file, first, last);
+            status = HTTP_STATUS_PARTIAL_CONTENT;
+        }
+    }
+    len     = phd->file.end - phd->file.offset;
+    body    = (len != 0) && (lws_hdr_total_length(wsi, WSI_TOKEN_HEAD_URI) <= 0);
+    
+    // sendfile() writes to the socket itself, so it is only used when lws 
+    // doesn't encrypt or frame the body.  In that case, Content-Length is
+    // added by token, so lws doesn't expect to write the body.
+    phd->usesendfile = bigfile_cansendfile() && !lws_is_ssl(wsi) 
+                    && (lws_get_network_wsi(wsi) == wsi);
+    snprintf(clen, sizeof(clen), "%llu", (unsigned long long)len);
+    snprintf(crange, sizeof(crange), "bytes %llu-%llu/%llu", (unsigned long long)phd->file.offset,
+                (unsigned long long)(phd->file.end - 1), (unsigned long long)size);
+    if (lws_add_http_header_status(wsi, status, &p, end)
+    ||  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, 
+                            (const uint8_t*)mimetype, (int)strlen(mimetype), &p, end)
+    ||  (phd->usesendfile ?
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_LENGTH, 
+                            (const uint8_t*)clen, (int)strlen(clen), &p, end) :
+            lws_add_http_header_content_length(wsi, (unsigned long long)len, &p, end))
+    ||  lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_ACCEPT_RANGES, 
+                            (const uint8_t*)"bytes", 5, &p, end)
+    ||  ((status == HTTP_STATUS_PARTIAL_CONTENT)
+        && lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_RANGE, 
+                            (const uint8_t*)crange, (int)strlen(crange), &p, end))
+    ||  sub_http_encheaders(wsi, assets_encname(enc), true, &p, end)
+    ||  sub_http_cacheheaders(wsi, etag, st.st_mtime, cachecontrol, &p, end)
+    ||  sub_http_finalize(wsi, start, &p, end, body)) {
+        return -1;
+    }
+    
+    if (!body) {
+        sub_http_fileclose(phd);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+
+static int sub_http_writefile(struct lws* wsi, struct per_http_data* phd) {
+/// Writes the next part of a large file.  sendfile() writes as much as the
+/// socket takes, once lws has sent what it buffered.  Otherwise, a slice of
+/// the mapped window is written like a chunk of a cached asset.
+    if (phd->usesendfile) {
+        if (!lws_partial_buffered(wsi)
+        &&  (bigfile_sendfile(&phd->file, lws_get_socket_fd(wsi), WFEDD_PARAM(BIGFILE_SENDMAX)) < 0)) {
+            return -1;
+        }
+    }
+    else {
+        uint8_t* data;
+        size_t size;
+        bool final;
+        
+        data = bigfile_window(&phd->file, WFEDD_PARAM(ASSET_CHUNK), &size);
+        if (data == NULL) {
+            return -1;
+        }
+        final = ((phd->file.offset + size) >= phd->file.end);
+        if (lws_write(wsi, data, size, final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < (int)size) {
+            return -1;
+        }
+        bigfile_advance(&phd->file, size);
+    }
+    
+    if (!bigfile_done(&phd->file)) {
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+    sub_http_fileclose(phd);
+    return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+
+static int sub_http_serve(struct lws* wsi, struct per_http_data* phd, const char* uri) {
+/// Starts a response from the asset cache.  uri is the path after the mount
+/// point.  The headers are written here, and the body is written in chunks
+/// from the writeable callback.  Files that are too large for the cache are
+/// sent from the filesystem, with Range support.  Both send the best 
+/// precompressed body that the client accepts, and answer conditional 
+/// requests with 304.
+    uint8_t headers[LWS_PRE + WFEDD_PARAM(ASSET_HEADERS)];
+    uint8_t* start  = &headers[LWS_PRE];
+    uint8_t* p      = start;
+    uint8_t* end    = &headers[sizeof(headers) - 1];
+    char accept[128];
+    char ifnonematch[256];
+    char ifmodsince[64];
+    char path[PATH_MAX];
+    asset_t* asset;
+    bool vary;
+    bool body;
+    size_t plen;
+    int rc;
+    
+    // A header that is missing, or too long to copy, is ignored.
+    if (lws_hdr_copy(wsi, accept, sizeof(accept), WSI_TOKEN_HTTP_ACCEPT_ENCODING) < 0) {
+        accept[0] = 0;
+    }
+    if (lws_hdr_copy(wsi, ifnonematch, sizeof(ifnonematch), WSI_TOKEN_HTTP_IF_NONE_MATCH) < 0) {
+        ifnonematch[0] = 0;
+    }
+    if (lws_hdr_copy(wsi, ifmodsince, sizeof(ifmodsince), WSI_TOKEN_HTTP_IF_MODIFIED_SINCE) < 0) {
+        ifmodsince[0] = 0;
+    }
+    
+    // Directories are served by their index file, which is the same default
+    // that the mount has without the cache.
+    while (*uri == '/') {
+        uri++;
+    }
+    plen = strlen(uri);
+    if ((plen == 0) || (uri[plen-1] == '/')) {
+        rc = snprintf(path, sizeof(path), "%sindex.html", uri);
+    }
+    else {
+        rc = snprintf(path, sizeof(path), "%s", uri);
+    }
+    if (rc >= (int)sizeof(path)) {
+        rc = ASSETS_NOTFOUND;
+    }
+    else {
+        rc = assets_get(path, &phd->asset);
+    }
+    
+    if (rc == ASSETS_UNCACHED) {
+        return sub_http_servefile(wsi, phd, path, accept, ifnonematch, ifmodsince);
+    }
+    if (rc != 0) {
+        lws_return_http_status(wsi, (rc == ASSETS_FORBIDDEN) ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND, NULL);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    
+    asset       = phd->asset;
+    vary        = (asset->body[ASSET_GZIP].chunk != NULL) || (asset->body[ASSET_BR].chunk != NULL);
+    phd->offset = 0;
+    phd->enc    = assets_select(asset, path, accept);
+    
+    if (assets_notmodified(asset->etag[phd->enc], asset->mtime, ifnonematch, ifmodsince)) {
+        rc = sub_http_notmodified(wsi, asset->etag[phd->enc], asset->mtime, asset->cachecontrol, vary);
+        assets_put(asset);
+        phd->asset = NULL;
+        return rc;
+    }
+    
+    // Empty files and HEAD requests have no body to write.
+    body = (asset->body[phd->enc].size != 0) && (lws_hdr_total_length(wsi, WSI_TOKEN_HEAD_URI) <= 0);
+    if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, asset->mimetype, 
+                                    (long long)asset->body[phd->enc].size, &p, end)
+    ||  sub_http_encheaders(wsi, assets_encname(phd->enc), vary, &p, end)
+    ||  sub_http_cacheheaders(wsi, asset->etag[phd->enc], asset->mtime, asset->cachecontrol, &p, end)
+    ||  sub_http_finalize(wsi, start, &p, end, body)) {
+        return -1;
+    }
+    if (!body) {
+        assets_put(asset);
+        phd->asset = NULL;
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+
 int frontend_http_callback(  struct lws *wsi, 
                             enum lws_callback_reasons reason, 
                             void *user, 
                             void *in, 
                             size_t len) {
-/// There could be an additional switch statement, here, that does additional
-/// work to what's available in the dummy function.
+/// Requests on the mount are served from the asset cache, when it is open.
+/// Everything else is left to the dummy function.
+    struct per_http_data* phd = (struct per_http_data*)user;
+    
+    switch (reason) {
+        case LWS_CALLBACK_HTTP:
+            if (assets_isopen() && (phd != NULL)) {
+                return sub_http_serve(wsi, phd, (const char*)in);
+            }
+            break;
+    
+        case LWS_CALLBACK_HTTP_WRITEABLE: {
+            uint8_t* data;
+            size_t size;
+            bool final;
+            
+            if ((phd != NULL) && phd->isfile) {
+                return sub_http_writefile(wsi, phd);
+            }
+            if ((phd == NULL) || (phd->asset == NULL)) {
+                break;
+            }
+            
+            // Chunks are written whole, from the cache, which reserves LWS_PRE
+            // ahead of each one.
+            data    = assets_chunk(phd->asset, phd->enc, phd->offset, &size);
+            final   = ((phd->offset + size) >= phd->asset->body[phd->enc].size);
+            if (lws_write(wsi, data, size, final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < (int)size) {
+                return -1;
+            }
+            phd->offset += size;
+            if (!final) {
+                lws_callback_on_writable(wsi);
+                return 0;
+            }
+            assets_put(phd->asset);
+            phd->asset = NULL;
+            if (lws_http_transaction_completed(wsi)) {
+                return -1;
+            }
+        } return 0;
+        
+        case LWS_CALLBACK_CLOSED_HTTP:
+            if (phd != NULL) {
+                assets_put(phd->asset);
+                phd->asset = NULL;
+                sub_http_fileclose(phd);
+            }
+            break;
+        
+        default:
+            break;
+    }
+    
     return lws_callback_http_dummy(wsi, reason, user, in, len);
 }
 
 
 
 
+static int sub_connect(struct lws* wsi, struct per_session_data* pss, 
+                        struct per_vhost_data* vhd, void* backend) {
+/// Connects a session to its daemon, without blocking.  While the connect is
+/// pending, it is retried from a timer on the websocket, and the messages 
+/// from the websocket are queued.  Once connected, the daemon socket is 
+/// adopted, and the queued messages are sent.  If the connect fails, or it
+/// times out, the websocket is closed with a reason.
+/// In a fan-out or multiplexed mapping, the daemon socket of the hub is 
+/// adopted once, by the first session that connects.  It has no parent, 
+/// because it outlives that session.
+    lws_adoption_type type;
+    lws_sock_file_fd_type desc;
+    const char* pname;
+    int rc;
+    
+    rc = conn_open(pss->conn_handle);
+    if (rc > 0) {
+        lws_set_timer_usecs(wsi, WFEDD_PARAM(CONNECT_RETRY));
+        return 0;
+    }
+    if ((rc == 0) && conn_isshared(pss->conn_handle)) {
+        void* hub = conn_get_upstream(pss->conn_handle);
+        if (vhd->hubwsi == NULL) {
+            desc.filefd = conn_get_descriptor(hub);
+            type        = conn_get_adoptiontype(hub);
+            pname       = conn_get_protocolname(hub);
+            vhd->hubwsi = lws_adopt_descriptor_vhost(vhd->vhost, type, desc, pname, NULL);
+            if (vhd->hubwsi != NULL) {
+                lws_set_opaque_user_data(vhd->hubwsi, hub);
+            }
+        }
+        if (vhd->hubwsi != NULL) {
+            if (conn_hasmsg_forlocal(hub)) {
+                lws_callback_on_writable(vhd->hubwsi);
+            }
+            if (conn_hasroom_forweb(hub)) {
+                lws_rx_flow_control(vhd->hubwsi, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_QUEUE);
+            }
+            return 0;
+        }
+    }
+    else if (rc == 0) {
+        // Adopt the connection to the lws service loop, and this vhost.
+        desc.filefd = conn_get_descriptor(pss->conn_handle);
+        type        = conn_get_adoptiontype(pss->conn_handle);
+        pname       = conn_get_protocolname(pss->conn_handle);
+        pss->lwsi   = lws_adopt_descriptor_vhost(vhd->vhost, type, desc, pname, wsi);
+        if (pss->lwsi != NULL) {
+            // This will enable access of the conn handle from the child wsi
+            lws_set_opaque_user_data(pss->lwsi, pss->conn_handle);
+            if (conn_hasmsg_forlocal(pss->conn_handle)) {
+                lws_callback_on_writable(pss->lwsi);
+            }
+            return 0;
+        }
+    }
+    
+    lwsl_warn("%s: %s connecting to daemon\n", vhd->protocol->name, 
+                (rc == -2) ? "timeout" : "error");
+    conn_close(pss->conn_handle);
+    conn_del(backend, pss->conn_handle);
+    pss->conn_handle = NULL;
+    lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, 
+                    (unsigned char*)"daemon unavailable", 18);
+    return -1;
+}
+
+
+
+static void sub_deflate_init(struct lws* wsi, struct per_session_data* pss, 
+                            struct per_vhost_data* vhd) {
+/// Sets the deflate parameters of a websocket that negotiated permessage-
+/// deflate.  They bound the zlib memory of the session: the window bits and
+/// memory level apply when the deflate stream starts, with the first message,
+/// and without context takeover, the stream is reset after each message.
+    pss->zlevel = -1;
+#   if !defined(LWS_WITHOUT_EXTENSIONS)
+    char val[16];
+    
+    if ((vhd->map == NULL) || (vhd->map->deflate == 0)) {
+        return;
+    }
+    
+    // This fails if the browser didn't negotiate the extension
+    snprintf(val, sizeof(val), "%zu", vhd->map->zmem);
+    if (lws_set_extension_option(wsi, "permessage-deflate", "mem_level", val) != 0) {
+        return;
+    }
+    snprintf(val, sizeof(val), "%zu", vhd->map->zwbits);
+    lws_set_extension_option(wsi, "permessage-deflate", "server_max_window_bits", val);
+    lws_set_extension_option(wsi, "permessage-deflate", "server_no_context_takeover", 
+                            (vhd->map->znoctx != 0) ? "1" : "0");
+    snprintf(val, sizeof(val), "%i", WFEDD_PARAM(DEFLATE_LEVEL));
+    lws_set_extension_option(wsi, "permessage-deflate", "compression_level", val);
+    pss->zlevel = WFEDD_PARAM(DEFLATE_LEVEL);
+#   endif
+}
+
+
+static int sub_write_deflate(struct lws* wsi, struct per_session_data* pss, 
+                            const sockmap_t* map, uint8_t* data, size_t size,
+                            enum lws_write_protocol wp) {
+/// Writes a frame to a websocket that deflates.  Messages smaller than the 
+/// mapping's minimum are sent stored (level 0), which costs a few bytes and
+/// no CPU.  The level only changes between messages, never within one, and
+/// it takes effect because the stream restarts with each message: a minimum
+/// is only set with deflatenoctx.
+    struct timespec t0, t1;
+    int level = pss->zlevel;
+    int m;
+    
+    if ((wp & 0x1F) != LWS_WRITE_CONTINUATION) {
+        level = (size < map->zmin) ? 0 : WFEDD_PARAM(DEFLATE_LEVEL);
+        if (level != pss->zlevel) {
+            char val[4];
+            snprintf(val, sizeof(val), "%i", level);
+            lws_set_extension_option(wsi, "permessage-deflate", "compression_level", val);
+            pss->zlevel = level;
+        }
+    }
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    m = lws_write(wsi, data, size, wp);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    conn_count_deflate(pss->conn_handle, data, size, (level != 0), 
+                    (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec)));
+    return m;
+}
+
+
+
 /// This does most of the work in handling the websockets
 int frontend_ws_callback(   struct lws *wsi, 
                             enum lws_callback_reasons reason, 
@@ -135,6 +828,7 @@ int frontend_ws_callback(   struct lws *wsi,
                             size_t len      ) {
 	struct per_session_data *pss;
 	struct per_vhost_data *vhd;
+    struct lws* lwsi;
     void* backend;
 	int m;
     int rc = 0;   
@@ -152,43 +846,67 @@ int frontend_ws_callback(   struct lws *wsi,
 		vhd->context    = lws_get_context(wsi);
 		vhd->protocol   = lws_get_protocol(wsi);
 		vhd->vhost      = lws_get_vhost(wsi);
+        vhd->map        = backend_getmap(backend, vhd->protocol->name);
 		break;
+    
+    // permessage-deflate is declined, by returning nonzero, unless the 
+    // mapping enables it.
+    case LWS_CALLBACK_CONFIRM_EXTENSION_OKAY:
+        if ((vhd == NULL) || (vhd->map == NULL) || (vhd->map->deflate == 0)
+        ||  (strcmp((const char*)in, "permessage-deflate") != 0)) {
+            rc = 1;
+        }
+        break;
 
-	case LWS_CALLBACK_ESTABLISHED: {
-        lws_adoption_type type;
-        lws_sock_file_fd_type desc;
-        const char* pname;
-        
-        // Create a connection object to bridge the web and local worlds
-        pss->conn_handle = conn_new(backend, vhd->protocol->name);
+	case LWS_CALLBACK_ESTABLISHED:
+        // Create a connection object to bridge the web and local worlds.
+        // It is stored in the session.
+        pss->lwsi = NULL;
+        sub_deflate_init(wsi, pss, vhd);
+        pss->conn_handle = conn_new(backend, &pss->conn, vhd->protocol->name);
         if (pss->conn_handle == NULL) {
-            ///@todo Some sort of error reporting
+            lwsl_warn("%s: no daemon client socket\n", vhd->protocol->name);
             rc = -1;
         }
         else {
             // add ourselves to the list of live pss held in the vhd 
+            conn_set_websocket(pss->conn_handle, wsi);
             lws_ll_fwd_insert(pss, pss_list, vhd->pss_list);
             //pss->wsi = wsi;
-        
-            // open the connection -- must be accepted to be adopted
-            conn_open(pss->conn_handle);
-        
-            // Adopt the connection to the lws service loop, and this vhost.
-            desc.filefd = conn_get_descriptor(pss->conn_handle);
-            type        = conn_get_adoptiontype(pss->conn_handle);
-            pname       = conn_get_protocolname(pss->conn_handle);
-            pss->lwsi   = lws_adopt_descriptor_vhost(vhd->vhost, type, desc, pname, wsi);
-            
-            // This will enable access of the conn handle from the child wsi
-            lws_set_opaque_user_data(pss->lwsi, pss->conn_handle);
+            rc = sub_connect(wsi, pss, vhd, backend);
         }
-    } break;
+        break;
+    
+    // A pending connect to the daemon is retried on a timer, and the retries
+    // also check a pause by the rx rate limit.  Once connected, the timer 
+    // ends a hold of the queue for coalescing, or a pause by the rx limit.
+    case LWS_CALLBACK_TIMER:
+        if ((pss->conn_handle != NULL) && (sub_rawwsi(pss, vhd) == NULL)) {
+            rc = sub_connect(wsi, pss, vhd, backend);
+            if ((rc == 0) && (pss->conn_handle != NULL) && (sub_rawwsi(pss, vhd) != NULL)) {
+                sub_rxresume(wsi, pss->conn_handle);
+            }
+        }
+        else if (pss->conn_handle != NULL) {
+            lws_callback_on_writable(wsi);
+        }
+        break;
 
 	case LWS_CALLBACK_CLOSED: {
         DEBUG_PRINTF("%s LWS_CALLBACK_CLOSED\n", __FUNCTION__);
-        // Kill the corresponding daemon client socket
-        ///@todo could/should the socket closing part be in the raw callback?
-        //conn_close(pss->conn_handle);
+        // The daemon client socket is normally closed already, by the raw 
+        // callback.  If the session never adopted it, it's closed here.  A 
+        // session of a hub leaves it, and a multiplexed hub writes the close
+        // of its channel.
+        if (pss->conn_handle != NULL) {
+            lwsi = conn_isshared(pss->conn_handle) ? vhd->hubwsi : NULL;
+            conn_close(pss->conn_handle);
+            conn_del(backend, pss->conn_handle);
+            pss->conn_handle = NULL;
+            if ((lwsi != NULL) && (vhd->map != NULL) && (vhd->map->framing == FRAMING_MUX)) {
+                lws_callback_on_writable(lwsi);
+            }
+        }
         
         // remove our closing pss from the list of live pss 
 		lws_ll_fwd_remove(struct per_session_data, pss_list, pss, vhd->pss_list);
@@ -202,9 +920,27 @@ int frontend_ws_callback(   struct lws *wsi,
         /// This loop inspects the msg queue of the daemon socket (ds) that is
         /// associated with this websocket.  It will consume messages from the
         /// daemon socket queue until it has no more or until the websocket is
-        /// too busy to do so.
-        while (conn_hasmsg_forweb(pss->conn_handle)) {
-            mq_msg_t* msg;
+        /// too busy to do so.  Framed messages that were waiting for room in
+        /// the queue are added as the queue drains.  When the mapping 
+        /// coalesces, each frame may carry several messages, and the queue
+        /// is held until the frame fills or the linger time passes.
+        if (pss->conn_handle == NULL) {
+            break;
+        }
+        
+        // A session that fell behind a mapping with the close policy is 
+        // closed at once, and its queue is discarded.
+        if (conn_isslow(pss->conn_handle)) {
+            lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, (unsigned char*)"client too slow", 15);
+            rc = -1;
+            break;
+        }
+        lwsi = sub_rawwsi(pss, vhd);
+        while (conn_hasmsg_forweb(pss->conn_handle) 
+        ||    (conn_framemsg_forweb(pss->conn_handle) > 0)) {
+            enum lws_write_protocol wp;
+            void* data;
+            size_t size;
             
             // Re-instate this callback on the next service loop in the event that 
             // data cannot be written to it right now.
@@ -213,34 +949,116 @@ int frontend_ws_callback(   struct lws *wsi,
                 break;
             }
             
-            // Get the next message for this websocket.  Exit if no message.
-            msg = conn_getmsg_forweb(pss->conn_handle);
-            if (msg == NULL)  {
+            // Wait for more messages to coalesce, up to the linger time.
+            if (conn_holdus_forweb(pss->conn_handle) > 0) {
+                sub_schedule_write(wsi, pss->conn_handle);
                 break;
             }
             
-            // Finally, write the message onto the websocket.
-            ///@note We allowed for LWS_PRE in the payload via creation of the data
-            ///@todo have a specifier to select BINARY mode or TEXT
-            DEBUG_PRINTF("writing msg to ws: %s\n", (char*)msg->data+LWS_PRE);
-            m = lws_write(wsi, (uint8_t*)msg->data+LWS_PRE, msg->size, LWS_WRITE_TEXT);     //LWS_WRITE_BINARY
-            if (m < msg->size) {
+            // Get the next frame for this websocket.  Exit if no message.
+            data = conn_peekframe_forweb(pss->conn_handle, &size);
+            if (data == NULL)  {
+                break;
+            }
+            
+            // Finally, write the frame onto the websocket, and then remove its
+            // messages from the queue.  The opcode is by the payload mode.
+            ///@note The queue and the frame buffer reserve LWS_PRE ahead
+            DEBUG_PRINTF("writing msg to ws: %.*s\n", (int)size, (char*)data);
+            wp = conn_get_writeprotocol(pss->conn_handle, data, size);
+            if (pss->zlevel >= 0) {
+                m = sub_write_deflate(wsi, pss, vhd->map, (uint8_t*)data, size, wp);
+            }
+            else {
+                m = lws_write(wsi, (uint8_t*)data, size, wp);
+            }
+            if (m < size) {
                 lwsl_err("ERROR %d writing to ws\n", m);
                 rc = -1;
             }
             
-            msg_free(msg);
+            conn_popframe_forweb(pss->conn_handle);
+            
+            // A websocket over an HTTP/2 stream shares its connection, so it
+            // writes one frame per callback, and the streams take turns.
+            if (lws_get_network_wsi(wsi) != wsi) {
+                lws_callback_on_writable(wsi);
+                break;
+            }
+        }
+        
+        // A multiplexed daemon may close the channel of this session, which 
+        // then closes once its queue is written.
+        if (conn_isended(pss->conn_handle) && !conn_hasmsg_forweb(pss->conn_handle)) {
+            lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, (unsigned char*)"session ended", 13);
+            rc = -1;
+            break;
+        }
+        
+        // Resume reading from the daemon once there is room in the queue.
+        // There is no daemon wsi while the connect is pending.  In a fan-out
+        // mapping, the queue is the hub's, and the session resumes receiving
+        // here, because the hub has no parent to resume.
+        if ((lwsi != NULL) && conn_hasroom_forweb(pss->conn_handle)) {
+            lws_rx_flow_control(lwsi, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_QUEUE);
+        }
+        if ((lwsi != NULL) && (lwsi != pss->lwsi) 
+        &&  conn_hasroom_forlocal(pss->conn_handle, sub_rxmax(wsi))) {
+            lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_QUEUE);
+        }
+        
+        // Resume all inputs of this session once the governors release.
+        if (!conn_isthrottled(pss->conn_handle)) {
+            if (lwsi != NULL) {
+                lws_rx_flow_control(lwsi, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_GOVERN);
+            }
+            lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_ENABLE | WFEDD_RXFLOW_GOVERN);
         }
+        sub_rxresume(wsi, pss->conn_handle);
         break;
 
     /// Put the message received from the the websocket onto its queue.
     /// This message will be written to corresponding daemon socket (ds).
-	case LWS_CALLBACK_RECEIVE:
+	case LWS_CALLBACK_RECEIVE: {
         DEBUG_PRINTF("%s LWS_CALLBACK_RECEIVE\n", __FUNCTION__);
-        DEBUG_PRINTF("reading msg from ws: %s\n", (char*)in);
-        conn_putmsg_forlocal(pss->conn_handle, in, len);
-        lws_callback_on_writable(pss->lwsi);
-		break;
+        DEBUG_PRINTF("reading msg from ws: %.*s\n", (int)len, (char*)in);
+        if ((pss->conn_handle == NULL) || (conn_get_upstream(pss->conn_handle) == NULL)) {
+            lwsl_warn("daemon connection is closed: %zu bytes dropped\n", len);
+            break;
+        }
+        
+        // If a token bucket of the session or its mapping is empty, stop 
+        // receiving until it refills.  The data stays with the browser.  
+        // Messages that are dropped below still take their tokens.
+        if (conn_rxcharge(pss->conn_handle, lws_is_first_fragment(wsi) ? 1 : 0, len) > 0) {
+            lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_RATE);
+            sub_rxresume(wsi, pss->conn_handle);
+        }
+        
+        if (!conn_accepts_forlocal(pss->conn_handle, lws_frame_is_binary(wsi))) {
+            lwsl_warn("payload type not accepted: %zu bytes dropped\n", len);
+            break;
+        }
+        if (conn_putmsg_forlocal(pss->conn_handle, in, len) != 0) {
+            lwsl_warn("queue to daemon is full: %zu bytes dropped\n", len);
+        }
+        lwsi = sub_rawwsi(pss, vhd);
+        if (lwsi != NULL) {
+            lws_callback_on_writable(lwsi);
+        }
+        
+        // If the queue to the daemon cannot take another full rx buffer, stop
+        // receiving from the websocket until the daemon has drained it.
+        if (!conn_hasroom_forlocal(pss->conn_handle, sub_rxmax(wsi))) {
+            lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_QUEUE);
+        }
+        
+        // If too much data is queued overall, stop receiving until the 
+        // governor releases.
+        if (conn_isthrottled(pss->conn_handle)) {
+            lws_rx_flow_control(wsi, LWS_RXFLOW_REASON_APPLIES_DISABLE | WFEDD_RXFLOW_GOVERN);
+        }
+    } break;
 
 	default:
         DEBUG_PRINTF("%s REASON=%i\n", __FUNCTION__, reason);
@@ -253,25 +1071,43 @@ int frontend_ws_callback(   struct lws *wsi,
 
 
 
-mq_msg_t* frontend_createmsg(void* in, size_t len) {
-    mq_msg_t* msg = NULL;
-    
-    if ((in != NULL) && (len != 0)) {
-        msg = msg_new(len + LWS_PRE);
-        if (msg != NULL) {
-            memcpy((uint8_t*)msg->data+LWS_PRE, in, len);
-        }
-        else {
-            ///@todo handle some error
-        }
+static void sub_http2_config(struct lws_context_creation_info* info, 
+                            unsigned int streams, size_t window) {
+/// Browsers use HTTP/2 only over TLS, where ALPN offers it ahead of HTTP/1.1.
+/// One connection then carries the page, its resources, and its websockets
+/// (RFC 8441), with one TLS handshake.  There must be enough streams for a 
+/// burst of resource requests while the websockets of the page hold theirs.
+/// Clients that don't do websockets over HTTP/2 open an HTTP/1.1 connection 
+/// for them, which ALPN still allows.  With no streams, only HTTP/1.1 is 
+/// offered.
+#   if defined(LWS_WITH_HTTP2)
+    if (streams == 0) {
+        info->alpn = "http/1.1";
+        return;
     }
+    info->alpn = "h2,http/1.1";
+    
+    // The settings replace all of the lws defaults, when [0] is nonzero
+    info->http2_settings[0]                             = 1;
+    info->http2_settings[H2SET_HEADER_TABLE_SIZE]       = 4096;
+    info->http2_settings[H2SET_ENABLE_PUSH]             = 0;
+    info->http2_settings[H2SET_MAX_CONCURRENT_STREAMS]  = streams;
+    info->http2_settings[H2SET_INITIAL_WINDOW_SIZE]     = (uint32_t)window;
+    info->http2_settings[H2SET_MAX_FRAME_SIZE]          = 16384;
+    info->http2_settings[H2SET_MAX_HEADER_LIST_SIZE]    = 4096;
     
-    return msg;
+#   if defined(LWS_SERVER_OPTION_H2_JUST_FIX_WINDOW_UPDATE_OVERFLOW)
+    // Some browsers send a WINDOW_UPDATE that overflows a large window
+    info->options |= LWS_SERVER_OPTION_H2_JUST_FIX_WINDOW_UPDATE_OVERFLOW;
+#   endif
+#   else
+    if (streams != 0) {
+        lwsl_notice("HTTP/2 is not supported by this build of libwebsockets\n");
+    }
+#   endif
 }
 
 
-
-
 void* frontend_start(void* backend_handle,
                     int logs_mask,
                     bool do_hostcheck,
@@ -296,6 +1132,9 @@ void* frontend_start(void* backend_handle,
     info.port       = port_number;
     info.mounts     = mount;
     info.protocols  = protocols;
+#   if !defined(LWS_WITHOUT_EXTENSIONS)
+    info.extensions = extensions;
+#   endif
     info.vhost_name = hostname;
     info.options    = LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE;
     info.ws_ping_pong_interval = 10;
@@ -307,6 +1146,7 @@ void* frontend_start(void* backend_handle,
     if (do_hostcheck) {
         info.options |= LWS_SERVER_OPTION_VHOST_UPG_STRICT_HOST_CHECK;
     }
+    sub_http2_config(&info, cliopt_geth2streams(), cliopt_geth2window());
 #   if defined(LWS_HAS_RETRYPOLICY)
     ///@note this feature is not in all builds of libwebsockets
     if (do_fastmonitoring) {
@@ -25,6 +25,7 @@
 
 #include <libwebsockets.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
 
 // Local Libraries
@@ -37,6 +38,7 @@
 #include "frontend.h"
 #include "backend.h"
 #include "socklist.h"
+#include "assets.h"
 #include "debug.h"
 
 
@@ -81,10 +83,18 @@ int main(int argc, char* argv[]) {
     struct arg_int  *port    = arg_int0("P","port","number",            "HTTP server port (default 7681)");
     struct arg_lit  *tls     = arg_lit0("s","tls",                      "Use TLS (HTTPS)");
     struct arg_str  *socket  = arg_strn("S","socket","path", 1,255,     "Daemon Socket");
+    struct arg_int  *budget  = arg_int0("B","budget","kB",              "Budget for all queued messages, in kB (default 2048, 0 = unlimited)");
+    struct arg_int  *cache   = arg_int0("C","cache","kB",               "Memory for cached web resources, in kB (default 4096, 0 = off)");
+    struct arg_lit  *preload = arg_lit0(NULL,"preload",                 "Load web resources into the cache at startup");
+    struct arg_int  *maxage  = arg_int0(NULL,"maxage","seconds",        "Browser cache lifetime of web resources (default 0 = revalidate)");
+    struct arg_str  *bundle  = arg_str0(NULL,"bundle","file",           "Serve web resources from a bundle, instead of mount-origin");
+    struct arg_str  *pack    = arg_str0(NULL,"pack","file",             "Pack mount-origin into a bundle, and exit");
+    struct arg_int  *h2streams = arg_int0(NULL,"h2-streams","number",   "Concurrent HTTP/2 streams per connection (default 32, 0 = HTTP/1.1 only)");
+    struct arg_int  *h2window  = arg_int0(NULL,"h2-window","kB",        "HTTP/2 initial flow control window, in kB (default 128)");
     // Terminator
     struct arg_end  *end    = arg_end(20);
     
-    void* argtable[] = { verbose, debug, quiet, help, version, rsrc, urlpath, port, tls, socket, end };
+    void* argtable[] = { verbose, debug, quiet, help, version, rsrc, urlpath, port, tls, socket, budget, cache, preload, maxage, bundle, pack, h2streams, h2window, end };
     const char* progname = WFEDD_PARAM(NAME);
     
     int nerrors;
@@ -100,8 +110,15 @@ int main(int argc, char* argv[]) {
     bool quiet_val      = false;
     char* rsrc_val      = NULL;
     char* urlpath_val   = NULL;
+    char* bundle_val    = NULL;
     int port_val        = 7681;
     bool tls_val        = false;
+    size_t qbudget_val  = WFEDD_PARAM(QBUDGET);
+    size_t cache_val    = (size_t)WFEDD_PARAM(ASSET_CACHE) * 1024;
+    bool preload_val    = false;
+    unsigned int maxage_val = WFEDD_PARAM(ASSET_MAXAGE);
+    unsigned int h2streams_val = WFEDD_PARAM(H2_STREAMS);
+    size_t h2window_val = (size_t)WFEDD_PARAM(H2_WINDOW) * 1024;
 
     socklist_t* socklist= NULL;
 
@@ -133,6 +150,27 @@ int main(int argc, char* argv[]) {
         goto main_FINISH;
     }
 
+    /// special case: '--pack' takes precedence over error reporting, because
+    /// it only needs the resources path
+    if (pack->count > 0) {
+        char* origin;
+        int packed;
+        if (asprintf(&origin, "%s/mount-origin", (rsrc->count > 0) ? rsrc->sval[0] : "./resources") < 0) {
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        packed = assets_pack(origin, pack->sval[0]);
+        if (packed < 0) {
+            printf("Error: could not pack %s into %s (%i)\n", origin, pack->sval[0], packed);
+            exitcode = 1;
+        }
+        else {
+            printf("Packed %i files from %s into %s\n", packed, origin, pack->sval[0]);
+        }
+        free(origin);
+        goto main_FINISH;
+    }
+
     /// If the parser returned any errors then display them and exit
     /// - Display the error details contained in the arg_end struct.
     if (nerrors > 0) {
@@ -181,6 +219,10 @@ int main(int argc, char* argv[]) {
         strcpy(rsrc_val, "./resources");
     }
     
+    if (bundle->count > 0) {
+        FILL_STRINGARG(bundle, bundle_val);
+    }
+    
     if (urlpath->count > 0) {
         ///@todo test that urlpath->sval[0] is valid according to URL path rules
         FILL_STRINGARG(urlpath, urlpath_val);
@@ -203,6 +245,52 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (budget->count > 0) {
+        if (budget->ival[0] < 0) {
+            printf("Error: Supplied budget must not be negative\n");
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        qbudget_val = (size_t)budget->ival[0] * 1024;
+    }
+    
+    if (cache->count > 0) {
+        if (cache->ival[0] < 0) {
+            printf("Error: Supplied cache size must not be negative\n");
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        cache_val = (size_t)cache->ival[0] * 1024;
+    }
+    if (preload->count > 0) {
+        preload_val = true;
+    }
+    if (maxage->count > 0) {
+        if (maxage->ival[0] < 0) {
+            printf("Error: Supplied maxage must not be negative\n");
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        maxage_val = (unsigned int)maxage->ival[0];
+    }
+    if (h2streams->count > 0) {
+        if (h2streams->ival[0] < 0) {
+            printf("Error: Supplied h2-streams must not be negative\n");
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        h2streams_val = (unsigned int)h2streams->ival[0];
+    }
+    if (h2window->count > 0) {
+        // RFC 9113 limits the window to 2^31-1 bytes
+        if ((h2window->ival[0] < 64) || (h2window->ival[0] > (INT_MAX / 1024))) {
+            printf("Error: Supplied h2-window must be between 64 and %i kB\n", INT_MAX / 1024);
+            exitcode = 1;
+            goto main_FINISH;
+        }
+        h2window_val = (size_t)h2window->ival[0] * 1024;
+    }
+
     /// Handle Socket arguments & Construct the socklist
     if (socket->count <= 0) {
         printf("Input must contain socket specification argument.\n");
@@ -215,7 +303,16 @@ int main(int argc, char* argv[]) {
         goto main_FINISH;
     }
     for (int i=0; i<socket->count; i++) {
-        socklist_addmap(socklist, socket->sval[i]);
+        // A malformed mapping is fatal.  A daemon socket that is missing is 
+        // skipped, as the other mappings may still be usable.
+        int addrc = socklist_addmap(socklist, socket->sval[i]);
+        if (addrc == -3) {
+            printf("Error: socket input \"%s\" is not correctly formatted.\n", socket->sval[i]);
+            exitcode = 3;
+        }
+        else if (addrc != 0) {
+            printf("Warning: socket input \"%s\" was not added (%i).\n", socket->sval[i], addrc);
+        }
     }
     
     if (exitcode != 0) {
@@ -228,6 +325,13 @@ int main(int argc, char* argv[]) {
     cliopts.verbose_on  = verbose_val;
     cliopts.debug_on    = debug_val;
     cliopts.quiet_on    = quiet_val;
+    cliopts.qbudget     = qbudget_val;
+    cliopts.assetcache  = cache_val;
+    cliopts.preload_on  = preload_val;
+    cliopts.maxage      = maxage_val;
+    cliopts.bundle      = bundle_val;
+    cliopts.h2streams   = h2streams_val;
+    cliopts.h2window    = h2window_val;
     cliopt_init(&cliopts);
 
     /// All configuration is done.
@@ -253,6 +357,7 @@ int main(int argc, char* argv[]) {
     socklist_deinit(socklist);
     free(rsrc_val);
     free(urlpath_val);
+    free(bundle_val);
 
     return exitcode;
 }
@@ -295,11 +400,11 @@ int wfedd(  const char* rsrcpath,
         .extra_mimetypes        = NULL,
         .interpret              = NULL,
         .cgi_timeout            = 0,
-        .cache_max_age          = 0,
+        .cache_max_age          = 0,                // set later, from --maxage
         .auth_mask              = 0,
-        .cache_reusable         = 0,
-        .cache_revalidate       = 0,
-        .cache_intermediaries   = 0,
+        .cache_reusable         = 1,
+        .cache_revalidate       = 1,
+        .cache_intermediaries   = 1,
         .origin_protocol        = LWSMPRO_FILE,     // files in a dir
         .mountpoint_len         = strlen(urlpath),  // char count
         .basic_auth_login_file  = NULL,
@@ -350,12 +455,12 @@ int wfedd(  const char* rsrcpath,
     ///@todo allocate and write .mountpoint and .origin in wfedd() function
     if (use_tls) {
         cursor = asprintf(&certpath, "%s/localhost-100y.cert", rsrcpath);
-        if (cursor > 0) {
+        if (cursor < 0) {
             exitcode = 1;
             goto wfedd_FINISH;
         }
         cursor = asprintf(&keypath, "%s/localhost-100y.key", rsrcpath);
-        if (cursor > 0) {
+        if (cursor < 0) {
             exitcode = 2;
             goto wfedd_FINISH;
         }
@@ -366,10 +471,38 @@ int wfedd(  const char* rsrcpath,
         goto wfedd_FINISH;
     }
     mount.origin = (const char*)str_mountorigin;
+    mount.cache_max_age = (int)cliopt_getmaxage();
+    
+    /// With the asset cache, the mount is served by the http protocol 
+    /// callback, from memory.  A bundle is served the same way.  If the cache
+    /// can't be opened, lws serves the files, as it does without the cache.
+    if ((cliopt_getassetcache() != 0) || (cliopt_getbundle() != NULL)) {
+        int arc;
+        if (cliopt_getbundle() != NULL) {
+            arc = assets_openbundle(cliopt_getbundle(), cliopt_getmaxage());
+        }
+        else {
+            arc = assets_init(str_mountorigin, cliopt_getassetcache(), cliopt_ispreload(), cliopt_getmaxage());
+        }
+        if (arc == 0) {
+            mount.origin            = protocol_http;
+            mount.origin_protocol   = LWSMPRO_CALLBACK;
+            protocols[0].per_session_data_size = sizeof(struct per_http_data);
+        }
+        else {
+            printf("Warning: asset cache could not be opened, serving from filesystem\n");
+        }
+    }
     
     /// Startup Message: just printed to console and not saved
     printf("Starting wfedd on:\n");
     printf(" * mount:%s/mount-origin\n", rsrcpath);
+    if (assets_isopen() && (cliopt_getbundle() != NULL)) {
+        printf(" * bundle:%s\n", cliopt_getbundle());
+    }
+    else if (assets_isopen()) {
+        printf(" * cache:%zu kB%s\n", cliopt_getassetcache() / 1024, cliopt_ispreload() ? ", preloaded" : "");
+    }
     printf(" * %s://localhost:%i%s\n", use_tls ? "https" : "http", port, urlpath);
     if (use_tls) {
         printf(" * %s\n", certpath);
@@ -397,6 +530,8 @@ int wfedd(  const char* rsrcpath,
                 keypath,
                 protocols,
                 &mount      );
+    
+    assets_deinit();
 
     wfedd_FINISH:
     switch (exitcode) {
@@ -24,68 +24,450 @@
   */
 
 
+#include "wfedd_cfg.h"
 #include "mq.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+
+
+/// Size classes are the payload capacity of a block, which excludes the 
+/// mq_msg_t header.  The larger classes hold the ring storage of queues, and
+/// they are sized so that power-of-two queue capacities fit exactly.
+static const size_t pool_blocksize[] = {
+    64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536
+};
+
+#define POOL_CLASSES    (sizeof(pool_blocksize)/sizeof(size_t))
+#define POOL_HEAP       POOL_CLASSES
+
+/// Classes above this size are queue storage, which is sized per mapping, so 
+/// they are not preallocated.
+#define POOL_PREALLOC_MAX   8192
+
+typedef struct {
+    bool            ready;
+    mq_list_t       freelist[POOL_CLASSES];
+    msgpool_stat_t  stat[POOL_CLASSES+1];
+} msgpool_t;
+
+static msgpool_t pool;
+
+
+
+static int sub_getclass(size_t len) {
+    int i;
+    
+    for (i=0; i<POOL_CLASSES; i++) {
+        if (pool_blocksize[i] >= len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static void sub_count_alloc(msgpool_stat_t* stat, bool hit) {
+    if (hit)    stat->hits++;
+    else        stat->misses++;
+    
+    stat->inuse++;
+    if (stat->inuse > stat->highwater) {
+        stat->highwater = stat->inuse;
+    }
+}
+
+
+
+int msgpool_init(size_t prealloc) {
+    mq_msg_t* msg;
+    int i;
+    
+    if (pool.ready) {
+        return 0;
+    }
+    
+    for (i=0; i<POOL_CLASSES; i++) {
+        STAILQ_INIT(&pool.freelist[i]);
+        pool.stat[i] = (msgpool_stat_t){ .blocksize = pool_blocksize[i] };
+    }
+    pool.stat[POOL_HEAP] = (msgpool_stat_t){ .blocksize = 0 };
+    pool.ready = true;
+    
+    for (i=0; (i<POOL_CLASSES) && (pool_blocksize[i]<=POOL_PREALLOC_MAX); i++) {
+        for (size_t j=0; j<prealloc; j++) {
+            msg = malloc(sizeof(mq_msg_t) + pool_blocksize[i]);
+            if (msg == NULL) {
+                return -1;
+            }
+            msg->pclass = i;
+            msg->alloc  = pool_blocksize[i];
+            STAILQ_INSERT_HEAD(&pool.freelist[i], msg, entries);
+            pool.stat[i].cached++;
+        }
+    }
+    
+    return 0;
+}
+
+
+void msgpool_deinit(void) {
+    mq_msg_t* msg;
+    int i;
+    
+    if (pool.ready) {
+        for (i=0; i<POOL_CLASSES; i++) {
+            while (!STAILQ_EMPTY(&pool.freelist[i])) {
+                msg = STAILQ_FIRST(&pool.freelist[i]);
+                STAILQ_REMOVE_HEAD(&pool.freelist[i], entries);
+                free(msg);
+            }
+            pool.stat[i].cached = 0;
+        }
+        pool.ready = false;
+    }
+}
+
+
+size_t msgpool_getstats(msgpool_stat_t* stats, size_t max) {
+    size_t i;
+    
+    if ((stats == NULL) || !pool.ready) {
+        return 0;
+    }
+    
+    for (i=0; (i<max) && (i<=POOL_HEAP); i++) {
+        stats[i] = pool.stat[i];
+    }
+    return i;
+}
+
 
 
 mq_msg_t* msg_new(size_t len) {
     mq_msg_t* msg = NULL;
+    int pclass;
     
-    msg = malloc(sizeof(mq_msg_t));
-    if (msg != NULL) {
-        msg->size   = len;
-        msg->data   = malloc(len + 0);  // zero data block overhead
-        if (msg->data == NULL) {
-            free(msg);
-            msg = NULL;
+    if (!pool.ready) {
+        msgpool_init(0);
+    }
+    
+    pclass = sub_getclass(len);
+    
+    // Oversize messages bypass the pool: they are rare, and caching them 
+    // would hold onto large blocks indefinitely.
+    if (pclass < 0) {
+        msg = malloc(sizeof(mq_msg_t) + len);
+        if (msg != NULL) {
+            msg->pclass = -1;
+            msg->alloc  = len;
+            sub_count_alloc(&pool.stat[POOL_HEAP], false);
+        }
+    }
+    else if (!STAILQ_EMPTY(&pool.freelist[pclass])) {
+        msg = STAILQ_FIRST(&pool.freelist[pclass]);
+        STAILQ_REMOVE_HEAD(&pool.freelist[pclass], entries);
+        pool.stat[pclass].cached--;
+        sub_count_alloc(&pool.stat[pclass], true);
+    }
+    else {
+        msg = malloc(sizeof(mq_msg_t) + pool_blocksize[pclass]);
+        if (msg != NULL) {
+            msg->pclass = pclass;
+            msg->alloc  = pool_blocksize[pclass];
+            sub_count_alloc(&pool.stat[pclass], false);
         }
     }
     
+    if (msg != NULL) {
+        msg->size = len;
+        msg->refs = 1;
+    }
+    
     return msg;
 }
 
 
-void msg_free(mq_msg_t* msg) {
+mq_msg_t* msg_ref(mq_msg_t* msg) {
     if (msg != NULL) {
-        free(msg->data);
-        free(msg);
+        msg->refs++;
+    }
+    return msg;
+}
+
+
+void msg_free(mq_msg_t* msg) {
+    if ((msg != NULL) && (--msg->refs == 0)) {
+        if (msg->pclass < 0) {
+            pool.stat[POOL_HEAP].inuse--;
+            free(msg);
+        }
+        else {
+            pool.stat[msg->pclass].inuse--;
+            
+            // Blocks are retained up to a limit, which bounds the memory that
+            // a burst of traffic can leave behind on the free lists.
+            if (pool.ready && (pool.stat[msg->pclass].cached < WFEDD_PARAM(MSGPOOL_RETAIN))) {
+                STAILQ_INSERT_HEAD(&pool.freelist[msg->pclass], msg, entries);
+                pool.stat[msg->pclass].cached++;
+            }
+            else {
+                free(msg);
+            }
+        }
+    }
+}
+
+
+/// Each record begins with a header, and records are aligned to the header.
+/// The header stores the payload length.  The payload follows the headroom.
+typedef struct {
+    uint32_t    len;
+    uint32_t    flags;
+} mq_rechdr_t;
+
+#define MQ_ALIGN(X)     (((X) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1))
+
+static inline size_t sub_recsize(mq_t* mq, size_t len) {
+    return MQ_ALIGN(sizeof(mq_rechdr_t) + mq->headroom + len);
+}
+
+
+/// Returns the offset where a record of recsize bytes would be placed, or -1
+/// if there's no room.  The ring is reset to the origin whenever it's empty,
+/// which maximizes the contiguous space available.
+static long sub_place(mq_t* mq, size_t recsize, bool* wrap) {
+    *wrap = false;
+    
+    if (mq->count == 0) {
+        return (recsize <= mq->size) ? 0 : -1;
+    }
+    if (mq->wrapped) {
+        return (recsize <= (mq->head - mq->tail)) ? (long)mq->tail : -1;
+    }
+    if (recsize <= (mq->size - mq->tail)) {
+        return (long)mq->tail;
+    }
+    if (recsize <= mq->head) {
+        *wrap = true;
+        return 0;
     }
+    return -1;
 }
 
 
-void mq_init(mq_t* mq) {
-    STAILQ_INIT(mq);
+
+int mq_init(mq_t* mq, size_t size, size_t headroom) {
+    assert(mq);
+    
+    mq->store = msg_new(size);
+    if (mq->store == NULL) {
+        return -1;
+    }
+    mq->base        = mq->store->data;
+    mq->size        = size;
+    mq->headroom    = MQ_ALIGN(headroom);
+    mq->head        = 0;
+    mq->tail        = 0;
+    mq->end         = 0;
+    mq->wrapped     = false;
+    mq->count       = 0;
+    mq->bytes       = 0;
+    mq->resv        = -1;
+    mq->resv_wrap   = false;
+    mq->hoff        = 0;
+    return 0;
+}
+
+
+void mq_deinit(mq_t* mq) {
+    if (mq != NULL) {
+        msg_free(mq->store);
+        mq->store   = NULL;
+        mq->base    = NULL;
+        mq->size    = 0;
+        mq->count   = 0;
+        mq->bytes   = 0;
+        mq->hoff    = 0;
+    }
 }
 
 
 bool mq_isempty(mq_t* mq) {
-    return (bool)STAILQ_EMPTY(mq);
+    return (bool)(mq->count == 0);
 }
 
 
-mq_msg_t* mq_getmsg(mq_t* mq) {
-    mq_msg_t* msg;
+bool mq_hasroom(mq_t* mq, size_t len) {
+    bool wrap;
+    assert(mq);
+    return (bool)(sub_place(mq, sub_recsize(mq, len), &wrap) >= 0);
+}
+
+
+void* mq_reserve(mq_t* mq, size_t len) {
+    long offset;
     assert(mq);
     
-    if (!STAILQ_EMPTY(mq)) {
-        msg = STAILQ_FIRST(mq);
-        STAILQ_REMOVE_HEAD(mq, entries);
+    offset = sub_place(mq, sub_recsize(mq, len), &mq->resv_wrap);
+    if (offset < 0) {
+        return NULL;
     }
-    else {
-        msg = NULL;
+    
+    mq->resv = offset;
+    return &mq->base[offset + sizeof(mq_rechdr_t) + mq->headroom];
+}
+
+
+static void sub_commit(mq_t* mq, size_t len, uint32_t flags) {
+    mq_rechdr_t* hdr;
+    assert(mq);
+    
+    if (mq->resv < 0) {
+        return;
+    }
+    if (len == 0) {
+        mq->resv = -1;
+        return;
     }
     
-    return msg;
+    if (mq->count == 0) {
+        mq->head    = 0;
+        mq->wrapped = false;
+    }
+    else if (mq->resv_wrap) {
+        mq->end     = mq->tail;
+        mq->wrapped = true;
+    }
+    
+    hdr         = (mq_rechdr_t*)&mq->base[mq->resv];
+    hdr->len    = (uint32_t)len;
+    hdr->flags  = flags;
+    
+    mq->tail    = (size_t)mq->resv + sub_recsize(mq, len);
+    mq->count  += 1;
+    mq->bytes  += len;
+    mq->resv    = -1;
 }
 
 
-void mq_putmsg(mq_t* mq, mq_msg_t* msg) {
+void mq_commit(mq_t* mq, size_t len) {
+    sub_commit(mq, len, 0);
+}
+
+
+int mq_putmsg_flags(mq_t* mq, const void* data, size_t len, uint32_t flags) {
+    void* payload;
     assert(mq);
-    assert(msg);
-    STAILQ_INSERT_TAIL(mq, msg, entries);
+    assert(data);
+    
+    payload = mq_reserve(mq, len);
+    if (payload == NULL) {
+        return -1;
+    }
+    memcpy(payload, data, len);
+    sub_commit(mq, len, flags);
+    return 0;
+}
+
+
+int mq_putmsg(mq_t* mq, const void* data, size_t len) {
+    return mq_putmsg_flags(mq, data, len, 0);
+}
+
+
+void* mq_peek(mq_t* mq, size_t* len) {
+    mq_rechdr_t* hdr;
+    assert(mq);
+    
+    if (mq->count == 0) {
+        return NULL;
+    }
+    
+    hdr = (mq_rechdr_t*)&mq->base[mq->head];
+    if (len != NULL) {
+        *len = hdr->len - mq->hoff;
+    }
+    return (uint8_t*)hdr + sizeof(mq_rechdr_t) + mq->headroom + mq->hoff;
+}
+
+
+uint32_t mq_peekflags(mq_t* mq) {
+    assert(mq);
+    
+    if (mq->count == 0) {
+        return 0;
+    }
+    return ((mq_rechdr_t*)&mq->base[mq->head])->flags;
+}
+
+
+void mq_pop(mq_t* mq) {
+    mq_rechdr_t* hdr;
+    assert(mq);
+    
+    if (mq->count == 0) {
+        return;
+    }
+    
+    hdr         = (mq_rechdr_t*)&mq->base[mq->head];
+    mq->bytes  -= hdr->len - mq->hoff;
+    mq->head   += sub_recsize(mq, hdr->len);
+    mq->count  -= 1;
+    mq->hoff    = 0;
+    
+    if (mq->wrapped && (mq->head >= mq->end)) {
+        mq->head    = 0;
+        mq->wrapped = false;
+    }
+    if (mq->count == 0) {
+        mq->head    = 0;
+        mq->tail    = 0;
+        mq->wrapped = false;
+    }
+}
+
+
+
+size_t mq_peekv(mq_t* mq, struct iovec* iov, size_t max) {
+    mq_rechdr_t* hdr;
+    size_t offset;
+    size_t skip;
+    size_t i;
+    assert(mq);
+    
+    offset  = mq->head;
+    skip    = mq->hoff;
+    for (i=0; (i<max) && (i<mq->count); i++) {
+        hdr                 = (mq_rechdr_t*)&mq->base[offset];
+        iov[i].iov_base     = (uint8_t*)hdr + sizeof(mq_rechdr_t) + mq->headroom + skip;
+        iov[i].iov_len      = hdr->len - skip;
+        skip                = 0;
+        offset             += sub_recsize(mq, hdr->len);
+        if (mq->wrapped && (offset >= mq->end)) {
+            offset = 0;
+        }
+    }
+    return i;
+}
+
+
+void mq_consume(mq_t* mq, size_t len) {
+    size_t avail;
+    assert(mq);
+    
+    while ((len != 0) && (mq->count != 0)) {
+        avail = ((mq_rechdr_t*)&mq->base[mq->head])->len - mq->hoff;
+        if (len < avail) {
+            mq->hoff   += len;
+            mq->bytes  -= len;
+            break;
+        }
+        len -= avail;
+        mq_pop(mq);
+    }
 }
 
 
@@ -100,37 +482,122 @@ int main(void) {
     int rnumber;
     int trials = 1000;
     uint8_t testdata[128];
+    uint8_t* payload;
+    size_t len;
+    unsigned int seq_in  = 0;
+    unsigned int seq_out = 0;
     int i;
     mq_t q;
     mq_msg_t* msg;
+    msgpool_stat_t stats[16];
+    size_t nstats;
     
     srand((unsigned int)time(NULL));
     
-printf("%s %i\n", __FUNCTION__, __LINE__);
-    mq_init(&q);
-printf("%s %i\n", __FUNCTION__, __LINE__);
+    msgpool_init(4);
+    assert(mq_init(&q, 4096, 16) == 0);
     
     while (--trials > 0) {
+        // Messages from the pool
         rnumber = (rand() % 100) + 1;
-printf("%s %i\n", __FUNCTION__, __LINE__);
         for (i=rnumber; i>0; i--) {
-printf("%s %i\n", __FUNCTION__, __LINE__);
-            msg = msg_new(128);
-printf("%s %i\n", __FUNCTION__, __LINE__);
-            memcpy(msg->data, testdata, 128);
-            
-            mq_putmsg(&q, msg);
-        }
-printf("%s %i\n", __FUNCTION__, __LINE__);
-        for (i=rnumber; i>0; i--) {
-            msg = msg_new(128);
-            mq_getmsg(&q);
-printf("%s %i\n", __FUNCTION__, __LINE__);
+            len = (size_t)(rand() % sizeof(testdata)) + 1;
+            msg = msg_new(len);
+            assert(msg != NULL);
+            assert(msg->alloc >= len);
+            memcpy(msg->data, testdata, len);
+            if (i & 1) {
+                // A shared message is freed with its last reference
+                assert(msg_ref(msg) == msg);
+                msg_free(msg);
+                assert(msg->refs == 1);
+            }
             msg_free(msg);
-printf("%s %i\n", __FUNCTION__, __LINE__);
         }
+    
+        // Records in the ring: fill until full, then drain a random amount.
+        // Every record carries a sequence number to check FIFO order.
+        for (;;) {
+            len = (size_t)(rand() % (sizeof(testdata) - sizeof(unsigned int))) + sizeof(unsigned int);
+            if (!mq_hasroom(&q, len)) {
+                assert(mq_putmsg(&q, testdata, len) != 0);
+                break;
+            }
+            memcpy(testdata, &seq_in, sizeof(unsigned int));
+            if (seq_in & 1) {
+                assert(mq_putmsg_flags(&q, testdata, len, seq_in) == 0);
+            }
+            else {
+                // Reserve the maximum, and commit only what was "read"
+                payload = mq_reserve(&q, len + 16);
+                if (payload == NULL) {
+                    break;
+                }
+                memcpy(payload, testdata, len);
+                mq_commit(&q, len);
+            }
+            seq_in++;
+        }
+        if (trials & 1) {
+            // A record that was partly consumed has no sequence number left
+            if (q.hoff != 0) {
+                mq_pop(&q);
+                seq_out++;
+            }
+            rnumber = (q.count != 0) ? (rand() % (int)q.count) + 1 : 0;
+            for (i=rnumber; i>0; i--) {
+                unsigned int seq;
+                payload = mq_peek(&q, &len);
+                assert(payload != NULL);
+                memcpy(&seq, payload, sizeof(unsigned int));
+                assert(seq == seq_out);
+                assert(mq_peekflags(&q) == ((seq & 1) ? seq : 0));
+                memset(payload-16, 0xFF, 16);
+                mq_pop(&q);
+                seq_out++;
+            }
+        }
+        else {
+            // Gather the oldest records, as for writev(), and consume a 
+            // random number of bytes, which may end within a record.
+            struct iovec iov[8];
+            size_t n;
+            size_t total = 0;
+            size_t bytes = q.bytes;
+            size_t count = q.count;
+            
+            n = mq_peekv(&q, iov, 8);
+            assert(n == ((q.count < 8) ? q.count : 8));
+            for (i=0; i<n; i++) {
+                if ((i != 0) || (q.hoff == 0)) {
+                    unsigned int seq;
+                    memcpy(&seq, iov[i].iov_base, sizeof(unsigned int));
+                    assert(seq == seq_out + i);
+                }
+                total += iov[i].iov_len;
+            }
+            len = (size_t)(rand() % total) + 1;
+            mq_consume(&q, len);
+            assert(q.bytes == bytes - len);
+            seq_out += (unsigned int)(count - q.count);
+        }
+    }
+    
+    while (!mq_isempty(&q)) {
+        mq_pop(&q);
+    }
+    assert(q.bytes == 0);
+    mq_deinit(&q);
+    
+    nstats = msgpool_getstats(stats, 16);
+    for (i=0; i<nstats; i++) {
+        printf("block=%zu hits=%lu misses=%lu inuse=%lu highwater=%lu cached=%lu\n",
+                stats[i].blocksize, stats[i].hits, stats[i].misses, 
+                stats[i].inuse, stats[i].highwater, stats[i].cached);
+        assert(stats[i].inuse == 0);
     }
     
+    msgpool_deinit();
     return 0;
 }
 
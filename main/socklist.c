@@ -32,6 +32,8 @@
 #include "debug.h"
 #include "socklist.h"
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -102,11 +104,182 @@ int sub_testsocket(const char* sockpath, int socktype) {
 
 
 
+/// Options that may be appended to a mapping string.  Each one sets a field
+/// of the sockmap_t, and is range-checked.  An option with a list of names 
+/// takes one of the names as its value, and sets an int field to its index.
+/// A string option sets a char array field of strsize bytes.
+typedef struct {
+    const char* name;
+    size_t      offset;
+    size_t      min;
+    size_t      max;
+    const char* const* names;
+    size_t      strsize;
+} mapopt_t;
+
+static const char* const framing_names[] = {
+    "raw", "newline", "nul", "len16", "len32", "seqpacket", "mux", NULL
+};
+
+static const char* const payload_names[] = {
+    "text", "binary", "auto", NULL
+};
+
+static const char* const slow_names[] = {
+    "block", "dropold", "dropnew", "close", NULL
+};
+
+static const char* const conflate_names[] = {
+    "off", "prefix", "json", NULL
+};
+
+static const char* const onoff_names[] = {
+    "off", "on", NULL
+};
+
+static const mapopt_t mapopts[] = {
+    { "framing",    offsetof(sockmap_t, framing),    0, 0, framing_names },
+    { "payload",    offsetof(sockmap_t, payload),    0, 0, payload_names },
+    { "stream",     offsetof(sockmap_t, stream),     0, 0, onoff_names },
+    { "deflate",    offsetof(sockmap_t, deflate),    0, 0, onoff_names },
+    { "deflatenoctx", offsetof(sockmap_t, znoctx),   0, 0, onoff_names },
+    { "fanout",     offsetof(sockmap_t, fanout),     0, 0, onoff_names },
+    { "slowpolicy", offsetof(sockmap_t, slowpolicy), 0, 0, slow_names },
+    { "conflate",   offsetof(sockmap_t, conflate),   0, 0, conflate_names },
+    { "conflatekey", offsetof(sockmap_t, conflatekey), 0, 0, NULL, WFEDD_PARAM(CONFLATE_KEYLEN) },
+    { "deflatemin", offsetof(sockmap_t, zmin),       0,                      WFEDD_PARAM(QUEUE_MAX) },
+    { "deflatewbits", offsetof(sockmap_t, zwbits),   9,                      15 },
+    { "deflatemem", offsetof(sockmap_t, zmem),       1,                      9 },
+    { "msgmax",     offsetof(sockmap_t, msgmax),     64,                     (WFEDD_PARAM(QUEUE_MAX)/2) },
+    { "ctimeout",   offsetof(sockmap_t, ctimeout),   1,                      (3600*1000) },
+    { "coalesce",   offsetof(sockmap_t, coalesce),   0,                      (1024*1024) },
+    { "linger",     offsetof(sockmap_t, linger),     0,                      (1000*1000) },
+    { "pagesize",   offsetof(sockmap_t, pagesize),   64,                     (1024*1024) },
+    { "pagemax",    offsetof(sockmap_t, pagemax),    64,                     (WFEDD_PARAM(QUEUE_MAX)/2) },
+    { "webqueue",   offsetof(sockmap_t, webqueue),   WFEDD_PARAM(QUEUE_MIN), WFEDD_PARAM(QUEUE_MAX) },
+    { "localqueue", offsetof(sockmap_t, localqueue), WFEDD_PARAM(QUEUE_MIN), WFEDD_PARAM(QUEUE_MAX) },
+    { "budget",     offsetof(sockmap_t, budget),     0,                      (1024*1024*1024) },
+    { "poolmin",    offsetof(sockmap_t, poolmin),    0,                      WFEDD_PARAM(POOL_MAX) },
+    { "poolmax",    offsetof(sockmap_t, poolmax),    0,                      WFEDD_PARAM(POOL_MAX) },
+    { "slowmark",   offsetof(sockmap_t, slowmark),   0,                      WFEDD_PARAM(QUEUE_MAX) },
+    { "conflatelen", offsetof(sockmap_t, conflatelen), 1,                    256 },
+    { "conflatekeys", offsetof(sockmap_t, conflatekeys), 1,                  65536 },
+    { "rxrate",     offsetof(sockmap_t, rxrate),     0,                      (1000*1000) },
+    { "rxbytes",    offsetof(sockmap_t, rxbytes),    0,                      (1024*1024*1024) },
+    { "maprxrate",  offsetof(sockmap_t, maprxrate),  0,                      (1000*1000) },
+    { "maprxbytes", offsetof(sockmap_t, maprxbytes), 0,                      (1024*1024*1024) },
+};
+
+
+
+static int sub_parsesize(size_t* size, const char* str, const char* str_end) {
+    char* endptr;
+    unsigned long val;
+    
+    val = strtoul(str, &endptr, 10);
+    if (endptr == str) {
+        return -1;
+    }
+    if (endptr < str_end) {
+        switch (*endptr++) {
+            case 'k':
+            case 'K':   val *= 1024; break;
+            case 'm':
+            case 'M':   val *= 1024*1024; break;
+            default:    return -1;
+        }
+    }
+    if (endptr != str_end) {
+        return -1;
+    }
+    
+    *size = (size_t)val;
+    return 0;
+}
+
+
+
+static int sub_parseopts(sockmap_t* map, const char* optstr) {
+    const char* key;
+    const char* key_end;
+    const char* val_end;
+    size_t val;
+    int i;
+    
+    for (key=optstr; *key != 0; key=val_end) {
+        while (*key == ',') {
+            key++;
+        }
+        if (*key == 0) {
+            break;
+        }
+        val_end = strchr(key, ',');
+        if (val_end == NULL) {
+            val_end = strchr(key, 0);
+        }
+        key_end = memchr(key, '=', val_end - key);
+        if (key_end == NULL) {
+            return -1;
+        }
+        
+        for (i=0; i<(sizeof(mapopts)/sizeof(mapopt_t)); i++) {
+            if ((strlen(mapopts[i].name) == (key_end - key)) 
+            &&  (strncmp(mapopts[i].name, key, key_end - key) == 0)) {
+                break;
+            }
+        }
+        if (i >= (sizeof(mapopts)/sizeof(mapopt_t))) {
+            printf("Error: unknown socket option \"%.*s\"\n", (int)(key_end-key), key);
+            return -1;
+        }
+        if (mapopts[i].names != NULL) {
+            int j;
+            for (j=0; mapopts[i].names[j] != NULL; j++) {
+                if ((strlen(mapopts[i].names[j]) == (val_end - key_end - 1))
+                &&  (strncmp(mapopts[i].names[j], key_end+1, val_end - key_end - 1) == 0)) {
+                    break;
+                }
+            }
+            if (mapopts[i].names[j] == NULL) {
+                printf("Error: socket option \"%s\" has unknown value \"%.*s\"\n", 
+                            mapopts[i].name, (int)(val_end - key_end - 1), key_end+1);
+                return -1;
+            }
+            *(int*)((uint8_t*)map + mapopts[i].offset) = j;
+            continue;
+        }
+        if (mapopts[i].strsize != 0) {
+            if ((size_t)(val_end - key_end - 1) >= mapopts[i].strsize) {
+                printf("Error: socket option \"%s\" is longer than %zu characters\n", 
+                            mapopts[i].name, mapopts[i].strsize - 1);
+                return -1;
+            }
+            memcpy((uint8_t*)map + mapopts[i].offset, key_end+1, val_end - key_end - 1);
+            ((char*)map + mapopts[i].offset)[val_end - key_end - 1] = 0;
+            continue;
+        }
+        if ((sub_parsesize(&val, key_end+1, val_end) != 0)
+        ||  (val < mapopts[i].min) || (val > mapopts[i].max)) {
+            printf("Error: socket option \"%s\" must be in range %zu-%zu\n", 
+                        mapopts[i].name, mapopts[i].min, mapopts[i].max);
+            return -1;
+        }
+        *(size_t*)((uint8_t*)map + mapopts[i].offset) = val;
+    }
+    
+    return 0;
+}
+
+
+
+
 int socklist_addmap(socklist_t* socklist, const char* mapstr) {
     const char* ds;
     const char* ds_end;
     const char* ws;
     const char* ws_end;
+    const char* opts;
+    sockmap_t newmap;
     int ds_size;
     int ws_size;
     char* dspath;
@@ -124,15 +297,22 @@ int socklist_addmap(socklist_t* socklist, const char* mapstr) {
     }
     
     /// 2. The format of the mapstr is shown below, with a ':' separator.
-    ///    local-socket-path:websocket-path
+    ///    local-socket-path:websocket-path[:options]
     ds      = mapstr;
     ds_end  = strchr(mapstr, ':');
-    ws      = ds_end + 1;
-    ws_end  = strchr(ws, 0);
-    if ((ds == NULL) || (ds_end == NULL) || (ws == NULL) || (ws_end == NULL)) {
+    if (ds_end == NULL) {
         //printf("Error: socket input \"%s\" is not correctly formatted.\n", mapstr);
         return -3;
     }
+    ws      = ds_end + 1;
+    ws_end  = strchr(ws, ':');
+    if (ws_end == NULL) {
+        ws_end  = strchr(ws, 0);
+        opts    = ws_end;
+    }
+    else {
+        opts    = ws_end + 1;
+    }
     
     /// 3. Create proper strings for ds and ws.
     ds_size = (int)(ds_end - ds);
@@ -158,7 +338,154 @@ int socklist_addmap(socklist_t* socklist, const char* mapstr) {
         goto socklist_addmap_TERM;
     }
     
-    /// 4. Do insertion based on the name of the websocket.
+    /// 4. Apply default parameters, then any options from the mapstr.
+    newmap.pagesize     = WFEDD_PARAM(PAGESIZE);
+    newmap.pagemax      = WFEDD_PARAM(PAGEMAX);
+    newmap.webqueue     = WFEDD_PARAM(WEBQUEUE_SIZE);
+    newmap.localqueue   = WFEDD_PARAM(LOCALQUEUE_SIZE);
+    newmap.budget       = 0;
+    newmap.framing      = FRAMING_RAW;
+    newmap.payload      = PAYLOAD_TEXT;
+    newmap.stream       = 0;
+    newmap.deflate      = 0;
+    newmap.zmin         = SIZE_MAX;             // set below, by deflatenoctx
+    newmap.zwbits       = WFEDD_PARAM(DEFLATE_WBITS);
+    newmap.zmem         = WFEDD_PARAM(DEFLATE_MEMLEVEL);
+    newmap.znoctx       = 0;
+    newmap.fanout       = 0;
+    newmap.poolmin      = 0;
+    newmap.poolmax      = 0;
+    newmap.slowpolicy   = SLOW_BLOCK;
+    newmap.slowmark     = 0;
+    newmap.conflate     = CONFLATE_OFF;
+    newmap.conflatelen  = 8;
+    newmap.conflatekeys = WFEDD_PARAM(CONFLATE_KEYS);
+    newmap.conflatekey[0] = 0;
+    newmap.rxrate       = 0;
+    newmap.rxbytes      = 0;
+    newmap.maprxrate    = 0;
+    newmap.maprxbytes   = 0;
+    newmap.msgmax       = 0;
+    newmap.ctimeout     = WFEDD_PARAM(CONNECT_TIMEOUT);
+    newmap.coalesce     = 0;
+    newmap.linger       = WFEDD_PARAM(COALESCE_LINGER);
+    newmap.l_type       = SOCK_STREAM;
+    newmap.l_socket     = dspath;
+    newmap.websocket    = wspath;
+    if (sub_parseopts(&newmap, opts) != 0) {
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // A read must always fit in an empty web queue, so reads are capped at
+    // half of it.  The initial read size is within the cap.
+    if (newmap.pagemax > (newmap.webqueue / 2)) {
+        newmap.pagemax = newmap.webqueue / 2;
+    }
+    if (newmap.pagesize > newmap.pagemax) {
+        newmap.pagesize = newmap.pagemax;
+    }
+    
+    // A framed message must also fit in an empty web queue.  SEQPACKET 
+    // framing needs a socket of that type.
+    if ((newmap.msgmax == 0) || (newmap.msgmax > (newmap.webqueue / 2))) {
+        newmap.msgmax = newmap.webqueue / 2;
+    }
+    if (newmap.framing == FRAMING_SEQPACKET) {
+        newmap.l_type = SOCK_SEQPACKET;
+    }
+    
+    // Coalesced messages are joined in one frame, so the browser can only 
+    // split them again if they are delimited.
+    if ((newmap.coalesce != 0) && (newmap.framing != FRAMING_RAW)
+    &&  (newmap.framing != FRAMING_NEWLINE) && (newmap.framing != FRAMING_NUL)) {
+        printf("Error: socket option \"coalesce\" needs raw, newline, or nul framing\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // Streaming splits a message by its framing, and its fragments are sent
+    // alone, so they can't be coalesced.  A mux fragment would lose its
+    // channel, so mux messages aren't streamed either.
+    if ((newmap.stream != 0) && ((newmap.framing == FRAMING_RAW) 
+    ||  (newmap.framing == FRAMING_SEQPACKET) || (newmap.framing == FRAMING_MUX)
+    ||  (newmap.coalesce != 0))) {
+        printf("Error: socket option \"stream\" needs newline, nul, len16, or len32 framing, without coalesce\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // Fan-out messages are shared by all sessions, and they are referenced in
+    // place, so they can't be packed into per-session frames.
+    if ((newmap.fanout != 0) && ((newmap.coalesce != 0) || (newmap.framing == FRAMING_MUX))) {
+        printf("Error: socket option \"fanout\" can't be combined with coalesce or mux framing\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // The compression level of a session is fixed when its deflate stream 
+    // starts, so messages can only be sent stored by size when the stream
+    // restarts with each message.
+    if (newmap.zmin == SIZE_MAX) {
+        newmap.zmin = (newmap.znoctx != 0) ? WFEDD_PARAM(DEFLATE_MIN) : 0;
+    }
+    else if ((newmap.zmin != 0) && (newmap.znoctx == 0)) {
+        printf("Error: socket option \"deflatemin\" needs deflatenoctx=on\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // The pool holds at least poolmin.  It is for sessions that each have a
+    // daemon connection, so a shared connection has none.
+    if (newmap.poolmax < newmap.poolmin) {
+        newmap.poolmax = newmap.poolmin;
+    }
+    if ((newmap.poolmax != 0) && ((newmap.fanout != 0) || (newmap.framing == FRAMING_MUX))) {
+        printf("Error: socket options \"poolmin\" and \"poolmax\" can't be combined with fanout or mux framing\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // The high-water mark defaults to the whole web queue, and it must hold a
+    // full read.  The queue of a fan-out subscriber or a conflating session
+    // holds references, so its mark is its depth, and it can't be set.  
+    // Dropping messages would cut a streamed message, so streaming needs the
+    // block policy.
+    if ((newmap.slowmark != 0) && ((newmap.fanout != 0) || (newmap.conflate != CONFLATE_OFF))) {
+        printf("Error: socket option \"slowmark\" can't be combined with fanout or conflate\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    if ((newmap.slowmark == 0) || (newmap.slowmark > newmap.webqueue)) {
+        newmap.slowmark = newmap.webqueue;
+    }
+    if (newmap.slowmark < newmap.pagemax) {
+        printf("Error: socket option \"slowmark\" must be at least pagemax (%zu)\n", newmap.pagemax);
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    if ((newmap.stream != 0) && (newmap.slowpolicy != SLOW_BLOCK)) {
+        printf("Error: socket option \"stream\" needs slowpolicy=block\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    // Conflation replaces whole messages in the queue of a session, so they
+    // must be delimited or prefixed, and they can't be packed or fragmented.
+    if ((newmap.conflate != CONFLATE_OFF) && ((newmap.framing == FRAMING_RAW) 
+    ||  (newmap.framing == FRAMING_SEQPACKET) || (newmap.framing == FRAMING_MUX)
+    ||  (newmap.coalesce != 0) || (newmap.stream != 0))) {
+        printf("Error: socket option \"conflate\" needs newline, nul, len16, or len32 framing, without coalesce or stream\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    if ((newmap.conflate == CONFLATE_JSON) && (newmap.conflatekey[0] == 0)) {
+        printf("Error: socket option \"conflate=json\" needs conflatekey\n");
+        rc = -3;
+        goto socklist_addmap_TERM;
+    }
+    
+    /// 5. Do insertion based on the name of the websocket.
     ///    Only one instance per websocket name is allowed.
     for (i=0; i<socklist->size; i++) {
         int cmp = strcmp(wspath, socklist->map[i].websocket);
@@ -174,11 +501,7 @@ int socklist_addmap(socklist_t* socklist, const char* mapstr) {
         }
     }
     
-    ///@todo the 1024,0 elements should come from somewhere.
-    socklist->map[i].pagesize   = 1024;
-    socklist->map[i].l_type     = 0;
-    socklist->map[i].l_socket   = dspath;
-    socklist->map[i].websocket  = wspath;
+    socklist->map[i] = newmap;
     socklist->size++;
     return 0;
     
@@ -215,7 +538,7 @@ int socklist_newclient(sockmap_t** newclient, socklist_t* socklist, const char*
     // Create a client socket of the resolved type.
     ///@todo Right now we only support UNIX sockets.
     DEBUG_PRINTF("%s : socket passed test\n", __FUNCTION__);
-    newfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    newfd = socket(AF_UNIX, clisock->l_type, 0);
     if (newfd < 0) {
         goto socklist_newclient_EXIT;
     }
@@ -0,0 +1,180 @@
+/*  Copyright 2020, JP Norair
+  *
+  * Redistribution and use in source and binary forms, with or without 
+  * modification, are permitted provided that the following conditions are met:
+  *
+  * 1. Redistributions of source code must retain the above copyright notice, 
+  *    this list of conditions and the following disclaimer.
+  *
+  * 2. Redistributions in binary form must reproduce the above copyright 
+  *    notice, this list of conditions and the following disclaimer in the 
+  *    documentation and/or other materials provided with the distribution.
+  *
+  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+  * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+  * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+  * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+  * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+  * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+  * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+  * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+  * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+  * POSSIBILITY OF SUCH DAMAGE.
+  */
+
+#include "wfedd_cfg.h"
+#include "utf8.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#   include <arm_neon.h>
+#endif
+
+
+
+static size_t sub_asciispan(const uint8_t* s, size_t len) {
+/// Returns the length of the leading run of ASCII bytes.  Daemon output is 
+/// mostly ASCII, so this is where the time goes.
+    size_t i = 0;
+    
+#   if defined(__SSE2__)
+    for (; (i+16) <= len; i+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&s[i]);
+        if (_mm_movemask_epi8(v) != 0) {
+            break;
+        }
+    }
+#   elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; (i+16) <= len; i+=16) {
+        if ((vmaxvq_u8(vld1q_u8(&s[i])) & 0x80) != 0) {
+            break;
+        }
+    }
+#   endif
+    for (; (i+8) <= len; i+=8) {
+        uint64_t w;
+        memcpy(&w, &s[i], 8);
+        if ((w & 0x8080808080808080ULL) != 0) {
+            break;
+        }
+    }
+    while ((i < len) && (s[i] < 0x80)) {
+        i++;
+    }
+    return i;
+}
+
+
+
+bool utf8_isvalid(const void* data, size_t len) {
+/// Between runs of ASCII, each sequence is checked by its lead byte, which 
+/// gives the number of continuation bytes and the range of the first one.
+/// The ranges exclude overlongs (E0, F0), surrogates (ED), and > U+10FFFF (F4).
+    const uint8_t* s = data;
+    size_t i = 0;
+    
+    while (i < len) {
+        uint8_t lo = 0x80;
+        uint8_t hi = 0xBF;
+        size_t n;
+        
+        i += sub_asciispan(&s[i], len - i);
+        if (i >= len) {
+            break;
+        }
+        
+        if (s[i] < 0xC2) {
+            return false;
+        }
+        else if (s[i] < 0xE0) {
+            n = 1;
+        }
+        else if (s[i] < 0xF0) {
+            n   = 2;
+            lo  = (s[i] == 0xE0) ? 0xA0 : 0x80;
+            hi  = (s[i] == 0xED) ? 0x9F : 0xBF;
+        }
+        else if (s[i] < 0xF5) {
+            n   = 3;
+            lo  = (s[i] == 0xF0) ? 0x90 : 0x80;
+            hi  = (s[i] == 0xF4) ? 0x8F : 0xBF;
+        }
+        else {
+            return false;
+        }
+        
+        if ((len - i) <= n) {
+            return false;
+        }
+        if ((s[i+1] < lo) || (s[i+1] > hi)) {
+            return false;
+        }
+        for (size_t k=2; k<=n; k++) {
+            if ((s[i+k] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        i += n + 1;
+    }
+    
+    return true;
+}
+
+
+
+#ifdef UTF8TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+int main(void) {
+    static const struct {
+        const char* str;
+        bool        valid;
+    } vectors[] = {
+        { "", true },
+        { "plain ascii, long enough to take the vector path: 0123456789", true },
+        { "caf\xC3\xA9", true },
+        { "\xE2\x82\xAC euro", true },
+        { "\xF0\x9F\x98\x80 emoji", true },
+        { "\xF4\x8F\xBF\xBF", true },                   // U+10FFFF
+        { "\xED\x9F\xBF", true },                       // U+D7FF
+        { "\xC0\xAF", false },                          // overlong
+        { "\xE0\x80\xAF", false },                      // overlong
+        { "\xF0\x80\x80\xAF", false },                  // overlong
+        { "\xED\xA0\x80", false },                      // surrogate
+        { "\xF4\x90\x80\x80", false },                  // > U+10FFFF
+        { "\xF5\x80\x80\x80", false },
+        { "\x80", false },                              // lone continuation
+        { "0123456789abcdef0123456789abcdef\xC3", false },  // truncated
+        { "\xE2\x82", false },
+        { "\xE2\x28\xA1", false },
+        { "0123456789abcdef\xFF", false },
+    };
+    uint8_t buf[256];
+    size_t i;
+    
+    for (i=0; i<(sizeof(vectors)/sizeof(vectors[0])); i++) {
+        size_t len = strlen(vectors[i].str);
+        assert(utf8_isvalid(vectors[i].str, len) == vectors[i].valid);
+        
+        // Every alignment and trailing ASCII give the same result
+        for (size_t off=0; off<16; off++) {
+            memset(buf, 'a', sizeof(buf));
+            memcpy(&buf[off], vectors[i].str, len);
+            assert(utf8_isvalid(&buf[off], len) == vectors[i].valid);
+            if (vectors[i].valid) {
+                assert(utf8_isvalid(buf, off + len + 40));
+            }
+        }
+    }
+    
+    printf("utf8: %zu vectors passed\n", i);
+    return 0;
+}
+
+#endif